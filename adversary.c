@@ -0,0 +1,215 @@
+// adversary - search for the rects an engine answers most slowly and save them as a reusable query file.
+//
+// usage: adversary [options] <dataset> <engine.dll> <out.trace>
+//   -nRESTARTS   hill climbs to run (default 1000)
+//   -iSTEPS      mutations tried per climb (default 200)
+//   -cCOUNT      count for every query (default 20)
+//   -rREPEATS    runs per measurement, the fastest is kept (default 3)
+//   -kTOP        slowest rects to print (default 20)
+//   -sSEED       random seed (default 1)
+//
+// Each climb starts from a random rect (mixed size, thin slab or tiny) and keeps any mutation that measures no more than
+// NOISE faster: resizing either side, moving, or small steps in size that find thresholds. The slowest rect seen on each
+// climb is re-measured and written, slowest first, in the trace format so replay and inspect -t can reuse it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tools.h"
+#include "trace.h"
+
+#define NOISE 0.05  // fraction of a measurement treated as timer noise
+
+struct Candidate {
+	Rect rect;
+	int32_t hits;
+	double ns;
+};
+
+uint64_t state;
+float ew, eh;
+Rect bounds;
+
+// fastest of "repeats" runs of one search
+double measure(Engine* e, SearchContext* sc, Rect* rect, int count, int repeats, Point* out, int32_t* hits) {
+	double best = 1e300;
+	for (int r = 0; r < repeats; r++) {
+		double t = nowNs();
+		*hits = e->search(sc, *rect, count, out);
+		double dt = nowNs() - t;
+		if (dt < best) best = dt;
+	}
+	return best;
+}
+
+void randomRect(Rect* r) {
+	float w, h;
+	switch (nextRandom(&state) % 4) {
+		case 0:  // mixed sizes
+			w = ew * powf(10, -randomFloat(&state, 0, 4));
+			h = eh * powf(10, -randomFloat(&state, 0, 4));
+			break;
+		case 1:  // x slab
+			w = ew * powf(10, -randomFloat(&state, 2, 5));
+			h = eh * randomFloat(&state, 0.1f, 1);
+			break;
+		case 2:  // y slab
+			w = ew * randomFloat(&state, 0.1f, 1);
+			h = eh * powf(10, -randomFloat(&state, 2, 5));
+			break;
+		default:  // tiny
+			w = ew * powf(10, -randomFloat(&state, 4, 6));
+			h = eh * powf(10, -randomFloat(&state, 4, 6));
+			break;
+	}
+	r->lx = randomFloat(&state, bounds.lx, bounds.hx - w);
+	r->ly = randomFloat(&state, bounds.ly, bounds.hy - h);
+	r->hx = r->lx + w;
+	r->hy = r->ly + h;
+}
+
+void mutateRect(Rect* from, Rect* to) {
+	float w = from->hx - from->lx;
+	float h = from->hy - from->ly;
+	float cx = (from->lx + from->hx) / 2;
+	float cy = (from->ly + from->hy) / 2;
+	switch (nextRandom(&state) % 5) {
+		case 0: w *= powf(2, randomFloat(&state, -1, 1)); break;
+		case 1: h *= powf(2, randomFloat(&state, -1, 1)); break;
+		case 2: {
+			float s = powf(2, randomFloat(&state, -0.5f, 0.5f));
+			w *= s;
+			h *= s;
+			break;
+		}
+		case 3:
+			cx += w * randomFloat(&state, -1, 1);
+			cy += h * randomFloat(&state, -1, 1);
+			break;
+		default:
+			// small steps in size, for thresholds that sit between two counts
+			w *= randomFloat(&state, 0.95f, 1.05f);
+			h *= randomFloat(&state, 0.95f, 1.05f);
+			break;
+	}
+	w = w > ew ? ew : (w < ew * 1e-7f ? ew * 1e-7f : w);
+	h = h > eh ? eh : (h < eh * 1e-7f ? eh * 1e-7f : h);
+	cx = cx < bounds.lx ? bounds.lx : (cx > bounds.hx ? bounds.hx : cx);
+	cy = cy < bounds.ly ? bounds.ly : (cy > bounds.hy ? bounds.hy : cy);
+	to->lx = cx - w / 2;
+	to->hx = cx + w / 2;
+	to->ly = cy - h / 2;
+	to->hy = cy + h / 2;
+}
+
+int main(int argc, char** argv) {
+	int restarts = 1000, steps = 200, count = 20, repeats = 3, ntop = 20;
+	uint64_t seed = 1;
+	const char* args[3];
+	int nargs = 0;
+
+	for (int i = 1; i < argc; i++) {
+		char* a = argv[i];
+		if (a[0] != '-') {
+			if (nargs < 3) args[nargs++] = a;
+			continue;
+		}
+		switch (a[1]) {
+			case 'n': restarts = atoi(&a[2]); break;
+			case 'i': steps = atoi(&a[2]); break;
+			case 'c': count = atoi(&a[2]); break;
+			case 'r': repeats = atoi(&a[2]); break;
+			case 'k': ntop = atoi(&a[2]); break;
+			case 's': seed = strtoull(&a[2], NULL, 10); break;
+		}
+	}
+	if (nargs < 3 || restarts < 1 || count < 1) {
+		printf("usage: adversary [-nRESTARTS] [-iSTEPS] [-cCOUNT] [-rREPEATS] [-kTOP] [-sSEED] <dataset> <engine.dll> <out.trace>\n");
+		return 1;
+	}
+	if (repeats < 1) repeats = 1;
+
+	int64_t N;
+	Point* points = loadDataset(args[0], &N);
+	if (!points || N == 0) {
+		printf("Can't read dataset %s\n", args[0]);
+		return 1;
+	}
+	Engine engine;
+	if (!loadEngine(&engine, args[1])) {
+		printf("Can't load engine %s\n", args[1]);
+		return 1;
+	}
+
+	pointBounds(points, N, &bounds);
+	ew = bounds.hx - bounds.lx;
+	eh = bounds.hy - bounds.ly;
+	state = seed * 2654435761u + 3;
+
+	SearchContext* sc = engine.create(points, points + N);
+	Point* out = (Point*)malloc(count * sizeof(Point));
+	Candidate* best = (Candidate*)malloc(restarts * sizeof(Candidate));
+	double* starts = (double*)malloc(restarts * sizeof(double));
+
+	double t = nowNs();
+	for (int k = 0; k < restarts; k++) {
+		Candidate cur;
+		randomRect(&cur.rect);
+		cur.ns = measure(&engine, sc, &cur.rect, count, repeats, out, &cur.hits);
+		starts[k] = cur.ns;
+
+		// moves within the noise are kept too, so a climb can cross plateaus like the empty rects
+		Candidate top = cur;
+		for (int s = 0; s < steps; s++) {
+			Candidate next;
+			mutateRect(&cur.rect, &next.rect);
+			next.ns = measure(&engine, sc, &next.rect, count, repeats, out, &next.hits);
+			if (next.ns > cur.ns * (1 - NOISE)) cur = next;
+			if (cur.ns > top.ns) top = cur;
+		}
+
+		// a climb's best is partly luck, so rank it on a fresh measurement
+		top.ns = measure(&engine, sc, &top.rect, count, 3 * repeats, out, &top.hits);
+		best[k] = top;
+	}
+	double ms = (nowNs() - t) / 1e6;
+
+	#define slower(a,b) ((a)->ns > (b)->ns)
+	QSORT(Candidate, best, restarts, slower);
+
+	TraceWriter* w = traceOpen(args[2], N, &bounds);
+	if (!w) {
+		printf("Can't write %s\n", args[2]);
+		return 1;
+	}
+	for (int k = 0; k < restarts; k++) traceAppend(w, &best[k].rect, count, best[k].hits, -1, 0);
+	traceClose(w);
+
+	// how much worse the climbs got than where they started
+	double* found = (double*)malloc(restarts * sizeof(double));
+	for (int k = 0; k < restarts; k++) found[k] = best[k].ns;
+	sortDoubles(starts, restarts);
+	sortDoubles(found, restarts);
+	printf("%d climbs of %d steps in %.0f ms on %s\n", restarts, steps, ms, engine.name);
+	printf("  %-14s %9s %9s %9s   (ns)\n", "", "p50", "p90", "max");
+	printf("  %-14s %9.0f %9.0f %9.0f\n", "random starts", percentile(starts, restarts, 0.5), percentile(starts, restarts, 0.9), percentile(starts, restarts, 1.0));
+	printf("  %-14s %9.0f %9.0f %9.0f\n", "after climbing", percentile(found, restarts, 0.5), percentile(found, restarts, 0.9), percentile(found, restarts, 1.0));
+
+	printf("\nSlowest %d rects:\n", ntop);
+	printf("  %10s %12s %12s %12s %12s %12s %12s %6s\n", "ns", "lx", "ly", "hx", "hy", "w/extent", "h/extent", "hits");
+	for (int k = 0; k < ntop && k < restarts; k++) {
+		Rect* r = &best[k].rect;
+		printf("  %10.0f %12.6f %12.6f %12.6f %12.6f %12.3g %12.3g %6d\n", best[k].ns, r->lx, r->ly, r->hx, r->hy,
+			(r->hx - r->lx) / ew, (r->hy - r->ly) / eh, best[k].hits
+		);
+	}
+
+	engine.destroy(sc);
+	unloadEngine(&engine);
+	free(found);
+	free(starts);
+	free(best);
+	free(out);
+	free(points);
+	return 0;
+}
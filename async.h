@@ -0,0 +1,48 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "gumptionaire.h"
+
+/* C++20 coroutine front end for search_async: "int32_t hits = co_await searchAsync(sc, rect, count, out);" suspends
+the coroutine until a worker has answered the query. The coroutine resumes on that worker's thread with the number of
+points copied to "out", or ASYNC_REJECTED if the queue was full, or ASYNC_CANCELLED if the context was destroyed first.
+A coroutine that must continue on an event loop should post itself back to the loop when it resumes. */
+
+#if defined(__cplusplus) && __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+
+struct SearchAwaitable {
+	SearchContext* sc;
+	Rect rect;
+	int32_t count;
+	Point* out;
+	int32_t hits;
+	std::coroutine_handle<> handle;
+
+	bool await_ready() { return false; }
+
+	// once search_async has the query, a worker may resume (and end) the coroutine before this returns, so nothing
+	// here may touch *this after it
+	bool await_suspend(std::coroutine_handle<> h) {
+		handle = h;
+		if (search_async(sc, rect, count, out, resume, this) != 0) return true;
+		hits = ASYNC_REJECTED;
+		return false;
+	}
+
+	int32_t await_resume() { return hits; }
+
+	static void __stdcall resume(void* user, int32_t hits) {
+		SearchAwaitable* a = (SearchAwaitable*)user;
+		a->hits = hits;
+		a->handle.resume();
+	}
+};
+
+inline SearchAwaitable searchAsync(SearchContext* sc, Rect rect, int32_t count, Point* out) {
+	return SearchAwaitable{ sc, rect, count, out, 0, nullptr };
+}
+
+#endif
+
+#endif
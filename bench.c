@@ -0,0 +1,600 @@
+// bench - run every engine and a brute-force oracle over a fixed set of workloads and compare them side by side.
+//
+// usage: bench [options] <engine.dll> [engine.dll ...]
+//   -pPOINTS     points per dataset (default 1000000)
+//   -qQUERIES    queries per query set (default 1000)
+//   -rREPEATS    runs of each query, the fastest is kept (default 3)
+//   -tPERCENT    latency regression that fails the run (default 25)
+//   -bFILE       compare p50/p99 against the results saved in FILE
+//   -wFILE       save the results to FILE for a later -b
+//
+// Workloads are every combination of the uniform, clustered and duplicates datasets from tools.h, the query sets
+// below and counts 1, 20 and 1000. Each engine's answers are checked against brute force. Exit code is 1 if any
+// answer differs from the oracle or any latency regressed more than PERCENT (and NOISEFLOOR) against the baseline.
+//
+// Engines that export the extensions of gumptionaire.h also have count, exists, search_below, search_union,
+// search_ids, search_async, search_parallel and publish_shared / attach_shared checked against brute force, on the
+// first EXTQUERIES queries of the mixed set. An extension the engine doesn't export, or can't run on this platform, is
+// shown as n/a.
+//
+// Each build line also shows how much of the index landed on huge pages and the data TLB misses per query, where the
+// platform has a counter for them. Run with GUMPTIONAIRE_HUGEPAGES=0 for the same engine on normal pages.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tools.h"
+#include "gumptionaire.h"
+
+#define NDATASETS 3
+#define NCOUNTS 3
+#define MAXCOUNT 1000
+#define NOISEFLOOR 200   // ns, smaller latency changes are never reported as regressions
+#define MAXBASELINE 4096
+#define EXTQUERIES 100   // mixed queries the extensions are checked on
+#define EXTCOUNT 20      // count the extensions are checked at
+#define EXTRECTS 3       // rects per search_union query
+
+typedef int64_t (__stdcall* T_stats)(SearchContext* sc, IndexStats* out);
+typedef int32_t (__stdcall* T_count)(SearchContext* sc, const Rect rect);
+typedef int32_t (__stdcall* T_search_below)(SearchContext* sc, const Rect rect, const int32_t max_rank, Point* out_points, const int32_t capacity, T_chunk chunk, void* user);
+typedef int32_t (__stdcall* T_search_union)(SearchContext* sc, const Rect* rects, const int32_t nrects, const int32_t count, Point* out_points);
+typedef int32_t (__stdcall* T_search_ids)(SearchContext* sc, const Rect rect, const IdMask* ids, const int32_t count, Point* out_points);
+typedef int64_t (__stdcall* T_search_async)(SearchContext* sc, const Rect rect, const int32_t count, Point* out_points, T_done done, void* user);
+typedef int32_t (__stdcall* T_search_parallel)(SearchContext* sc, const Rect* rects, const int32_t nrects, const int32_t count, Point* out_points, int32_t* out_counts, const int32_t nthreads);
+typedef int32_t (__stdcall* T_publish_shared)(SearchContext* sc, const char* name);
+typedef SearchContext* (__stdcall* T_attach_shared)(const char* name);
+typedef void (__stdcall* T_unpublish_shared)(const char* name);
+
+enum QuerySet {
+	QUERY_MIXED,  // log-uniform sizes, from tools.h
+	QUERY_XSLAB,  // thin in x, most of the extent in y
+	QUERY_YSLAB,  // thin in y, most of the extent in x
+	QUERY_EMPTY,  // outside the bounds of the points
+	QUERY_FULL,   // the whole extent or more
+	NQUERYSETS
+};
+
+const char* datasetNames[NDATASETS] = {"uniform", "clustered", "duplicates"};
+const char* querySetNames[NQUERYSETS] = {"mixed", "xslab", "yslab", "empty", "full"};
+const int counts[NCOUNTS] = {1, 20, MAXCOUNT};
+
+struct Result {
+	double p50, p99, max;
+	int64_t mismatches;
+};
+
+struct Baseline {
+	char key[256];
+	double p50, p99;
+};
+
+// brute-force answers to the mixed queries: the top MAXCOUNT of each, and how many points each holds
+struct Oracle {
+	const Rect* rects;
+	int64_t n;
+	const Point* top;
+	const int32_t* tophits;
+	int64_t* inside;
+};
+
+// the points search_below passes to its chunk callback
+struct BelowSink {
+	Point* points;
+	int32_t n;
+	int32_t capacity;
+};
+
+// the search_async queries still running
+struct AsyncWait {
+	ThreadLock lock;
+	ThreadCond cond;
+	int64_t pending;
+};
+
+// one search_async query: the slot its hits go to
+struct AsyncSlot {
+	AsyncWait* wait;
+	int32_t hits;
+};
+
+// QUERY SETS -------------------------------------------------------------------------------------
+
+Rect* generateQuerySet(int set, int64_t n, const Rect* b, uint64_t seed) {
+	if (set == QUERY_MIXED) return generateQueries(n, b, seed);
+
+	uint64_t state = seed * 2654435761u + 11;
+	float ew = b->hx - b->lx;
+	float eh = b->hy - b->ly;
+	Rect* rects = (Rect*)malloc((n > 0 ? n : 1) * sizeof(Rect));
+	for (int64_t i = 0; i < n; i++) {
+		Rect* r = &rects[i];
+		float w, h;
+		switch (set) {
+			case QUERY_XSLAB:
+				w = ew * powf(10, -randomFloat(&state, 2, 4));
+				h = eh * randomFloat(&state, 0.5f, 1);
+				r->lx = randomFloat(&state, b->lx, b->hx - w);
+				r->ly = randomFloat(&state, b->ly, b->hy - h);
+				r->hx = r->lx + w;
+				r->hy = r->ly + h;
+				break;
+			case QUERY_YSLAB:
+				w = ew * randomFloat(&state, 0.5f, 1);
+				h = eh * powf(10, -randomFloat(&state, 2, 4));
+				r->lx = randomFloat(&state, b->lx, b->hx - w);
+				r->ly = randomFloat(&state, b->ly, b->hy - h);
+				r->hx = r->lx + w;
+				r->hy = r->ly + h;
+				break;
+			case QUERY_EMPTY:
+				// past one side of the bounds, spanning anything up to the full extent of the other axis
+				w = ew * randomFloat(&state, 0.001f, 1);
+				h = eh * randomFloat(&state, 0.001f, 1);
+				r->lx = randomFloat(&state, b->lx, b->hx);
+				r->ly = randomFloat(&state, b->ly, b->hy);
+				switch (i & 3) {
+					case 0: r->lx = b->hx + w * 0.01f + 1e-6f; break;
+					case 1: r->lx = b->lx - w * 1.01f - 1e-6f; break;
+					case 2: r->ly = b->hy + h * 0.01f + 1e-6f; break;
+					case 3: r->ly = b->ly - h * 1.01f - 1e-6f; break;
+				}
+				r->hx = r->lx + w;
+				r->hy = r->ly + h;
+				break;
+			case QUERY_FULL:
+				// the exact bounds, or the bounds grown by up to their size
+				w = (i & 1) ? ew * randomFloat(&state, 0, 1) : 0;
+				h = (i & 1) ? eh * randomFloat(&state, 0, 1) : 0;
+				r->lx = b->lx - w;
+				r->ly = b->ly - h;
+				r->hx = b->hx + w;
+				r->hy = b->hy + h;
+				break;
+		}
+	}
+	return rects;
+}
+
+// BASELINES --------------------------------------------------------------------------------------
+
+const char* baseName(const char* path) {
+	const char* s = path;
+	for (const char* c = path; *c; c++) if (*c == '/' || *c == '\\') s = c + 1;
+	return s;
+}
+
+void resultKey(char* key, const char* engine, int d, int q, int c) {
+	snprintf(key, 256, "%s,%s,%s,%d", baseName(engine), datasetNames[d], querySetNames[q], counts[c]);
+}
+
+int readBaseline(const char* path, Baseline* base) {
+	FILE* f = fopen(path, "r");
+	if (!f) return -1;
+	int n = 0;
+	char line[256];
+	while (n < MAXBASELINE && fgets(line, sizeof(line), f)) {
+		// key is everything before the last two fields
+		char* p99 = strrchr(line, ',');
+		if (!p99) continue;
+		*p99 = 0;
+		char* p50 = strrchr(line, ',');
+		if (!p50) continue;
+		*p50 = 0;
+		snprintf(base[n].key, sizeof(base[n].key), "%s", line);
+		base[n].p50 = atof(p50 + 1);
+		base[n].p99 = atof(p99 + 1);
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+Baseline* findBaseline(Baseline* base, int n, const char* key) {
+	for (int i = 0; i < n; i++) if (strcmp(base[i].key, key) == 0) return &base[i];
+	return NULL;
+}
+
+bool regressed(double now, double then, double thresh) {
+	return now > then * (1 + thresh) && now - then > NOISEFLOOR;
+}
+
+// EXTENSIONS -------------------------------------------------------------------------------------
+
+// true if "out" holds the ranks of "expect"
+bool sameRanks(const Point* out, int32_t hits, const Point* expect, int32_t nexpect) {
+	if (hits != nexpect) return false;
+	for (int32_t k = 0; k < hits; k++) if (out[k].rank != expect[k].rank) return false;
+	return true;
+}
+
+// the oracle's answer to query i at "count", which is a prefix of its top MAXCOUNT
+int32_t oracleHits(const Oracle* o, int64_t i, int32_t count) {
+	return o->tophits[i] < count ? o->tophits[i] : count;
+}
+
+void sortByRank(Point* points, unsigned n) {
+	#define bench_rank_lt(a,b) ((a)->rank < (b)->rank)
+	QSORT(Point, points, n, bench_rank_lt);
+}
+
+// count and exists
+int64_t checkCount(Engine* e, SearchContext* sc, const Oracle* o, bool exists) {
+	T_count fn = (T_count)engineSymbol(e, exists ? "exists" : "count");
+	if (!fn) return -1;
+	int64_t wrong = 0;
+	for (int64_t i = 0; i < o->n; i++) {
+		int64_t expect = exists ? (o->inside[i] > 0) : o->inside[i];
+		if (fn(sc, o->rects[i]) != expect) wrong++;
+	}
+	return wrong;
+}
+
+void __stdcall belowChunk(void* user, const Point* points, int32_t n) {
+	BelowSink* s = (BelowSink*)user;
+	for (int32_t k = 0; k < n && s->n < s->capacity; k++) s->points[s->n++] = points[k];
+}
+
+// search_below, up to the rank of the EXTCOUNT-th hit, through a buffer small enough that chunk is called several times
+int64_t checkBelow(Engine* e, SearchContext* sc, const Oracle* o) {
+	T_search_below fn = (T_search_below)engineSymbol(e, "search_below");
+	if (!fn) return -1;
+	Point buf[8];
+	Point found[MAXCOUNT];
+	int64_t wrong = 0;
+	for (int64_t i = 0; i < o->n; i++) {
+		const Point* top = &o->top[i * MAXCOUNT];
+		int32_t expect = oracleHits(o, i, EXTCOUNT);
+		int32_t max_rank = (o->tophits[i] > expect) ? top[expect].rank : INT32_MAX;
+
+		BelowSink sink = { found, 0, MAXCOUNT };
+		int32_t hits = fn(sc, o->rects[i], max_rank, buf, 8, belowChunk, &sink);
+		sortByRank(found, sink.n);
+		if (hits != sink.n || !sameRanks(found, sink.n, top, expect)) wrong++;
+	}
+	return wrong;
+}
+
+// search_union of EXTRECTS consecutive rects. The top EXTCOUNT of the union is among the top EXTCOUNT of each rect, so
+// it comes from merging their oracle answers
+int64_t checkUnion(Engine* e, SearchContext* sc, const Oracle* o) {
+	T_search_union fn = (T_search_union)engineSymbol(e, "search_union");
+	if (!fn) return -1;
+	Point out[EXTCOUNT];
+	Point expect[EXTRECTS * EXTCOUNT];
+	int64_t wrong = 0;
+	for (int64_t i = 0; i + EXTRECTS <= o->n; i++) {
+		int32_t n = 0;
+		for (int r = 0; r < EXTRECTS; r++) {
+			int32_t hits = oracleHits(o, i + r, EXTCOUNT);
+			for (int32_t k = 0; k < hits; k++) expect[n++] = o->top[(i + r) * MAXCOUNT + k];
+		}
+		sortByRank(expect, n);
+		int32_t m = 0;
+		for (int32_t k = 0; k < n && m < EXTCOUNT; k++) {
+			if (m == 0 || expect[k].rank != expect[m - 1].rank) expect[m++] = expect[k];
+		}
+
+		int32_t hits = fn(sc, &o->rects[i], EXTRECTS, EXTCOUNT, out);
+		if (!sameRanks(out, hits, expect, m)) wrong++;
+	}
+	return wrong;
+}
+
+// search_ids with the odd ids. Checked where the oracle's top MAXCOUNT settles the answer
+int64_t checkIds(Engine* e, SearchContext* sc, const Oracle* o) {
+	T_search_ids fn = (T_search_ids)engineSymbol(e, "search_ids");
+	if (!fn) return -1;
+	IdMask ids;
+	for (int w = 0; w < 4; w++) ids.bits[w] = 0xAAAAAAAAAAAAAAAAull;
+	Point out[EXTCOUNT];
+	Point expect[EXTCOUNT];
+	int64_t wrong = 0;
+	for (int64_t i = 0; i < o->n; i++) {
+		int32_t n = 0;
+		for (int32_t k = 0; k < o->tophits[i] && n < EXTCOUNT; k++) {
+			const Point* p = &o->top[i * MAXCOUNT + k];
+			if ((uint8_t)p->id & 1) expect[n++] = *p;
+		}
+		if (n < EXTCOUNT && o->tophits[i] == MAXCOUNT) continue;
+
+		int32_t hits = fn(sc, o->rects[i], &ids, EXTCOUNT, out);
+		if (!sameRanks(out, hits, expect, n)) wrong++;
+	}
+	return wrong;
+}
+
+void __stdcall asyncDone(void* user, int32_t hits) {
+	AsyncSlot* slot = (AsyncSlot*)user;
+	AsyncWait* w = slot->wait;
+	lockAcquire(&w->lock);
+	slot->hits = hits;
+	w->pending--;
+	condSignal(&w->cond);
+	lockRelease(&w->lock);
+}
+
+// search_async, every query queued before any is waited for. A query turned away is queued again once the ones ahead
+// of it finish
+int64_t checkAsync(Engine* e, SearchContext* sc, const Oracle* o) {
+	T_search_async fn = (T_search_async)engineSymbol(e, "search_async");
+	if (!fn) return -1;
+	Point* out = (Point*)malloc(o->n * EXTCOUNT * sizeof(Point));
+	AsyncSlot* slots = (AsyncSlot*)malloc(o->n * sizeof(AsyncSlot));
+	AsyncWait w;
+	lockInit(&w.lock);
+	condInit(&w.cond);
+	w.pending = 0;
+
+	bool supported = true;
+	for (int64_t i = 0; i < o->n && supported; i++) {
+		slots[i].wait = &w;
+		lockAcquire(&w.lock);
+		w.pending++;
+		lockRelease(&w.lock);
+		int64_t ticket;
+		while ((ticket = fn(sc, o->rects[i], EXTCOUNT, &out[i * EXTCOUNT], asyncDone, &slots[i])) == 0) {
+			lockAcquire(&w.lock);
+			bool idle = w.pending == 1;
+			if (!idle) condWait(&w.cond, &w.lock);
+			lockRelease(&w.lock);
+			if (idle) break;
+		}
+
+		// turned away again with nothing ahead of it, so the engine turns every query away
+		if (ticket == 0) supported = fn(sc, o->rects[i], EXTCOUNT, &out[i * EXTCOUNT], asyncDone, &slots[i]) != 0;
+	}
+
+	lockAcquire(&w.lock);
+	if (!supported) w.pending--;
+	while (w.pending > 0) condWait(&w.cond, &w.lock);
+	lockRelease(&w.lock);
+
+	int64_t wrong = 0;
+	for (int64_t i = 0; i < o->n && supported; i++) {
+		if (!sameRanks(&out[i * EXTCOUNT], slots[i].hits, &o->top[i * MAXCOUNT], oracleHits(o, i, EXTCOUNT))) wrong++;
+	}
+	condFree(&w.cond);
+	lockFree(&w.lock);
+	free(slots);
+	free(out);
+	return supported ? wrong : -1;
+}
+
+// search_parallel on one thread per CPU
+int64_t checkParallel(Engine* e, SearchContext* sc, const Oracle* o) {
+	T_search_parallel fn = (T_search_parallel)engineSymbol(e, "search_parallel");
+	if (!fn) return -1;
+	Point* out = (Point*)malloc(o->n * EXTCOUNT * sizeof(Point));
+	int32_t* counts = (int32_t*)malloc(o->n * sizeof(int32_t));
+	fn(sc, o->rects, (int32_t)o->n, EXTCOUNT, out, counts, 0);
+
+	int64_t wrong = 0;
+	for (int64_t i = 0; i < o->n; i++) {
+		if (!sameRanks(&out[i * EXTCOUNT], counts[i], &o->top[i * MAXCOUNT], oracleHits(o, i, EXTCOUNT))) wrong++;
+	}
+	free(counts);
+	free(out);
+	return wrong;
+}
+
+// publish_shared, then search a context from attach_shared
+int64_t checkShared(Engine* e, SearchContext* sc, const Oracle* o) {
+	T_publish_shared publish = (T_publish_shared)engineSymbol(e, "publish_shared");
+	T_attach_shared attach = (T_attach_shared)engineSymbol(e, "attach_shared");
+	T_unpublish_shared unpublish = (T_unpublish_shared)engineSymbol(e, "unpublish_shared");
+	if (!publish || !attach || !unpublish) return -1;
+
+	char name[64];
+	snprintf(name, sizeof(name), "bench%lld", (long long)nowNs());
+	if (publish(sc, name) < 0) return -1;
+	SearchContext* shared = attach(name);
+	int64_t wrong = shared ? 0 : o->n;
+	Point out[EXTCOUNT];
+	for (int64_t i = 0; i < o->n && shared; i++) {
+		int32_t hits = e->search(shared, o->rects[i], EXTCOUNT, out);
+		if (!sameRanks(out, hits, &o->top[i * MAXCOUNT], oracleHits(o, i, EXTCOUNT))) wrong++;
+	}
+	if (shared) e->destroy(shared);
+	unpublish(name);
+	return wrong;
+}
+
+// check every extension the engine exports, print a line with the outcome of each and return the answers that differ
+int64_t checkExtensions(Engine* e, SearchContext* sc, const Oracle* o) {
+	const char* names[] = {"count", "exists", "below", "union", "ids", "async", "parallel", "shared"};
+	int64_t wrong[] = {
+		checkCount(e, sc, o, false), checkCount(e, sc, o, true), checkBelow(e, sc, o), checkUnion(e, sc, o),
+		checkIds(e, sc, o), checkAsync(e, sc, o), checkParallel(e, sc, o), checkShared(e, sc, o)
+	};
+	int64_t total = 0;
+	printf("  %-24s", "");
+	for (int k = 0; k < (int)(sizeof(wrong) / sizeof(wrong[0])); k++) {
+		if (wrong[k] < 0) printf("  %s n/a", names[k]);
+		else if (wrong[k] == 0) printf("  %s ok", names[k]);
+		else printf("  %s %lld WRONG", names[k], (long long)wrong[k]);
+		if (wrong[k] > 0) total += wrong[k];
+	}
+	printf("\n");
+	return total;
+}
+
+// BENCHMARK --------------------------------------------------------------------------------------
+
+void measure(Engine* e, SearchContext* sc, Rect* rects, int64_t n, int count, int repeats, Point* oracle, int32_t* oraclehits, Point* out, double* ns, Result* res) {
+	res->mismatches = 0;
+	for (int64_t i = 0; i < n; i++) ns[i] = 1e300;
+	for (int r = 0; r < repeats; r++) {
+		for (int64_t i = 0; i < n; i++) {
+			double t = nowNs();
+			int32_t hits = e->search(sc, rects[i], count, out);
+			double dt = nowNs() - t;
+			if (dt < ns[i]) ns[i] = dt;
+			if (r > 0) continue;
+
+			// the oracle holds the top MAXCOUNT, so every smaller count is a prefix of it
+			int32_t expect = oraclehits[i] < count ? oraclehits[i] : count;
+			bool ok = hits == expect;
+			for (int k = 0; ok && k < hits; k++) ok = out[k].rank == oracle[i * MAXCOUNT + k].rank;
+			if (!ok) res->mismatches++;
+		}
+	}
+	sortDoubles(ns, n);
+	res->p50 = percentile(ns, n, 0.5);
+	res->p99 = percentile(ns, n, 0.99);
+	res->max = percentile(ns, n, 1.0);
+}
+
+int main(int argc, char** argv) {
+	int64_t N = 1000000, nqueries = 1000;
+	int repeats = 3;
+	double thresh = 0.25;
+	const char* basepath = NULL;
+	const char* savepath = NULL;
+	int nengines = 0;
+	const char** enginePaths = (const char**)malloc(argc * sizeof(char*));
+
+	for (int i = 1; i < argc; i++) {
+		char* a = argv[i];
+		if (a[0] != '-') { enginePaths[nengines++] = a; continue; }
+		switch (a[1]) {
+			case 'p': N = strtoll(&a[2], NULL, 10); break;
+			case 'q': nqueries = strtoll(&a[2], NULL, 10); break;
+			case 'r': repeats = atoi(&a[2]); break;
+			case 't': thresh = atof(&a[2]) / 100; break;
+			case 'b': basepath = &a[2]; break;
+			case 'w': savepath = &a[2]; break;
+		}
+	}
+	if (nengines == 0 || N < 1 || nqueries < 1) {
+		printf("usage: bench [-pPOINTS] [-qQUERIES] [-rREPEATS] [-tPERCENT] [-bFILE] [-wFILE] <engine.dll> [engine.dll ...]\n");
+		return 1;
+	}
+	if (repeats < 1) repeats = 1;
+
+	Engine* engines = (Engine*)malloc(nengines * sizeof(Engine));
+	for (int e = 0; e < nengines; e++) {
+		if (!loadEngine(&engines[e], enginePaths[e])) {
+			printf("Can't load engine %s\n", enginePaths[e]);
+			return 1;
+		}
+	}
+
+	Baseline* base = (Baseline*)malloc(MAXBASELINE * sizeof(Baseline));
+	int nbase = 0;
+	if (basepath && (nbase = readBaseline(basepath, base)) < 0) {
+		printf("Can't read baseline %s\n", basepath);
+		return 1;
+	}
+	FILE* save = savepath ? fopen(savepath, "w") : NULL;
+
+	Rect** rects = (Rect**)malloc(NQUERYSETS * sizeof(Rect*));
+	Point** oracle = (Point**)malloc(NQUERYSETS * sizeof(Point*));
+	int32_t** oraclehits = (int32_t**)malloc(NQUERYSETS * sizeof(int32_t*));
+	Point* out = (Point*)malloc(MAXCOUNT * sizeof(Point));
+	double* ns = (double*)malloc(nqueries * sizeof(double));
+	Result* results = (Result*)malloc(nengines * NQUERYSETS * NCOUNTS * sizeof(Result));
+	int64_t* inside = (int64_t*)malloc(EXTQUERIES * sizeof(int64_t));
+	int64_t mismatches = 0, regressions = 0;
+
+	int tlb = tlbCounterOpen();
+	printf("%lld points per dataset, %lld queries per set, %d repeats, latencies in ns\n", (long long)N, (long long)nqueries, repeats);
+	for (int d = 0; d < NDATASETS; d++) {
+		Point* points = generatePoints(datasetNames[d], N, d + 1);
+		Rect bounds;
+		pointBounds(points, N, &bounds);
+
+		// oracle answers at the largest count
+		double t = nowNs();
+		for (int q = 0; q < NQUERYSETS; q++) {
+			rects[q] = generateQuerySet(q, nqueries, &bounds, d * NQUERYSETS + q + 1);
+			oracle[q] = (Point*)malloc(nqueries * MAXCOUNT * sizeof(Point));
+			oraclehits[q] = (int32_t*)malloc(nqueries * sizeof(int32_t));
+			for (int64_t i = 0; i < nqueries; i++) {
+				oraclehits[q][i] = bruteForce(points, N, &rects[q][i], MAXCOUNT, &oracle[q][i * MAXCOUNT]);
+			}
+		}
+		double oraclens = (nowNs() - t) / (NQUERYSETS * nqueries);
+
+		// the extensions are checked on the first mixed queries, count against the number of points in each
+		Oracle ext = { rects[QUERY_MIXED], nqueries < EXTQUERIES ? nqueries : EXTQUERIES, oracle[QUERY_MIXED], oraclehits[QUERY_MIXED],
+			inside
+		};
+		for (int64_t i = 0; i < ext.n; i++) inside[i] = bruteCount(points, N, &ext.rects[i]);
+
+		printf("\n%s: oracle %.0f ns per query\n", datasetNames[d], oraclens);
+		for (int e = 0; e < nengines; e++) {
+			Engine* en = &engines[e];
+			int64_t before = processBytes();
+			int64_t hugebefore = hugePageBytes();
+			t = nowNs();
+			SearchContext* sc = en->create(points, points + N);
+			double buildms = (nowNs() - t) / 1e6;
+
+			// prefer the engine's own accounting, fall back on the change in process memory
+			T_stats st = (T_stats)engineSymbol(en, "stats");
+			IndexStats is;
+			int64_t bytes = st ? st(sc, &is) : processBytes() - before;
+			int64_t huge = hugePageBytes() - hugebefore;
+
+			int64_t misses = tlbCounterRead(tlb);
+			for (int q = 0; q < NQUERYSETS; q++) {
+				for (int c = 0; c < NCOUNTS; c++) {
+					Result* r = &results[(e * NQUERYSETS + q) * NCOUNTS + c];
+					measure(en, sc, rects[q], nqueries, counts[c], repeats, oracle[q], oraclehits[q], out, ns, r);
+					mismatches += r->mismatches;
+				}
+			}
+			misses = tlbCounterRead(tlb) - misses;
+
+			printf("  %-24s build %8.0f ms  %8.1f MB%s  %8.1f MB huge pages", baseName(en->name), buildms, bytes / 1048576.0,
+				st ? "" : " (process)", huge / 1048576.0
+			);
+			if (tlb >= 0) printf("  %8.2f dTLB misses per query\n", (double)misses / (NQUERYSETS * NCOUNTS * nqueries * repeats));
+			else printf("  dTLB misses n/a\n");
+
+			mismatches += checkExtensions(en, sc, &ext);
+			en->destroy(sc);
+		}
+
+		// one row per workload, one column group per engine
+		printf("  %-6s %5s", "query", "count");
+		for (int e = 0; e < nengines; e++) printf("  | %-30.30s", baseName(engines[e].name));
+		printf("\n  %-6s %5s", "", "");
+		for (int e = 0; e < nengines; e++) printf("  | %9s %9s %10s", "p50", "p99", "max");
+		printf("\n");
+		for (int q = 0; q < NQUERYSETS; q++) {
+			for (int c = 0; c < NCOUNTS; c++) {
+				printf("  %-6s %5d", querySetNames[q], counts[c]);
+				for (int e = 0; e < nengines; e++) {
+					Result* r = &results[(e * NQUERYSETS + q) * NCOUNTS + c];
+					char key[256];
+					resultKey(key, engines[e].name, d, q, c);
+					if (save) fprintf(save, "%s,%.0f,%.0f\n", key, r->p50, r->p99);
+
+					Baseline* b = findBaseline(base, nbase, key);
+					bool slow = b && (regressed(r->p50, b->p50, thresh) || regressed(r->p99, b->p99, thresh));
+					if (slow) regressions++;
+					printf("  | %9.0f %9.0f %10.0f%s%s", r->p50, r->p99, r->max, slow ? " SLOW" : "", r->mismatches ? " WRONG" : "");
+				}
+				printf("\n");
+			}
+		}
+
+		for (int q = 0; q < NQUERYSETS; q++) {
+			free(rects[q]);
+			free(oracle[q]);
+			free(oraclehits[q]);
+		}
+		free(points);
+	}
+
+	if (save) fclose(save);
+	tlbCounterClose(tlb);
+	for (int e = 0; e < nengines; e++) unloadEngine(&engines[e]);
+
+	printf("\n%lld answers differ from the oracle, %lld workloads regressed more than %.0f%%\n", (long long)mismatches,
+		(long long)regressions, thresh * 100
+	);
+	return (mismatches > 0 || regressions > 0) ? 1 : 0;
+}
@@ -0,0 +1,4 @@
+#!/bin/bash
+rm core3d.o core3d.dll libcore3ddll.a
+x86_64-w64-mingw32-g++ -Ofast -c -DEXPORT_DLL -Drestrict=__restrict core3d.c
+x86_64-w64-mingw32-g++ -shared -o core3d.dll core3d.o -Wl,--out-implib,libcore3ddll.a
@@ -0,0 +1,4 @@
+#!/bin/bash
+rm engines.o engines.dll libenginesdll.a
+x86_64-w64-mingw32-g++ -Ofast -c -DEXPORT_DLL -Drestrict=__restrict engines.c
+x86_64-w64-mingw32-g++ -shared -o engines.dll engines.o -Wl,--out-implib,libenginesdll.a
\ No newline at end of file
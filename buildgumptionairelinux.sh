@@ -0,0 +1,4 @@
+#!/bin/bash
+rm gumptionaire.o libgumptionaire.so
+g++ -Ofast -fPIC -c -DEXPORT_DLL -Drestrict=__restrict -D__stdcall= '-D__declspec(x)=' gumptionaire.c
+g++ -shared -o libgumptionaire.so gumptionaire.o -lrt
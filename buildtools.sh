@@ -0,0 +1,6 @@
+#!/bin/bash
+rm replay.exe inspect.exe bench.exe adversary.exe
+x86_64-w64-mingw32-g++ -O2 -static -o replay.exe replay.c
+x86_64-w64-mingw32-g++ -O2 -Drestrict=__restrict -o inspect.exe inspect.c -L. -lgumptionairedll
+x86_64-w64-mingw32-g++ -O2 -static -o bench.exe bench.c -lpsapi
+x86_64-w64-mingw32-g++ -O2 -static -o adversary.exe adversary.c
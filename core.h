@@ -0,0 +1,444 @@
+#ifndef CORE_H
+#define CORE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits>
+#include "point_search.h"
+#include "iqsort.h"
+
+/* Search kernels shared by the engines, written once for any point layout: the coordinate type, the number of
+dimensions and the rank type come from PointLayout and RectLayout, and the axis a kernel works on is a template
+parameter, so every comparison and hit test is fixed at compile time. The engines' binary searches, slab kernels and
+top-k scans (bsearchx/bsearchy, findHitsUxV/findHitsUyV, findHitsU) are instantiations of these for the 2D float Point
+and Rect of point_search.h. Their grids, region trees and quantized kernels are written for Point alone.
+
+CoreIndex is a small top-k index over any layout, built from the same kernels: axis sorted copies and slab scans, with
+none of the engines' structures. core3d.h serves 3D points with it. */
+
+// LAYOUTS ----------------------------------------------------------------------------------------
+
+/* A point with "Dims" coordinates of type "Coord", and a rect bounding each of them from below (lo) and above (hi). */
+#pragma pack(push, 1)
+template <typename Coord, int Dims, typename Rank>
+struct CorePoint {
+	int8_t id;
+	Rank rank;
+	Coord c[Dims];
+};
+
+template <typename Coord, int Dims>
+struct CoreRect {
+	Coord lo[Dims];
+	Coord hi[Dims];
+};
+#pragma pack(pop)
+
+/* How the core reads a point type: its coordinate and rank types, its dimensions and its coordinate on each axis. Every
+layout also has the int8_t id and rank members the kernels copy. */
+template <typename P> struct PointLayout;
+
+/* How the core reads a rect type: the bounds of each axis, inclusive at both ends. */
+template <typename R> struct RectLayout;
+
+template <> struct PointLayout<Point> {
+	typedef float Coord;
+	typedef int32_t Rank;
+	enum { Dims = 2 };
+	template <int Axis> static inline float get(const Point& p) { return Axis == 0 ? p.x : p.y; }
+};
+
+template <> struct RectLayout<Rect> {
+	typedef float Coord;
+	enum { Dims = 2 };
+	template <int Axis> static inline float lo(const Rect& r) { return Axis == 0 ? r.lx : r.ly; }
+	template <int Axis> static inline float hi(const Rect& r) { return Axis == 0 ? r.hx : r.hy; }
+};
+
+template <typename C, int D, typename K> struct PointLayout<CorePoint<C, D, K> > {
+	typedef C Coord;
+	typedef K Rank;
+	enum { Dims = D };
+	template <int Axis> static inline C get(const CorePoint<C, D, K>& p) { return p.c[Axis]; }
+};
+
+template <typename C, int D> struct RectLayout<CoreRect<C, D> > {
+	typedef C Coord;
+	enum { Dims = D };
+	template <int Axis> static inline C lo(const CoreRect<C, D>& r) { return r.lo[Axis]; }
+	template <int Axis> static inline C hi(const CoreRect<C, D>& r) { return r.hi[Axis]; }
+};
+
+
+
+// HIT TESTS --------------------------------------------------------------------------------------
+
+template <int Axis, typename R>
+inline bool isInside(const R& r, typename RectLayout<R>::Coord v) {
+	return v >= RectLayout<R>::template lo<Axis>(r) && v <= RectLayout<R>::template hi<Axis>(r);
+}
+
+// p is inside r on every axis from "Axis" up
+template <typename R, typename P, int Axis = 0>
+inline bool isHitCore(const R& r, const P& p) {
+	if constexpr (Axis == RectLayout<R>::Dims) return true;
+	else return isInside<Axis>(r, PointLayout<P>::template get<Axis>(p)) && isHitCore<R, P, Axis + 1>(r, p);
+}
+
+
+
+// SORT ROUTINES ----------------------------------------------------------------------------------
+
+template <typename P>
+void coreRankSort(P* arr, unsigned n) {
+	#define core_rank_lt(a,b) ((a)->rank < (b)->rank)
+	QSORT(P, arr, n, core_rank_lt);
+	#undef core_rank_lt
+}
+
+template <int Axis, typename P>
+void coreAxisSort(P* arr, unsigned n) {
+	#define core_axis_lt(a,b) (PointLayout<P>::template get<Axis>(*(a)) < PointLayout<P>::template get<Axis>(*(b)))
+	QSORT(P, arr, n, core_axis_lt);
+	#undef core_axis_lt
+}
+
+
+
+// KERNELS ----------------------------------------------------------------------------------------
+
+/* Binary search of p[imin..imax], sorted on "Axis", for v. If v is there, return its first index (minOrMax) or its
+last. Otherwise return the index of the first point above v (minOrMax) or of the last point below it. */
+template <int Axis, typename P>
+int bsearchAxis(const P* p, bool minOrMax, typename PointLayout<P>::Coord v, int imin, int imax) {
+	typedef PointLayout<P> L;
+	while (imax >= imin) {
+		int imid = (imin + imax) / 2;
+		typename L::Coord val = L::template get<Axis>(p[imid]);
+		if (val == v) {
+			if (minOrMax) {
+				while (imid > imin && L::template get<Axis>(p[imid-1]) == v) imid--;
+				return imid;
+			} else {
+				while (imid < imax && L::template get<Axis>(p[imid+1]) == v) imid++;
+				return imid;
+			}
+		}
+		else if (val < v) imin = imid + 1;
+		else imax = imid - 1;
+	}
+	return minOrMax ? imin : imax;
+}
+
+/* Top-k of a "Count" fixed at compile time, for the counts nearly every search asks for. The ranks are kept sorted with
+the highest last, so a candidate is compared against one value, insertion is a shift of a few registers' worth of
+entries, and the result needs no sort. Empty entries hold the highest rank there is. "ref" is what the caller needs to
+copy the point out later: its id for the slab kernels, its index for the others. */
+#define SLABCHUNK 16  // points the fixed count slab kernels test at once
+#define isFixedCount(count) ((count) == 1 || (count) == 10 || (count) == 20 || (count) == 50)
+
+template <typename Rank, int Count>
+struct TopK {
+	int hits;
+	Rank rank[Count];
+	int32_t ref[Count];
+};
+
+template <typename Rank, int Count>
+inline void topkInit(TopK<Rank, Count>* t) {
+	t->hits = 0;
+	for (int j = 0; j < Count; j++) t->rank[j] = std::numeric_limits<Rank>::max();
+}
+
+// rank can't beat the kept points
+template <typename Rank, int Count>
+inline bool topkMisses(const TopK<Rank, Count>* t, Rank rank) {
+	return rank > t->rank[Count-1];
+}
+
+template <typename Rank, int Count>
+inline void topkInsert(TopK<Rank, Count>* t, Rank rank, int32_t ref) {
+	int j = Count - 1;
+	while (j > 0 && t->rank[j-1] > rank) {
+		t->rank[j] = t->rank[j-1];
+		t->ref[j] = t->ref[j-1];
+		j--;
+	}
+	t->rank[j] = rank;
+	t->ref[j] = ref;
+	t->hits++;
+}
+
+template <typename Rank, int Count>
+inline int topkHits(const TopK<Rank, Count>* t) {
+	return t->hits < Count ? t->hits : Count;
+}
+
+// findHitsSlab for a fixed count
+template <int Axis, typename R, typename P, int Count>
+int32_t findHitsSlabK(const R* rect, const int8_t* __restrict ids, const typename PointLayout<P>::Rank* __restrict ranks,
+		const typename RectLayout<R>::Coord* __restrict vs, int n, P* out) {
+	typedef typename PointLayout<P>::Rank Rank;
+	typedef typename RectLayout<R>::Coord Coord;
+	const int8_t* id = (const int8_t*)__builtin_assume_aligned(ids, 16);
+	const Rank* rank = (const Rank*)__builtin_assume_aligned(ranks, 16);
+	const Coord* v   = (const Coord*)__builtin_assume_aligned(vs, 16);
+
+	TopK<Rank, Count> t;
+	topkInit(&t);
+
+	// test a chunk at a time against the rank to beat as it stood before the chunk, which vectorizes, then insert the
+	// candidates in order, rechecking their ranks
+	int i = 0;
+	for (; i + SLABCHUNK <= n; i += SLABCHUNK) {
+		Rank worst = t.rank[Count-1];
+		uint32_t maybe = 0;
+		for (int j = 0; j < SLABCHUNK; j++) maybe |= (uint32_t)(rank[i+j] <= worst && isInside<Axis>(*rect, v[i+j])) << j;
+		while (maybe) {
+			int j = i + __builtin_ctz(maybe);
+			maybe &= maybe - 1;
+			if (!topkMisses(&t, rank[j])) topkInsert(&t, rank[j], id[j]);
+		}
+	}
+	for (; i < n; i++) {
+		if (topkMisses(&t, rank[i])) continue;
+		if (isInside<Axis>(*rect, v[i])) topkInsert(&t, rank[i], id[i]);
+	}
+
+	int hits = topkHits(&t);
+	for (int j = 0; j < hits; j++) {
+		out[j].id = t.ref[j];
+		out[j].rank = t.rank[j];
+	}
+	return hits;
+}
+
+// top-k of the points of "in" that "hit" accepts, for a fixed count
+template <typename R, typename P, int Count, typename Hit>
+int32_t findHitsK(R* rect, const P* in, int n, P* out, Hit hit) {
+	typedef typename PointLayout<P>::Rank Rank;
+	TopK<Rank, Count> t;
+	topkInit(&t);
+	for (int i = 0; i < n; i++) {
+		if (topkMisses(&t, in[i].rank)) continue;
+		if (hit(rect, (P*)&in[i])) topkInsert(&t, in[i].rank, i);
+	}
+
+	int hits = topkHits(&t);
+	for (int j = 0; j < hits; j++) out[j] = in[t.ref[j]];
+	return hits;
+}
+
+// findHitsK for a count that isFixedCount
+template <typename R, typename P, typename Hit>
+int32_t findHitsFixed(R* rect, const P* in, int n, P* out, int count, Hit hit) {
+	switch (count) {
+	case 1:  return findHitsK<R, P, 1>(rect, in, n, out, hit);
+	case 10: return findHitsK<R, P, 10>(rect, in, n, out, hit);
+	case 20: return findHitsK<R, P, 20>(rect, in, n, out, hit);
+	default: return findHitsK<R, P, 50>(rect, in, n, out, hit);
+	}
+}
+
+/* Slab scan: of n points whose coordinate on "Axis" is in vs, copy the ids and ranks of the "count" lowest ranked ones
+inside rect on that axis to out, in rank order. The points are already inside rect on the other axes. Return the
+number copied. */
+template <int Axis, typename R, typename P, void (*Sort)(P*, unsigned)>
+int32_t findHitsSlab(const R* rect, const int8_t* __restrict ids, const typename PointLayout<P>::Rank* __restrict ranks,
+		const typename RectLayout<R>::Coord* __restrict vs, int n, P* out, int count) {
+	typedef typename PointLayout<P>::Rank Rank;
+	typedef typename RectLayout<R>::Coord Coord;
+	switch (count) {
+	case 1:  return findHitsSlabK<Axis, R, P, 1>(rect, ids, ranks, vs, n, out);
+	case 10: return findHitsSlabK<Axis, R, P, 10>(rect, ids, ranks, vs, n, out);
+	case 20: return findHitsSlabK<Axis, R, P, 20>(rect, ids, ranks, vs, n, out);
+	case 50: return findHitsSlabK<Axis, R, P, 50>(rect, ids, ranks, vs, n, out);
+	}
+
+	const int8_t* id = (const int8_t*)__builtin_assume_aligned(ids, 16);
+	const Rank* rank = (const Rank*)__builtin_assume_aligned(ranks, 16);
+	const Coord* v   = (const Coord*)__builtin_assume_aligned(vs, 16);
+
+	int i = 0;
+	int hits = 0;
+	if (count <= 0) return 0;
+
+	// if fewer points in test buffer than allowed hits, use all hits
+	if (n <= count) {
+		for (int i = 0; i < n; i++) {
+			if (isInside<Axis>(*rect, v[i])) {
+				out[hits].id = id[i];
+				out[hits].rank = rank[i];
+				hits++;
+			}
+		}
+		Sort(out, hits);
+		return hits;
+	}
+
+	int j = 0;
+	Rank max = 0;
+	int maxloc = 0;
+
+	// start by filling out with the first count hits from in
+	while (i < n && hits < count) {
+		if (isInside<Axis>(*rect, v[i])) {
+			out[hits].id = id[i];
+			out[hits].rank = rank[i];
+			if (hits == 0 || rank[i] > max) {
+				max = rank[i];
+				maxloc = hits;
+			}
+			hits++;
+		}
+		i++;
+	}
+
+	// search through the remaining points in in, once out is full
+	while (i < n && hits == count) {
+		if (rank[i] > max) {
+			i++;
+			continue;
+		}
+
+		if (isInside<Axis>(*rect, v[i])) {
+			// replace previous max with this point
+			out[maxloc].id = id[i];
+			out[maxloc].rank = rank[i];
+
+			// find new max
+			max = out[0].rank;
+			maxloc = 0;
+			for (j = 1; j < count; j++) {
+				if (out[j].rank > max) {
+					max = out[j].rank;
+					maxloc = j;
+				}
+			}
+		}
+		i++;
+	}
+
+	Sort(out, hits);
+	return hits;
+}
+
+/* Copy the "count" lowest ranked of the n points in "in" that "hit" accepts to out, in rank order. "hit" is called
+with rect and a point, and is inlined into the scan, so the test is fixed at compile time when it's a lambda. */
+template <typename R, typename P, typename Hit>
+int32_t findHitsWith(R* rect, const P* in, int n, P* out, int count, Hit hit) {
+	typedef typename PointLayout<P>::Rank Rank;
+	if (isFixedCount(count)) return findHitsFixed(rect, in, n, out, count, hit);
+	if (count <= 0) return 0;
+
+	int hits = 0;
+	Rank max = 0;
+	int maxloc = 0;
+	for (int i = 0; i < n; i++) {
+		if (hits == count && in[i].rank > max) continue;
+		if (!hit(rect, (P*)&in[i])) continue;
+		if (hits < count) {
+			if (hits == 0 || in[i].rank > max) { max = in[i].rank; maxloc = hits; }
+			out[hits++] = in[i];
+			continue;
+		}
+
+		// replace the highest rank kept, and find the new highest
+		out[maxloc] = in[i];
+		max = out[0].rank;
+		maxloc = 0;
+		for (int j = 1; j < count; j++) {
+			if (out[j].rank > max) { max = out[j].rank; maxloc = j; }
+		}
+	}
+	coreRankSort(out, hits);
+	return hits;
+}
+
+/* Copy the "count" lowest ranked of the n points in "in" inside rect on every axis to out, in rank order. */
+template <typename R, typename P>
+int32_t findHitsCore(const R* rect, const P* in, int n, P* out, int count) {
+	return findHitsWith(rect, in, n, out, count, [](const R* r, const P* p) { return isHitCore(*r, *p); });
+}
+
+
+
+// INDEX ------------------------------------------------------------------------------------------
+
+/* Top-k index over any layout: a copy of the points in rank order, and one sorted on each axis. A search scans the
+thinnest slab of the rect along any axis, or the points in rank order when the rect holds so many points that the
+count lowest ranked turn up sooner that way. */
+template <typename P, typename R>
+struct CoreIndex {
+	enum { Dims = PointLayout<P>::Dims };
+	int n;
+	P* ranksort;
+	P* axissort[Dims];
+};
+
+template <int Axis, typename P, typename R>
+void coreSortAxes(CoreIndex<P, R>* index, const P* points) {
+	if constexpr (Axis < PointLayout<P>::Dims) {
+		index->axissort[Axis] = (P*)malloc((index->n > 0 ? index->n : 1) * sizeof(P));
+		memcpy(index->axissort[Axis], points, index->n * sizeof(P));
+		coreAxisSort<Axis>(index->axissort[Axis], index->n);
+		coreSortAxes<Axis + 1>(index, points);
+	}
+}
+
+template <typename P, typename R>
+CoreIndex<P, R>* coreBuild(const P* points_begin, const P* points_end) {
+	CoreIndex<P, R>* index = (CoreIndex<P, R>*)malloc(sizeof(CoreIndex<P, R>));
+	index->n = points_end - points_begin;
+	index->ranksort = (P*)malloc((index->n > 0 ? index->n : 1) * sizeof(P));
+	memcpy(index->ranksort, points_begin, index->n * sizeof(P));
+	coreRankSort(index->ranksort, index->n);
+	coreSortAxes<0>(index, points_begin);
+	return index;
+}
+
+template <typename P, typename R>
+void coreFree(CoreIndex<P, R>* index) {
+	for (int d = 0; d < CoreIndex<P, R>::Dims; d++) free(index->axissort[d]);
+	free(index->ranksort);
+	free(index);
+}
+
+// first index and length of the slab of rect along each axis from "Axis" up
+template <int Axis, typename P, typename R>
+void coreSlabs(const CoreIndex<P, R>* index, const R* rect, int* first, int* len) {
+	if constexpr (Axis < PointLayout<P>::Dims) {
+		const P* p = index->axissort[Axis];
+		first[Axis] = bsearchAxis<Axis>(p, true, RectLayout<R>::template lo<Axis>(*rect), 0, index->n - 1);
+		len[Axis] = bsearchAxis<Axis>(p, false, RectLayout<R>::template hi<Axis>(*rect), 0, index->n - 1) - first[Axis] + 1;
+		coreSlabs<Axis + 1>(index, rect, first, len);
+	}
+}
+
+template <typename P, typename R>
+int32_t coreSearch(const CoreIndex<P, R>* index, const R* rect, int count, P* out) {
+	enum { Dims = CoreIndex<P, R>::Dims };
+	if (index->n == 0 || count <= 0) return 0;
+	int first[Dims], len[Dims];
+	coreSlabs<0>(index, rect, first, len);
+
+	// the slabs are about independent, so a fraction prod(len / n) of the points is inside rect
+	int best = 0;
+	double inside = index->n;
+	for (int d = 0; d < Dims; d++) {
+		if (len[d] <= 0) return 0;
+		if (len[d] < len[best]) best = d;
+		inside *= (double)len[d] / index->n;
+	}
+	if ((double)count * index->n / (inside > 1 ? inside : 1) < len[best]) {
+		int hits = 0;
+		for (int i = 0; i < index->n && hits < count; i++) {
+			if (isHitCore(*rect, index->ranksort[i])) out[hits++] = index->ranksort[i];
+		}
+		return hits;
+	}
+	return findHitsCore(rect, &index->axissort[best][first[best]], len[best], out, count);
+}
+
+#endif
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "core3d.h"
+#include "core.h"
+
+// LAYOUTS ----------------------------------------------------------------------------------------
+
+template <> struct PointLayout<Point3> {
+	typedef float Coord;
+	typedef int32_t Rank;
+	enum { Dims = 3 };
+	template <int Axis> static inline float get(const Point3& p) { return Axis == 0 ? p.x : (Axis == 1 ? p.y : p.z); }
+};
+
+template <> struct RectLayout<Rect3> {
+	typedef float Coord;
+	enum { Dims = 3 };
+	template <int Axis> static inline float lo(const Rect3& r) { return Axis == 0 ? r.lx : (Axis == 1 ? r.ly : r.lz); }
+	template <int Axis> static inline float hi(const Rect3& r) { return Axis == 0 ? r.hx : (Axis == 1 ? r.hy : r.hz); }
+};
+
+typedef CoreIndex<Point3, Rect3> Index3;
+
+
+
+// DLL IMPLEMENTATION -----------------------------------------------------------------------------
+
+__stdcall SearchContext3* create3(const Point3* points_begin, const Point3* points_end) {
+	return (SearchContext3*)coreBuild<Point3, Rect3>(points_begin, points_end);
+}
+
+__stdcall int32_t search3(SearchContext3* sc, const Rect3 rect, const int32_t count, Point3* out_points) {
+	return coreSearch((Index3*)sc, &rect, count, out_points);
+}
+
+__stdcall SearchContext3* destroy3(SearchContext3* sc) {
+	coreFree((Index3*)sc);
+	return NULL;
+}
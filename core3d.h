@@ -0,0 +1,51 @@
+#ifndef CORE3D_H
+#define CORE3D_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef EXPORT_DLL
+#define DLL_API __declspec(dllexport)
+#else
+#define DLL_API __declspec(dllimport)
+#endif
+
+/* The following structs are packed with no padding. */
+#pragma pack(push, 1)
+
+/* A point in 3D space, with an id and rank like Point. */
+struct Point3 {
+	int8_t id;
+	int32_t rank;
+	float x;
+	float y;
+	float z;
+};
+
+/* A box, where a point (x,y,z) is inside if x is in [lx, hx], y is in [ly, hy] and z is in [lz, hz]. */
+struct Rect3 {
+	float lx;
+	float ly;
+	float lz;
+	float hx;
+	float hy;
+	float hz;
+};
+#pragma pack(pop)
+
+struct SearchContext3;
+
+/* The create, search and destroy of point_search.h for 3D points, on the CoreIndex of core.h: axis sorted copies and
+slab scans, without the grid and region tree of the 2D engines. */
+SearchContext3* __stdcall DLL_API create3(const Point3* points_begin, const Point3* points_end);
+int32_t __stdcall DLL_API search3(SearchContext3* sc, const Rect3 rect, const int32_t count, Point3* out_points);
+SearchContext3* __stdcall DLL_API destroy3(SearchContext3* sc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <string.h>
+
+/* Instruction set levels the hot kernels are compiled for, and the highest one the running CPU has. Each kernel is
+built once per level with the TARGET_ attributes, which also inline everything it calls so the whole loop is compiled
+for that level, and keep the compiler from folding the copies back into one. An index picks one set when it is
+created. CPU_BASE is the x86-64 baseline the rest of the library is built for. */
+
+enum CpuLevel {
+	CPU_BASE,
+	CPU_SSE42,
+	CPU_AVX2,
+	CPU_AVX512,
+	NCPULEVELS
+};
+
+#define TARGET_SSE42  __attribute__((target("sse4.2,popcnt"), flatten, no_icf))
+#define TARGET_AVX2   __attribute__((target("avx2,bmi,bmi2,popcnt,lzcnt,fma"), flatten, no_icf))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx512dq,avx2,bmi,bmi2,popcnt,lzcnt,fma"), flatten, no_icf))
+
+inline const char* cpuLevelName(int level) {
+	static const char* names[NCPULEVELS] = { "base", "sse4.2", "avx2", "avx512" };
+	return names[level];
+}
+
+inline int cpuLevel() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) return CPU_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("fma")) return CPU_AVX2;
+	if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) return CPU_SSE42;
+	return CPU_BASE;
+}
+
+// the CPU's level, or the lower one "name" asks for (one of cpuLevelName's, to try slower kernels on a fast machine)
+inline int cpuLevelCapped(const char* name) {
+	int level = cpuLevel();
+	if (!name) return level;
+	for (int i = 0; i < level; i++) {
+		if (strcmp(name, cpuLevelName(i)) == 0) return i;
+	}
+	return level;
+}
+
+#endif
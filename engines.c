@@ -0,0 +1,221 @@
+// Every engine in one library. Each engine's source is compiled into its own namespace, with its exports renamed so
+// they don't collide, and its #defines dropped before the next engine is included. The library's own exports pick an
+// engine by name and forward to it through an EngineOps table.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <immintrin.h>
+#include <x86intrin.h>
+#include "point_search.h"
+#include "core.h"
+#include "stats.h"
+#include "trace.h"
+#include "hugepages.h"
+#include "numa.h"
+#include "cpu.h"
+#include "threads.h"
+#include "shm.h"
+
+// ENGINES ----------------------------------------------------------------------------------------
+
+#define create  gump_create
+#define search  gump_search
+#define destroy gump_destroy
+#define stats   gump_stats
+namespace gump {
+#include "gump.c"
+}
+#undef create
+#undef search
+#undef destroy
+#undef stats
+#undef DEBUG
+#undef WRITEFILES
+#undef SIMPLELIMIT
+#undef MAXDEPTH
+#undef BASELIMIT
+#undef DEPTHFACTOR
+
+#define create  gumption_create
+#define search  gumption_search
+#define destroy gumption_destroy
+#define stats   gumption_stats
+namespace gumption {
+#include "gumption.c"
+}
+#undef create
+#undef search
+#undef destroy
+#undef stats
+#undef DPRINT
+#undef MAXDEPTH
+#undef REGIONTHRESH
+#undef MAXLEAF
+#undef NODESIZE
+#undef LEAFSIZE
+#undef DIVS
+#undef GRIDFACTOR
+#undef LINTHRESH1
+#undef LINTHRESH2
+#undef LINTHRESH3
+#undef RANKMAX
+
+#define GUMPTIONAIRE_PREFIX
+namespace gumptionaire {
+#include "gumptionaire.c"
+}
+#undef GUMPTIONAIRE_PREFIX
+
+#include "engines.h"
+
+#define DEFAULTENGINE "gumptionaire"
+
+// auto selection
+#define AUTOSAMPLE 250000   // most points to build the trial indexes on
+#define AUTOQUERIES 2000
+#define AUTOCOUNT 20
+
+const EngineOps engineOps[] = {
+	{ "gump",         gump::gump_create,                 gump::gump_search,                 gump::gump_destroy,                 gump::gump_stats },
+	{ "gumption",     gumption::gumption_create,         gumption::gumption_search,         gumption::gumption_destroy,         gumption::gumption_stats },
+	{ "gumptionaire", gumptionaire::gumptionaire_create, gumptionaire::gumptionaire_search, gumptionaire::gumptionaire_destroy, gumptionaire::gumptionaire_stats },
+};
+const int nengines = sizeof(engineOps) / sizeof(EngineOps);
+
+
+
+// AUTO SELECTION ---------------------------------------------------------------------------------
+
+const EngineOps* findEngine(const char* name) {
+	for (int i = 0; i < nengines; i++) {
+		if (strcmp(engineOps[i].name, name) == 0) return &engineOps[i];
+	}
+	return NULL;
+}
+
+uint64_t nextRand(uint64_t* state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+double randUnit(uint64_t* state) {
+	return (nextRand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// queries centered on sampled points, so dense areas get queried as often as real traffic would, with sides
+// log-uniform between 1e-4 and 1 of the extent
+void autoQueries(const Point* points, int n, Rect* rects, int nrects) {
+	float lx = points[0].x, hx = points[0].x, ly = points[0].y, hy = points[0].y;
+	for (int i = 1; i < n; i++) {
+		if (points[i].x < lx) lx = points[i].x;
+		if (points[i].x > hx) hx = points[i].x;
+		if (points[i].y < ly) ly = points[i].y;
+		if (points[i].y > hy) hy = points[i].y;
+	}
+
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+	for (int i = 0; i < nrects; i++) {
+		const Point* c = &points[nextRand(&state) % n];
+		float w = (hx - lx) * pow(10, -4 * randUnit(&state));
+		float h = (hy - ly) * pow(10, -4 * randUnit(&state));
+		rects[i].lx = c->x - w / 2;
+		rects[i].hx = c->x + w / 2;
+		rects[i].ly = c->y - h / 2;
+		rects[i].hy = c->y + h / 2;
+	}
+}
+
+// build every engine on (a sample of) the points and time it on the same queries. Return the fastest engine, and if
+// the sample was all of the points, its context in "built" so it doesn't have to be built again
+const EngineOps* autoEngine(const Point* points_begin, const Point* points_end, SearchContext** built) {
+	int N = points_end - points_begin;
+	*built = NULL;
+	if (N == 0) return findEngine(DEFAULTENGINE);
+
+	// every stride'th point keeps ranks unique
+	int stride = (N + AUTOSAMPLE - 1) / AUTOSAMPLE;
+	int n = (N + stride - 1) / stride;
+	Point* sample = (Point*)malloc(n * sizeof(Point));
+	for (int i = 0; i < n; i++) sample[i] = points_begin[(int64_t)i * stride];
+
+	Rect* rects = (Rect*)malloc(AUTOQUERIES * sizeof(Rect));
+	Point* out = (Point*)malloc(AUTOCOUNT * sizeof(Point));
+	autoQueries(sample, n, rects, AUTOQUERIES);
+
+	const EngineOps* best = NULL;
+	uint64_t bestcycles = 0;
+	for (int e = 0; e < nengines; e++) {
+		const EngineOps* ops = &engineOps[e];
+		SearchContext* sc = ops->create(sample, sample + n);
+
+		// first pass warms the caches, second is timed
+		for (int i = 0; i < AUTOQUERIES; i++) ops->search(sc, rects[i], AUTOCOUNT, out);
+		uint64_t start = __rdtsc();
+		for (int i = 0; i < AUTOQUERIES; i++) ops->search(sc, rects[i], AUTOCOUNT, out);
+		uint64_t cycles = __rdtsc() - start;
+		DPRINT(("Auto: %s %.0f cycles per query\n", ops->name, (double)cycles / AUTOQUERIES));
+
+		if (!best || cycles < bestcycles) {
+			if (*built) best->destroy(*built);
+			*built = (stride == 1) ? sc : NULL;
+			if (stride > 1) ops->destroy(sc);
+			best = ops;
+			bestcycles = cycles;
+		} else ops->destroy(sc);
+	}
+
+	free(out);
+	free(rects);
+	free(sample);
+	return best;
+}
+
+
+
+// DLL IMPLEMENTATION -----------------------------------------------------------------------------
+
+__stdcall SearchContext* create_with_engine(const char* name, const Point* points_begin, const Point* points_end) {
+	const EngineOps* ops;
+	SearchContext* sc = NULL;
+	if (strcmp(name, "auto") == 0) ops = autoEngine(points_begin, points_end, &sc);
+	else ops = findEngine(name);
+	if (!ops) return NULL;
+
+	EngineContext* ec = (EngineContext*)malloc(sizeof(EngineContext));
+	ec->ops = ops;
+	ec->sc = sc ? sc : ops->create(points_begin, points_end);
+	return (SearchContext*)ec;
+}
+
+__stdcall SearchContext* create(const Point* points_begin, const Point* points_end) {
+	return create_with_engine(DEFAULTENGINE, points_begin, points_end);
+}
+
+__stdcall int32_t search(SearchContext* sc, const Rect rect, const int32_t count, Point* out_points) {
+	EngineContext* ec = (EngineContext*)sc;
+	return ec->ops->search(ec->sc, rect, count, out_points);
+}
+
+__stdcall int64_t stats(SearchContext* sc, IndexStats* out) {
+	EngineContext* ec = (EngineContext*)sc;
+	int64_t bytes = ec->ops->stats(ec->sc, out);
+	out->scratch.bytes += sizeof(EngineContext);
+	out->bytes = bytes + sizeof(EngineContext);
+	return out->bytes;
+}
+
+__stdcall const char* engine_name(SearchContext* sc) {
+	return ((EngineContext*)sc)->ops->name;
+}
+
+__stdcall SearchContext* destroy(SearchContext* sc) {
+	EngineContext* ec = (EngineContext*)sc;
+	if (ec->ops->destroy(ec->sc) != NULL) return sc;
+	free(ec);
+	return NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef ENGINES_H
+#define ENGINES_H
+
+#include "point_search.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef EXPORT_DLL
+#define DLL_API __declspec(dllexport)
+#else
+#define DLL_API __declspec(dllimport)
+#endif
+
+/* Entry points shared by every engine in the library. */
+struct EngineOps {
+	const char* name;
+	T_create create;
+	T_search search;
+	T_destroy destroy;
+	int64_t (__stdcall* stats)(SearchContext* sc, IndexStats* out);
+};
+
+/* Context handed out by this library: the engine chosen and that engine's own context. */
+struct EngineContext {
+	const EngineOps* ops;
+	SearchContext* sc;
+};
+
+SearchContext* __stdcall DLL_API create(const Point* points_begin, const Point* points_end);
+int32_t __stdcall DLL_API search(SearchContext* sc, const Rect rect, const int32_t count, Point* out_points);
+SearchContext* __stdcall DLL_API destroy(SearchContext* sc);
+int64_t __stdcall DLL_API stats(SearchContext* sc, IndexStats* out);
+
+/* Like create, but build the index with the engine called "name" ("gump", "gumption" or "gumptionaire"). With "auto",
+build each engine on a sample of the points, time it on queries centered on sampled points and keep the fastest.
+Return NULL if there is no engine called "name". */
+SearchContext* __stdcall DLL_API create_with_engine(const char* name, const Point* points_begin, const Point* points_end);
+
+/* Return the name of the engine behind "sc". */
+const char* __stdcall DLL_API engine_name(SearchContext* sc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "gump.h"
+#include "core.h"
+#include "stats.h"
 
 #define DEBUG 0
 #define WRITEFILES 1
@@ -63,86 +65,11 @@ inline bool isHitY(Rect* r, Point* p) {
 }
 
 int bsearch(Point p[], bool xOrY, bool minOrMax, float v, int imin, int imax) {
-	while (imax >= imin) {
-		int imid = (imin + imax) / 2;
-		float val = xOrY ? p[imid].x : p[imid].y;
-		if (val == v) {
-			if (minOrMax) {
-				while (imid > imin && (xOrY ? p[imid-1].x : p[imid-1].y) == v) imid--;
-				return imid;
-			} else {
-				while (imid < imax && (xOrY ? p[imid+1].x : p[imid+1].y) == v) imid++;
-				return imid;
-			}
-		}
-		else if (val < v) imin = imid + 1;
-		else imax = imid - 1;
-	}
-	return minOrMax ? imin : imax;
+	return xOrY ? bsearchAxis<0>(p, minOrMax, v, imin, imax) : bsearchAxis<1>(p, minOrMax, v, imin, imax);
 }
 
 int32_t findHitsU(Rect* rect, Point* in, int n, Point* out, int count, bool (*hitcheck)(Rect* r, Point* p)) {
-	int i = 0;
-	int hits = 0;
-
-	// if fewer points in test buffer than allowed hits, use all hits
-	if (n <= count) {
-		for (int i = 0; i < n; i++) {
-			Point p = in[i];
-			if (hitcheck(rect, &p)) {
-				out[hits] = p;
-				hits++;
-			}
-		}
-		qsort(out, hits, sizeof(Point), rankcomp);
-		return hits;
-	}
-
-	int j = 0;
-	int max = -1;
-	int maxloc = -1;
-
-	// start by filling out with the first count hits from in
-	while (i < n && hits < count) {
-		Point p = in[i];
-		if (hitcheck(rect, &p)) {
-			out[hits] = p;
-			if (p.rank > max) {
-				max = p.rank;
-				maxloc = hits;
-			}
-			hits++;
-		}
-		i++;
-	}
-
-	// search through the remaining points in in
-	while (i < n) {
-		Point p = in[i];
-		if (p.rank > max) {
-			i++;
-			continue;
-		}
-
-		if (hitcheck(rect, &p)) {
-			// replace previous max with this point
-			out[maxloc] = p;
-
-			// find new max
-			max = -1;
-			maxloc = -1;
-			for (j = 0; j < count; j++) {
-				if (out[j].rank > max) {
-					max = out[j].rank;
-					maxloc = j;
-				}
-			}
-		}
-		i++;
-	}
-
-	qsort(out, hits, sizeof(Point), rankcomp);
-	return hits;
+	return findHitsWith(rect, in, n, out, count, hitcheck);
 }
 
 int32_t findHitsS(Rect* rect, Point* in, int n, Point* out, int count) {
@@ -173,10 +100,10 @@ int32_t searchBaseline(GumpSearchContext* sc, const Rect rect, const int32_t cou
 // binary search - narrow search to points in x range, y range, and check smaller set
 int32_t searchBinary(GumpSearchContext* sc, const Rect rect, const int32_t count, Point* out_points) {
 	int32_t n = 0;
-	int xidxl = bsearch(sc->xsort, true, true, rect.lx, 0, sc->N);
-	int xidxr = bsearch(sc->xsort, true, false, rect.hx, 0, sc->N);
-	int yidxl = bsearch(sc->ysort, false, true, rect.ly, 0, sc->N);
-	int yidxr = bsearch(sc->ysort, false, false, rect.hy, 0, sc->N);
+	int xidxl = bsearch(sc->xsort, true, true, rect.lx, 0, sc->N - 1);
+	int xidxr = bsearch(sc->xsort, true, false, rect.hx, 0, sc->N - 1);
+	int yidxl = bsearch(sc->ysort, false, true, rect.ly, 0, sc->N - 1);
+	int yidxr = bsearch(sc->ysort, false, false, rect.hy, 0, sc->N - 1);
 	int nx = xidxr - xidxl + 1;
 	int ny = yidxr - yidxl + 1;
 
@@ -202,10 +129,10 @@ int32_t rangeHits(GumpSearchContext* sc, const Rect rect, Range* range, int left
 }
 
 int32_t searchRange(GumpSearchContext* sc, const Rect rect, const int32_t count, Point* out_points) {
-	int xidxl = bsearch(sc->xsort, true, true, rect.lx, 0, sc->N);
-	int xidxr = bsearch(sc->xsort, true, false, rect.hx, 0, sc->N);
-	int yidxl = bsearch(sc->ysort, false, true, rect.ly, 0, sc->N);
-	int yidxr = bsearch(sc->ysort, false, false, rect.hy, 0, sc->N);
+	int xidxl = bsearch(sc->xsort, true, true, rect.lx, 0, sc->N - 1);
+	int xidxr = bsearch(sc->xsort, true, false, rect.hx, 0, sc->N - 1);
+	int yidxl = bsearch(sc->ysort, false, true, rect.ly, 0, sc->N - 1);
+	int yidxr = bsearch(sc->ysort, false, false, rect.hy, 0, sc->N - 1);
 	int nx = xidxr - xidxl + 1;
 	int ny = yidxr - yidxl + 1;
 
@@ -231,6 +158,45 @@ int32_t searchRange(GumpSearchContext* sc, const Rect rect, const int32_t count,
 
 
 
+// STATISTICS -------------------------------------------------------------------------------------
+
+// visit each node of the range dag once, following the same ownership rules as freeRange. The first pass (no bits in
+// set yet) only finds the rank range of the stored points, the second marks them to count duplicates
+void statRange(Range* range, bool left, bool right, int depth, StructStats* s, RankSet* set) {
+	if (left  && range->left)  statRange(range->left,  true,  true,  depth + 1, s, set);
+	if (right && range->right) statRange(range->right, true,  true,  depth + 1, s, set);
+	if (range->mid)            statRange(range->mid,   false, false, depth + 1, s, set);
+
+	if (set->bits) {
+		for (int i = 0; i < range->n; i++) rankSetAdd(set, range->ranksort[i].rank);
+		return;
+	}
+	for (int i = 0; i < range->n; i++) rankSetWiden(set, range->ranksort[i].rank);
+
+	int len = pow(2, MAXDEPTH - depth) * DEPTHFACTOR;
+	s->nodes++;
+	s->bytes += sizeof(Range) + len * sizeof(Point);
+	if (range->n == 0) s->empty++;
+	if (range->left == NULL) statLeaf(s, range->n);
+	s->points += range->n;
+}
+
+void statRanges(GumpSearchContext* sc, StructStats* s) {
+	RankSet set = { 0x7fffffff, -1, NULL, 0 };
+	statRange(sc->xroot, true, true, 1, s, &set);
+	statRange(sc->yroot, true, true, 1, s, &set);
+	rankSetAlloc(&set);
+	if (set.bits) {
+		statRange(sc->xroot, true, true, 1, s, &set);
+		statRange(sc->yroot, true, true, 1, s, &set);
+	}
+	s->duplicates = s->points - set.distinct;
+	free(set.bits);
+	statFinish(s);
+}
+
+
+
 // DLL IMPLEMENTATION -----------------------------------------------------------------------------
 
 int ranges = 0;
@@ -258,7 +224,7 @@ Range* buildRange(GumpSearchContext* sc, int l, int r, float (*sel)(Point* p), b
 		.hx = xOrY ? sc->xsort[r].x : sc->xsort[sc->N-1].x,
 		.hy = xOrY ? sc->ysort[sc->N-1].y : sc->ysort[r].y
 	};
-	searchBinary(sc, rect, len, range->ranksort);
+	range->n = searchBinary(sc, rect, len, range->ranksort);
 
 	// is this a leaf
 	if (depth == MAXDEPTH) return range;
@@ -334,6 +300,24 @@ __stdcall int32_t search(SearchContext* sc, const Rect rect, const int32_t count
 	return searchRange(context, rect, count, out_points);
 }
 
+__stdcall int64_t stats(SearchContext* sc, IndexStats* out) {
+	GumpSearchContext* context = (GumpSearchContext*)sc;
+	memset(out, 0, sizeof(IndexStats));
+	out->N = context->N;
+	out->scratch.bytes = sizeof(GumpSearchContext);
+	if (context->N > 0) {
+		statRanges(context, &out->regions);
+
+		out->sorted.nodes = 2;
+		out->sorted.bytes = 2 * (int64_t)context->N * sizeof(Point);
+		out->sorted.points = 2 * (int64_t)context->N;
+		out->sorted.duplicates = context->N;
+	}
+
+	out->bytes = out->regions.bytes + out->sorted.bytes + out->scratch.bytes;
+	return out->bytes;
+}
+
 __stdcall SearchContext* destroy(SearchContext* sc) {
 	GumpSearchContext* context = (GumpSearchContext*)sc;
 	free(context->xsort);
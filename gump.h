@@ -2,6 +2,7 @@
 #define GUMP_H
 
 #include "point_search.h"
+#include "stats.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +16,7 @@ extern "C" {
 
 struct Range {
 	int l, r;
+	int n;
 	Point* ranksort;
 	Range* left;
 	Range* right;
@@ -34,6 +36,10 @@ SearchContext* __stdcall DLL_API create(const Point* points_begin, const Point*
 int32_t __stdcall DLL_API search(SearchContext* sc, const Rect rect, const int32_t count, Point* out_points);
 SearchContext* __stdcall DLL_API destroy(SearchContext* sc);
 
+/* Fill "out" with the bytes allocated, node counts, leaf fill, empty cells and duplicated points of each structure in
+the context. Return the total number of bytes. */
+int64_t __stdcall DLL_API stats(SearchContext* sc, IndexStats* out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,6 +4,8 @@
 #include <math.h>
 #include "gumption.h"
 #include "iqsort.h"
+#include "core.h"
+#include "stats.h"
 
 // #define DEBUG
 #ifdef DEBUG
@@ -62,8 +64,6 @@ void ranksort(struct Point *arr, unsigned n) {
 
 // HELPER FUNCTIONS -------------------------------------------------------------------------------
 
-int hitchecks = 0;
-
 inline float rectArea(Rect* rect) {
 	return (rect->hx - rect->lx) * (rect->hy - rect->ly);
 }
@@ -97,105 +97,15 @@ inline bool isHitY(Rect* r, Point* p) {
 }
 
 int bsearchx(Point p[], bool minOrMax, float v, int imin, int imax) {
-	while (imax >= imin) {
-		int imid = (imin + imax) / 2;
-		float val = p[imid].x;
-		if (val == v) {
-			if (minOrMax) {
-				while (imid > imin && p[imid-1].x == v) imid--;
-				return imid;
-			} else {
-				while (imid < imax && p[imid+1].x == v) imid++;
-				return imid;
-			}
-		}
-		else if (val < v) imin = imid + 1;
-		else imax = imid - 1;
-	}
-	return minOrMax ? imin : imax;
+	return bsearchAxis<0>(p, minOrMax, v, imin, imax);
 }
 
 int bsearchy(Point p[], bool minOrMax, float v, int imin, int imax) {
-	while (imax >= imin) {
-		int imid = (imin + imax) / 2;
-		float val = p[imid].y;
-		if (val == v) {
-			if (minOrMax) {
-				while (imid > imin && p[imid-1].y == v) imid--;
-				return imid;
-			} else {
-				while (imid < imax && p[imid+1].y == v) imid++;
-				return imid;
-			}
-		}
-		else if (val < v) imin = imid + 1;
-		else imax = imid - 1;
-	}
-	return minOrMax ? imin : imax;
+	return bsearchAxis<1>(p, minOrMax, v, imin, imax);
 }
 
 int32_t findHitsU(Rect* rect, Point* in, int n, Point* out, int count, bool (*hitcheck)(Rect* r, Point* p)) {
-	int i = 0;
-	int hits = 0;
-
-	// if fewer points in test buffer than allowed hits, use all hits
-	if (n <= count) {
-		for (int i = 0; i < n; i++) {
-			Point p = in[i];
-			if (hitcheck(rect, &p)) {
-				out[hits] = p;
-				hits++;
-			}
-		}
-		ranksort(out, hits);
-		return hits;
-	}
-
-	int j = 0;
-	int max = -1;
-	int maxloc = -1;
-
-	// start by filling out with the first count hits from in
-	while (i < n && hits < count) {
-		Point p = in[i];
-		if (hitcheck(rect, &p)) {
-			out[hits] = p;
-			if (p.rank > max) {
-				max = p.rank;
-				maxloc = hits;
-			}
-			hits++;
-		}
-		i++;
-	}
-
-	// search through the remaining points in in
-	while (i < n) {
-		Point p = in[i];
-		if (p.rank > max) {
-			i++;
-			continue;
-		}
-
-		if (hitcheck(rect, &p)) {
-			// replace previous max with this point
-			out[maxloc] = p;
-
-			// find new max
-			max = -1;
-			maxloc = -1;
-			for (j = 0; j < count; j++) {
-				if (out[j].rank > max) {
-					max = out[j].rank;
-					maxloc = j;
-				}
-			}
-		}
-		i++;
-	}
-
-	ranksort(out, hits);
-	return hits;
+	return findHitsWith(rect, in, n, out, count, hitcheck);
 }
 
 int32_t findHitsS(const Rect* rect, Point* in, int n, Point* out, int count) {
@@ -230,6 +140,7 @@ int32_t findHitsB(Rect* rect, int b, Point** blocks, int* blocki, int* blockn, P
 			Point p = blocks[i][blocki[i]];
 			if (p.rank == prank) {
 				blocki[i]++;
+				if (blocki[i] >= blockn[i]) { fin++; continue; }
 				p = blocks[i][blocki[i]];
 			}
 			if (p.rank < minrank) {
@@ -285,7 +196,6 @@ int32_t regionHits(GumpSearchContext* sc, Rect rect, Region* region, int count,
 	return hits;
 }
 
-int ngrid = 0, nbin = 0;
 int32_t searchGumption(GumpSearchContext* sc, Rect rect, const int32_t count, Point* out_points) {
 	sc->trim->lx = (rect.lx < sc->bounds->lx) ? sc->bounds->lx : rect.lx;
 	sc->trim->hx = (rect.hx > sc->bounds->hx) ? sc->bounds->hx : rect.hx;
@@ -308,29 +218,29 @@ int32_t searchGumption(GumpSearchContext* sc, Rect rect, const int32_t count, Po
 
 	// if valid x range is likely to be smaller than y range, check it first
 	if (sc->w / sc->dx < sc->h / sc->dy) {
-		xidxl = bsearchx(sc->xsort, true, rect.lx, 0, sc->N);
-		xidxr = bsearchx(sc->xsort, false, rect.hx, 0, sc->N);
+		xidxl = bsearchx(sc->xsort, true, rect.lx, 0, sc->N - 1);
+		xidxr = bsearchx(sc->xsort, false, rect.hx, 0, sc->N - 1);
 		nx = xidxr - xidxl + 1;
 		if (nx == 0) return 0;
 
 		if (nx < LINTHRESH1) return findHitsU((Rect*)&rect, &sc->xsort[xidxl], nx, out_points, count, isHitY);
 
-		yidxl = bsearchy(sc->ysort, true, rect.ly, 0, sc->N);
-		yidxr = bsearchy(sc->ysort, false, rect.hy, 0, sc->N);
+		yidxl = bsearchy(sc->ysort, true, rect.ly, 0, sc->N - 1);
+		yidxr = bsearchy(sc->ysort, false, rect.hy, 0, sc->N - 1);
 		ny = yidxr - yidxl + 1;
 		if (ny == 0) return 0;
 
 		if (ny < LINTHRESH2) return findHitsU((Rect*)&rect, &sc->ysort[yidxl], ny, out_points, count, isHitX);
 	} else {
-		yidxl = bsearchy(sc->ysort, true, rect.ly, 0, sc->N);
-		yidxr = bsearchy(sc->ysort, false, rect.hy, 0, sc->N);
+		yidxl = bsearchy(sc->ysort, true, rect.ly, 0, sc->N - 1);
+		yidxr = bsearchy(sc->ysort, false, rect.hy, 0, sc->N - 1);
 		ny = yidxr - yidxl + 1;
 		if (ny == 0) return 0;
 
 		if (ny < LINTHRESH1) return findHitsU((Rect*)&rect, &sc->ysort[yidxl], ny, out_points, count, isHitX);
 
-		xidxl = bsearchx(sc->xsort, true, rect.lx, 0, sc->N);
-		xidxr = bsearchx(sc->xsort, false, rect.hx, 0, sc->N);
+		xidxl = bsearchx(sc->xsort, true, rect.lx, 0, sc->N - 1);
+		xidxr = bsearchx(sc->xsort, false, rect.hx, 0, sc->N - 1);
 		nx = xidxr - xidxl + 1;
 		if (nx == 0) return 0;
 
@@ -381,6 +291,64 @@ int32_t searchGumption(GumpSearchContext* sc, Rect rect, const int32_t count, Po
 
 
 
+// STATISTICS -------------------------------------------------------------------------------------
+
+// visit each node of the region dag once, following the same ownership rules as freeRegion. The first pass (no bits
+// in set yet) only finds the rank range of the stored points, the second marks them to count duplicates
+void statRegion(Region* region, bool left, bool lrmid, bool right, bool bottom, bool btmid, bool top, StructStats* s, RankSet* set) {
+	if (left   && region->left)   statRegion(region->left,   true,  true,  true,  true,  true, true,  s, set);
+	if (right  && region->right)  statRegion(region->right,  true,  true,  true,  true,  true, true,  s, set);
+	if (lrmid  && region->lrmid)  statRegion(region->lrmid,  false, true,  false, true,  true, true,  s, set);
+	if (bottom && region->bottom) statRegion(region->bottom, false, false, false, true,  true, true,  s, set);
+	if (top    && region->top)    statRegion(region->top,    false, false, false, true,  true, true,  s, set);
+	if (btmid  && region->btmid)  statRegion(region->btmid,  false, false, false, false, true, false, s, set);
+
+	if (set->bits) {
+		for (int i = 0; i < region->n; i++) rankSetAdd(set, region->ranksort[i].rank);
+		return;
+	}
+	for (int i = 0; i < region->n; i++) rankSetWiden(set, region->ranksort[i].rank);
+
+	bool leaf = region->left == NULL;
+	s->nodes++;
+	s->bytes += sizeof(Region) + (leaf ? LEAFSIZE : NODESIZE) * sizeof(Point);
+	if (region->crect) s->bytes += 6 * sizeof(Rect);
+	if (region->n == 0) s->empty++;
+	if (leaf) statLeaf(s, region->n);
+	s->points += region->n;
+}
+
+void statRegions(GumpSearchContext* sc, StructStats* s) {
+	RankSet set = { RANKMAX, -1, NULL, 0 };
+	statRegion(sc->root, true, true, true, true, true, true, s, &set);
+	rankSetAlloc(&set);
+	if (set.bits) statRegion(sc->root, true, true, true, true, true, true, s, &set);
+	s->duplicates = s->points - set.distinct;
+	free(set.bits);
+	statFinish(s);
+}
+
+void statGrid(GumpSearchContext* sc, StructStats* s) {
+	s->bytes = DIVS * (sizeof(Point**) + 2 * sizeof(Rect*) + sizeof(int*))
+		+ DIVS * DIVS * (sizeof(Point*) + 2 * sizeof(Rect) + sizeof(int));
+	for (int i = 0; i < DIVS; i++) {
+		for (int j = 0; j < DIVS; j++) {
+			int n = sc->dlen[i][j];
+			s->nodes++;
+			s->points += n;
+			s->bytes += n * sizeof(Point);
+			if (n == 0) s->empty++;
+			else statLeaf(s, n);
+		}
+	}
+
+	// points on a cell boundary are stored in both cells
+	s->duplicates = s->points - sc->N;
+	statFinish(s);
+}
+
+
+
 // DLL IMPLEMENTATION -----------------------------------------------------------------------------
 
 int regions = 0;
@@ -625,6 +593,28 @@ __stdcall int32_t search(SearchContext* sc, Rect rect, const int32_t count, Poin
 	return searchGumption(context, rect, count, out_points);
 }
 
+__stdcall int64_t stats(SearchContext* sc, IndexStats* out) {
+	GumpSearchContext* context = (GumpSearchContext*)sc;
+	memset(out, 0, sizeof(IndexStats));
+	out->N = context->N;
+	out->scratch.bytes = sizeof(GumpSearchContext);
+	if (context->N > 0) {
+		statRegions(context, &out->regions);
+		statGrid(context, &out->grid);
+
+		out->sorted.nodes = 2;
+		out->sorted.bytes = 2 * (int64_t)context->N * sizeof(Point);
+		out->sorted.points = 2 * (int64_t)context->N;
+		out->sorted.duplicates = context->N;
+
+		out->scratch.nodes = 3;
+		out->scratch.bytes += DIVS * DIVS * (sizeof(Point*) + 2 * sizeof(int)) + 2 * sizeof(Rect);
+	}
+
+	out->bytes = out->regions.bytes + out->grid.bytes + out->sorted.bytes + out->scratch.bytes;
+	return out->bytes;
+}
+
 __stdcall SearchContext* destroy(SearchContext* sc) {
 	GumpSearchContext* context = (GumpSearchContext*)sc;
 	if (context->N == 0) {
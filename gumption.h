@@ -1,4 +1,5 @@
 #include "point_search.h"
+#include "stats.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -59,6 +60,10 @@ SearchContext* __stdcall DLL_API create(const Point* points_begin, const Point*
 int32_t __stdcall DLL_API search(SearchContext* sc, const Rect rect, const int32_t count, Point* out_points);
 SearchContext* __stdcall DLL_API destroy(SearchContext* sc);
 
+/* Fill "out" with the bytes allocated, node counts, leaf fill, empty cells and duplicated points of each structure in
+the context. Return the total number of bytes. */
+int64_t __stdcall DLL_API stats(SearchContext* sc, IndexStats* out);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -4,9 +4,19 @@
 #include <math.h>
 #include "gumptionaire.h"
 #include "iqsort.h"
+#include "core.h"
+#include "stats.h"
+#include "hugepages.h"
+#include "cpu.h"
+#include <immintrin.h>
 
 // #define DEBUG 0
-#define WRITEFILES 0
+#ifndef INSTRUMENT
+#define INSTRUMENT 0    // per-path query counters for counters(), at two TSC reads and a few atomic adds per search
+#endif
+#ifndef TRACE
+#define TRACE 0         // trace() and GUMPTIONAIRE_TRACE, at a check of the context's writer per search
+#endif
 
 #ifdef DEBUG
 	#define DPRINT(x) printf x
@@ -14,6 +24,16 @@
 	#define DPRINT(x) do {} while (0)
 #endif
 
+#if INSTRUMENT || TRACE
+	#include <x86intrin.h>
+#endif
+
+#if INSTRUMENT
+	#define EXAMINE(n) (examined += (n))
+#else
+	#define EXAMINE(n) do {} while (0)
+#endif
+
 // rank search parameters
 #define BASELIMIT 1000000
 
@@ -27,12 +47,43 @@
 
 // grid search parameters
 #define DIVS 175
+#define DENSITYRES 256
 #define GRIDFACTOR 1.0f
 #define LINTHRESH1 1000
 #define LINTHRESH2 1500
 #define LINTHRESH3 15000
 #define RANKMAX 100000000
 
+// quantized coordinate parameters
+#define QMAX 65535
+
+// memory parameters
+#define HUGEPAGES 1     // large arrays and the arena on 2MB pages, unless GUMPTIONAIRE_HUGEPAGES=0
+
+// region layout parameters
+#define REGIONINDEX 1   // region nodes keep positions into one rank-sorted copy of the points instead of their own copies
+
+// prefetch parameters
+#define PREFETCH 1
+#define PREFETCHAHEAD 4   // points fetched ahead of each grid merge head
+
+// batch search parameters
+#define HILBERTORDER 16
+#define BATCHGROUP 8      // queries whose region descents are walked side by side
+#define STEALCHUNK 64     // queries search_parallel workers take at a time, a multiple of BATCHGROUP
+
+// async search parameters
+#define ASYNCQUEUE 1024   // queries search_async lets wait before turning more away
+
+// shared memory parameters
+#define SHAREDMAGIC 0x316d6873706d7567ull  // "gumpshm1"
+#define SHAREDTRIES 8     // times attach_shared reads the version again when that version's segment has just gone
+
+// hilbert search parameters
+#define HILBERTSLABS 0
+#define HBLOCKSIZE 256
+#define HFANOUT 32
+
 // DEBUGGING --------------------------------------------------------------------------------------
 
 void printRect(Rect rect) {
@@ -64,12 +115,49 @@ void ranksort(struct Point *arr, unsigned n) {
 	QSORT(struct Point, arr, n, point_rank_lt);
 }
 
+void keysort(struct BatchKey *arr, unsigned n) {
+	#define batch_key_lt(a,b) ((a)->key < (b)->key)
+	QSORT(struct BatchKey, arr, n, batch_key_lt);
+}
+
 
 
 // HELPER FUNCTIONS -------------------------------------------------------------------------------
 
-int ops = 0;
-int totops = 0;
+#if INSTRUMENT || TRACE
+// points looked at by the kernels during the current search
+static thread_local int64_t examined = 0;
+#endif
+
+// the counters are shared by every thread searching a context, so they're added to atomically. Relaxed order is
+// enough, as nothing else is read through them
+inline void countAdd(int64_t* counter, int64_t n) {
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// add the counters of "from" to "to", clearing them if "reset". Each is read (and cleared) in one atomic step, so
+// searches still running on other threads lose nothing
+void takeCounters(QueryCounters* to, QueryCounters* from, bool reset) {
+	int64_t* t = (int64_t*)to;
+	int64_t* f = (int64_t*)from;
+	for (size_t i = 0; i < sizeof(QueryCounters) / sizeof(int64_t); i++) {
+		t[i] += reset ? __atomic_exchange_n(&f[i], 0, __ATOMIC_RELAXED) : __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+	}
+}
+
+inline void addId(IdMask* m, int8_t id) {
+	uint8_t b = (uint8_t)id;
+	m->bits[b >> 6] |= 1ull << (b & 63);
+}
+
+inline bool hasId(const IdMask* m, int8_t id) {
+	uint8_t b = (uint8_t)id;
+	return (m->bits[b >> 6] >> (b & 63)) & 1;
+}
+
+inline bool isIdOverlap(const IdMask* m1, const IdMask* m2) {
+	return ((m1->bits[0] & m2->bits[0]) | (m1->bits[1] & m2->bits[1]) | (m1->bits[2] & m2->bits[2]) | (m1->bits[3] & m2->bits[3])) != 0;
+}
 
 inline float rectArea(Rect* rect) {
 	return (rect->hx - rect->lx) * (rect->hy - rect->ly);
@@ -103,45 +191,43 @@ inline bool isHitY(Rect* r, Point* p) {
 	return p->y >= r->ly && p->y <= r->hy;
 }
 
-int bsearchx(Point p[], bool minOrMax, float v, int imin, int imax) {
-	while (imax >= imin) {
-		int imid = (imin + imax) / 2;
-		float val = p[imid].x;
-		if (val == v) {
-			if (minOrMax) {
-				while (imid > imin && p[imid-1].x == v) imid--;
-				return imid;
-			} else {
-				while (imid < imax && p[imid+1].x == v) imid++;
-				return imid;
+// map a cell of a 2^HILBERTORDER square grid to its distance along the hilbert curve
+uint32_t hilbertIndex(uint32_t x, uint32_t y) {
+	uint32_t d = 0;
+	for (uint32_t s = 1u << (HILBERTORDER - 1); s > 0; s >>= 1) {
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
 			}
+			uint32_t t = x; x = y; y = t;
 		}
-		else if (val < v) imin = imid + 1;
-		else imax = imid - 1;
 	}
-	return minOrMax ? imin : imax;
+	return d;
+}
+
+int bsearchx(Point p[], bool minOrMax, float v, int imin, int imax) {
+	return bsearchAxis<0>(p, minOrMax, v, imin, imax);
 }
 
 int bsearchy(Point p[], bool minOrMax, float v, int imin, int imax) {
-	while (imax >= imin) {
-		int imid = (imin + imax) / 2;
-		float val = p[imid].y;
-		if (val == v) {
-			if (minOrMax) {
-				while (imid > imin && p[imid-1].y == v) imid--;
-				return imid;
-			} else {
-				while (imid < imax && p[imid+1].y == v) imid++;
-				return imid;
-			}
-		}
-		else if (val < v) imin = imid + 1;
-		else imax = imid - 1;
-	}
-	return minOrMax ? imin : imax;
+	return bsearchAxis<1>(p, minOrMax, v, imin, imax);
+}
+
+// column (or row) of the grid cell that owns a point at "v": the first whose upper edge isn't below it. A point exactly
+// on an edge is stored in the cells on both sides of it, but only counted in the lower one
+int gridOwner(const float* edges, int divs, double lo, double d, float v) {
+	double di = (v - lo) / d;
+	int i = (di >= divs) ? divs - 1 : (di > 0 ? (int)di : 0);
+	while (i > 0 && v <= edges[i-1]) i--;
+	while (i < divs - 1 && v > edges[i]) i++;
+	return i;
 }
 
-int bvalsearch(float* restrict p, bool minOrMax, float v, int imin, int imax) {
+inline int bvalsearch(float* restrict p, bool minOrMax, float v, int imin, int imax) {
 	while (imax >= imin) {
 		int imid = (imin + imax) >> 1;
 		float val = p[imid];
@@ -160,208 +246,28 @@ int bvalsearch(float* restrict p, bool minOrMax, float v, int imin, int imax) {
 	return minOrMax ? imin : imax;
 }
 
-int32_t findHitsU(Rect* rect, Point* in, int n, Point* out, int count, bool (*hitcheck)(Rect* r, Point* p)) {
-	int i = 0;
-	int hits = 0;
-
-	// if fewer points in test buffer than allowed hits, use all hits
-	if (n <= count) {
-		for (int i = 0; i < n; i++) {
-			Point p = in[i];
-			if (hitcheck(rect, &p)) {
-				out[hits] = p;
-				hits++;
-			}
-		}
-		ranksort(out, hits);
-		return hits;
-	}
-
-	int j = 0;
-	int max = -1;
-	int maxloc = -1;
-
-	// start by filling out with the first count hits from in
-	while (i < n && hits < count) {
-		Point p = in[i];
-		if (hitcheck(rect, &p)) {
-			out[hits] = p;
-			if (p.rank > max) {
-				max = p.rank;
-				maxloc = hits;
-			}
-			hits++;
-		}
-		i++;
-	}
-
-	// search through the remaining points in in
-	while (i < n) {
-		Point p = in[i];
-		if (p.rank > max) {
-			i++;
-			continue;
-		}
-
-		if (hitcheck(rect, &p)) {
-			// replace previous max with this point
-			out[maxloc] = p;
-
-			// find new max
-			max = -1;
-			maxloc = -1;
-			for (j = 0; j < count; j++) {
-				if (out[j].rank > max) {
-					max = out[j].rank;
-					maxloc = j;
-				}
-			}
-		}
-		i++;
+// ranks are unique, so this is the position of "rank" in a rank sorted array
+int bsearchrank(int32_t* restrict p, int32_t rank, int imin, int imax) {
+	while (imax > imin) {
+		int imid = (imin + imax) >> 1;
+		if (p[imid] < rank) imin = imid + 1;
+		else imax = imid;
 	}
-
-	ranksort(out, hits);
-	return hits;
+	return imin;
 }
 
-int32_t findHitsUxV(const Rect* rect, int8_t* restrict ids, int32_t* restrict ranks, float* restrict xs, int n, Point* out, int count) {
-	int8_t* id    = (int8_t*)__builtin_assume_aligned(ids, 16);
-	int32_t* rank = (int32_t*)__builtin_assume_aligned(ranks, 16);
-	float* x      = (float*)__builtin_assume_aligned(xs, 16);
-
-	int i = 0;
-	int hits = 0;
-
-	// if fewer points in test buffer than allowed hits, use all hits
-	if (n <= count) {
-		for (int i = 0; i < n; i++) {
-			// ops += 2;
-			if (x[i] >= rect->lx && x[i] <= rect->hx) {
-				out[hits].id = id[i];
-				out[hits].rank = rank[i];
-				hits++;
-			}
-		}
-		ranksort(out, hits);
-		return hits;
-	}
-
-	int j = 0;
-	int max = -1;
-	int maxloc = -1;
-
-	// start by filling out with the first count hits from in
-	while (i < n && hits < count) {
-		// ops += 2;
-		if (x[i] >= rect->lx && x[i] <= rect->hx) {
-			out[hits].id = id[i];
-			out[hits].rank = rank[i];
-			if (rank[i] > max) {
-				max = rank[i];
-				maxloc = hits;
-			}
-			hits++;
-		}
-		i++;
-	}
-
-	// search through the remaining points in in
-	while (i < n) {
-		// ops += 1;
-		if (rank[i] > max) {
-			i++;
-			continue;
-		}
-
-		// ops += 2;
-		if (x[i] >= rect->lx && x[i] <= rect->hx) {
-			// replace previous max with this point
-			out[maxloc].id = id[i];
-			out[maxloc].rank = rank[i];
-
-			// find new max
-			max = -1;
-			maxloc = -1;
-			for (j = 0; j < count; j++) {
-				if (out[j].rank > max) {
-					max = out[j].rank;
-					maxloc = j;
-				}
-			}
-		}
-		i++;
-	}
-
-	ranksort(out, hits);
-	return hits;
+int32_t findHitsU(Rect* rect, Point* in, int n, Point* out, int count, bool (*hitcheck)(Rect* r, Point* p)) {
+	return findHitsWith(rect, in, n, out, count, hitcheck);
 }
 
-int32_t findHitsUyV(const Rect* rect, int8_t* restrict ids, int32_t* restrict ranks, float* restrict ys, int n, Point* out, int count) {
-	int8_t* id    = (int8_t*)__builtin_assume_aligned(ids, 16);
-	int32_t* rank = (int32_t*)__builtin_assume_aligned(ranks, 16);
-	float* y      = (float*)__builtin_assume_aligned(ys, 16);
-
-	int i = 0;
-	int hits = 0;
-
-	// if fewer points in test buffer than allowed hits, use all hits
-	if (n <= count) {
-		for (int i = 0; i < n; i++) {
-			if (y[i] >= rect->ly && y[i] <= rect->hy) {
-				out[hits].id = id[i];
-				out[hits].rank = rank[i];
-				hits++;
-			}
-		}
-		ranksort(out, hits);
-		return hits;
-	}
-
-	int j = 0;
-	int max = -1;
-	int maxloc = -1;
-
-	// start by filling out with the first count hits from in
-	while (i < n && hits < count) {
-		if (y[i] >= rect->ly && y[i] <= rect->hy) {
-			out[hits].id = id[i];
-			out[hits].rank = rank[i];
-			if (rank[i] > max) {
-				max = rank[i];
-				maxloc = hits;
-			}
-			hits++;
-		}
-		i++;
-	}
-
-	// search through the remaining points in in
-	while (i < n) {
-		if (rank[i] > max) {
-			i++;
-			continue;
-		}
-
-		if (y[i] >= rect->ly && y[i] <= rect->hy) {
-			// replace previous max with this point
-			out[maxloc].id = id[i];
-			out[maxloc].rank = rank[i];
-
-			// find new max
-			max = -1;
-			maxloc = -1;
-			for (j = 0; j < count; j++) {
-				if (out[j].rank > max) {
-					max = out[j].rank;
-					maxloc = j;
-				}
-			}
-		}
-		i++;
-	}
+inline int32_t findHitsUxV(const Rect* rect, int8_t* restrict ids, int32_t* restrict ranks, float* restrict xs, int n, Point* out, int count) {
+	EXAMINE(n);
+	return findHitsSlab<0, Rect, Point, ranksort>(rect, ids, ranks, xs, n, out, count);
+}
 
-	ranksort(out, hits);
-	return hits;
+inline int32_t findHitsUyV(const Rect* rect, int8_t* restrict ids, int32_t* restrict ranks, float* restrict ys, int n, Point* out, int count) {
+	EXAMINE(n);
+	return findHitsSlab<1, Rect, Point, ranksort>(rect, ids, ranks, ys, n, out, count);
 }
 
 int32_t findHitsS(const Rect* rect, Point* in, int n, Point* out, int count) {
@@ -372,14 +278,15 @@ int32_t findHitsS(const Rect* rect, Point* in, int n, Point* out, int count) {
 		if (p.x >= rect->lx && p.x <= rect->hx && p.y >= rect->ly && p.y <= rect->hy) {
 			out[k] = p;
 			k++;
-			if (k == count) return k;
+			if (k == count) { EXAMINE(i + 1); return k; }
 		}
 		i++;
 	}
+	EXAMINE(n);
 	return k;
 }
 
-int32_t findHitsSV(const Rect* rect, int8_t* restrict ids, int32_t* restrict ranks, float* restrict xs, float* restrict ys, int n, Point* out, int count) {
+inline int32_t findHitsSV(const Rect* rect, int8_t* restrict ids, int32_t* restrict ranks, float* restrict xs, float* restrict ys, int n, Point* out, int count) {
 	int8_t* id    = (int8_t*)__builtin_assume_aligned(ids, 16);
 	int32_t* rank = (int32_t*)__builtin_assume_aligned(ranks, 16);
 	float* x      = (float*)__builtin_assume_aligned(xs, 16);
@@ -390,21 +297,124 @@ int32_t findHitsSV(const Rect* rect, int8_t* restrict ids, int32_t* restrict ran
 			out[k].id = id[i];
 			out[k].rank = rank[i];
 			k++;
-			if (k == count) return k;
+			if (k == count) { EXAMINE(i + 1); return k; }
+		}
+	}
+	EXAMINE(n);
+	return k;
+}
+
+// quantized hit test - coordinates are stored as 16 bit offsets into the node rect, so a whole 32 point chunk can be
+// tested in one compare. quantize() is monotone, so a point strictly between the quantized bounds is certainly a hit and
+// only points landing exactly on a bound need their float coordinates checked. If pos is set, the node stores positions into
+// ids/ranks/xs/ys rather than copies, and only the candidates are looked up
+inline double quantScale(float lo, float hi) {
+	return hi > lo ? (double)QMAX / ((double)hi - (double)lo) : 0;
+}
+
+inline int quantize(float v, float lo, double scale) {
+	double q = ((double)v - (double)lo) * scale;
+	if (!(q > 0)) return 0;
+	if (q >= QMAX) return QMAX;
+	return (int)q;
+}
+
+// which of the 32 points from c on are inside [qlx, qhx] x [qly, qhy] (maybe), and which strictly inside (sure)
+inline void quantMasks(uint16_t* restrict qxs, uint16_t* restrict qys, int c, int n, uint16_t qlx, uint16_t qhx, uint16_t qly, uint16_t qhy, uint32_t* maybe, uint32_t* sure) {
+	int m = (n - c >= 32) ? 32 : n - c;
+	*maybe = 0;
+	*sure = 0;
+	for (int j = 0; j < m; j++) {
+		uint16_t x = qxs[c+j], y = qys[c+j];
+		*maybe |= (uint32_t)(x >= qlx && x <= qhx && y >= qly && y <= qhy) << j;
+		*sure  |= (uint32_t)(x > qlx && x < qhx && y > qly && y < qhy) << j;
+	}
+}
+
+// quantMasks in one compare per bound
+__attribute__((target("avx512f,avx512bw")))
+inline void quantMasksWide(uint16_t* restrict qxs, uint16_t* restrict qys, int c, int n, uint16_t qlx, uint16_t qhx, uint16_t qly, uint16_t qhy, uint32_t* maybe, uint32_t* sure) {
+	__m512i vlx = _mm512_set1_epi16(qlx);
+	__m512i vhx = _mm512_set1_epi16(qhx);
+	__m512i vly = _mm512_set1_epi16(qly);
+	__m512i vhy = _mm512_set1_epi16(qhy);
+	__mmask32 tail = (n - c >= 32) ? 0xffffffffu : ((1u << (n - c)) - 1);
+	__m512i vx = _mm512_maskz_loadu_epi16(tail, &qxs[c]);
+	__m512i vy = _mm512_maskz_loadu_epi16(tail, &qys[c]);
+	__mmask32 inx = _mm512_mask_cmp_epu16_mask(tail, vx, vlx, _MM_CMPINT_NLT) & _mm512_cmp_epu16_mask(vx, vhx, _MM_CMPINT_LE);
+	__mmask32 iny = _mm512_mask_cmp_epu16_mask(tail, vy, vly, _MM_CMPINT_NLT) & _mm512_cmp_epu16_mask(vy, vhy, _MM_CMPINT_LE);
+	*maybe = inx & iny;
+	if (*maybe == 0) return;
+	*sure = *maybe
+		& _mm512_cmp_epu16_mask(vx, vlx, _MM_CMPINT_NLE) & _mm512_cmp_epu16_mask(vx, vhx, _MM_CMPINT_LT)
+		& _mm512_cmp_epu16_mask(vy, vly, _MM_CMPINT_NLE) & _mm512_cmp_epu16_mask(vy, vhy, _MM_CMPINT_LT);
+}
+
+// "Wide" tests 32 points with AVX-512, and is only called from kernels built for it
+template <bool Wide>
+int32_t findHitsSQ(const Rect* rect, const Rect* qrect, int8_t* restrict ids, int32_t* restrict ranks, float* restrict xs, float* restrict ys, int32_t* restrict pos, uint16_t* restrict qxs, uint16_t* restrict qys, int n, Point* out, int count) {
+	double sx = quantScale(qrect->lx, qrect->hx);
+	double sy = quantScale(qrect->ly, qrect->hy);
+	uint16_t qlx = quantize(rect->lx, qrect->lx, sx);
+	uint16_t qhx = quantize(rect->hx, qrect->lx, sx);
+	uint16_t qly = quantize(rect->ly, qrect->ly, sy);
+	uint16_t qhy = quantize(rect->hy, qrect->ly, sy);
+
+	int32_t k = 0;
+	for (int c = 0; c < n; c += 32) {
+		uint32_t maybe, sure;
+		if (Wide) quantMasksWide(qxs, qys, c, n, qlx, qhx, qly, qhy, &maybe, &sure);
+		else quantMasks(qxs, qys, c, n, qlx, qhx, qly, qhy, &maybe, &sure);
+		if (maybe == 0) continue;
+
+#if PREFETCH
+		// positions scatter the candidates through the rank sorted arrays, so start all of their loads at once
+		if (pos) {
+			for (uint32_t m = maybe; m; m &= m - 1) {
+				int i = pos[c + __builtin_ctz(m)];
+				__builtin_prefetch(&ranks[i]);
+				__builtin_prefetch(&ids[i]);
+				if (!((sure >> __builtin_ctz(m)) & 1)) {
+					__builtin_prefetch(&xs[i]);
+					__builtin_prefetch(&ys[i]);
+				}
+			}
+		}
+#endif
+
+		// walk candidates in index (rank) order, checking boundary points exactly
+		while (maybe) {
+			int j = __builtin_ctz(maybe);
+			int i = pos ? pos[c + j] : c + j;
+			maybe &= maybe - 1;
+			if (!((sure >> j) & 1) && !(xs[i] >= rect->lx && xs[i] <= rect->hx && ys[i] >= rect->ly && ys[i] <= rect->hy)) continue;
+
+			out[k].id = ids[i];
+			out[k].rank = ranks[i];
+			k++;
+			if (k == count) { EXAMINE(c + 32 < n ? c + 32 : n); return k; }
 		}
 	}
+	EXAMINE(n);
 	return k;
 }
 
-int32_t findHitsB(const Rect* rect, int b, Point** restrict blocks, int* restrict blocki, int* restrict blockn, Point* out, int count) {
+// merge the rank sorted lists in "blocks" smallest rank first, copying the points "take" accepts to "out" once each
+// until it holds count of them
+template <typename Take>
+inline int32_t mergeHits(int b, Point** restrict blocks, int* restrict blocki, int* restrict blockn, Point* out, int count, Take take) {
 	int* bi = (int*)__builtin_assume_aligned(blocki, 16);
-	int* bn = (int*)__builtin_assume_aligned(blockn, 16);
 
 	int32_t k = 0;
 	int minrank = RANKMAX;
 	int prank = -1;
 	int minb = -1;
 	int fin = 0;
+
+#if PREFETCH
+	// the heads sit in cells all over the grid, so start loading all of them before the first min scan
+	for (int i = 0; i < b; i++) __builtin_prefetch(&blocks[i][bi[i]]);
+#endif
 	while (k < count) {
 		minrank = RANKMAX;
 		fin = 0;
@@ -417,6 +427,7 @@ int32_t findHitsB(const Rect* rect, int b, Point** restrict blocks, int* restric
 			if (p.rank < minrank) {
 				if (p.rank == prank) {
 					bi[i]++;
+					if (bi[i] >= blockn[i]) { fin++; continue; }
 					p = blocks[i][bi[i]];
 					if (p.rank < minrank) {
 						minb = i;
@@ -433,30 +444,171 @@ int32_t findHitsB(const Rect* rect, int b, Point** restrict blocks, int* restric
 		if (fin == b) break;
 
 		Point bestp = blocks[minb][bi[minb]];
-		if (bestp.x >= rect->lx && bestp.x <= rect->hx && bestp.y >= rect->ly && bestp.y <= rect->hy) {
+		EXAMINE(1);
+		if (take(bestp)) {
 			out[k] = bestp;
 			prank = bestp.rank;
 			k++;
 		}
 		bi[minb]++;
+#if PREFETCH
+		__builtin_prefetch(&blocks[minb][bi[minb] + PREFETCHAHEAD]);
+#endif
 	}
 
 	return k;
 }
 
+inline int32_t findHitsB(const Rect* rect, int b, Point** restrict blocks, int* restrict blocki, int* restrict blockn, Point* out, int count) {
+	return mergeHits(b, blocks, blocki, blockn, out, count, [rect](const Point& p) {
+		return p.x >= rect->lx && p.x <= rect->hx && p.y >= rect->ly && p.y <= rect->hy;
+	});
+}
+
+// findHitsB, only taking points whose id is in "ids"
+int32_t findHitsBI(const Rect* rect, const IdMask* ids, int b, Point** restrict blocks, int* restrict blocki, int* restrict blockn, Point* out, int count) {
+	return mergeHits(b, blocks, blocki, blockn, out, count, [rect, ids](const Point& p) {
+		return p.x >= rect->lx && p.x <= rect->hx && p.y >= rect->ly && p.y <= rect->hy && hasId(ids, p.id);
+	});
+}
+
+
+
+// replace the current max in a full top-k buffer, or append while it is filling up
+inline void insertHit(Point* out, int count, int* hits, int* max, int* maxloc, int8_t id, int32_t rank) {
+	if (*hits < count) {
+		out[*hits].id = id;
+		out[*hits].rank = rank;
+		if (rank > *max) {
+			*max = rank;
+			*maxloc = *hits;
+		}
+		(*hits)++;
+		return;
+	}
+
+	out[*maxloc].id = id;
+	out[*maxloc].rank = rank;
+	*max = -1;
+	for (int j = 0; j < count; j++) {
+		if (out[j].rank > *max) {
+			*max = out[j].rank;
+			*maxloc = j;
+		}
+	}
+}
+
+void findHitsH(const Rect* rect, HBlock** levels, Points* restrict p, int level, int first, int n, Point* out, int count, int* hits, int* max, int* maxloc) {
+	HBlock* nodes = levels[level];
+	for (int b = first; b < first + n; b++) {
+		HBlock* node = &nodes[b];
+		if (*hits == count && node->minrank > *max) continue;
+		if (!isRectOverlap((Rect*)rect, &node->bbox)) continue;
+
+		if (level > 0) {
+			findHitsH(rect, levels, p, level - 1, node->start, node->n, out, count, hits, max, maxloc);
+			continue;
+		}
+
+		// points within a block are rank sorted, so stop as soon as they can't beat the current max
+		int end = node->start + node->n;
+		if (isRectInside((Rect*)rect, &node->bbox)) {
+			for (int i = node->start; i < end; i++) {
+				if (*hits == count && p->rank[i] > *max) break;
+				EXAMINE(1);
+				insertHit(out, count, hits, max, maxloc, p->id[i], p->rank[i]);
+			}
+		} else {
+			for (int i = node->start; i < end; i++) {
+				if (*hits == count && p->rank[i] > *max) break;
+				EXAMINE(1);
+				if (p->x[i] >= rect->lx && p->x[i] <= rect->hx && p->y[i] >= rect->ly && p->y[i] <= rect->hy) {
+					insertHit(out, count, hits, max, maxloc, p->id[i], p->rank[i]);
+				}
+			}
+		}
+	}
+}
+
+
+
+// KERNEL DISPATCH --------------------------------------------------------------------------------
+
+// the kernels built for one level: each wrapper inlines the kernel with everything it calls, so the whole loop is
+// compiled for "target"
+#define KERNELS(name, level, target, wide) \
+	target int32_t findHitsUxV_##name(const Rect* rect, int8_t* ids, int32_t* ranks, float* xs, int n, Point* out, int count) { \
+		return findHitsUxV(rect, ids, ranks, xs, n, out, count); \
+	} \
+	target int32_t findHitsUyV_##name(const Rect* rect, int8_t* ids, int32_t* ranks, float* ys, int n, Point* out, int count) { \
+		return findHitsUyV(rect, ids, ranks, ys, n, out, count); \
+	} \
+	target int32_t findHitsSV_##name(const Rect* rect, int8_t* ids, int32_t* ranks, float* xs, float* ys, int n, Point* out, int count) { \
+		return findHitsSV(rect, ids, ranks, xs, ys, n, out, count); \
+	} \
+	target int32_t findHitsSQ_##name(const Rect* rect, const Rect* qrect, int8_t* ids, int32_t* ranks, float* xs, float* ys, int32_t* pos, uint16_t* qxs, uint16_t* qys, int n, Point* out, int count) { \
+		return findHitsSQ<wide>(rect, qrect, ids, ranks, xs, ys, pos, qxs, qys, n, out, count); \
+	} \
+	target int32_t findHitsB_##name(const Rect* rect, int b, Point** blocks, int* blocki, int* blockn, Point* out, int count) { \
+		return findHitsB(rect, b, blocks, blocki, blockn, out, count); \
+	} \
+	target int bvalsearch_##name(float* p, bool minOrMax, float v, int imin, int imax) { \
+		return bvalsearch(p, minOrMax, v, imin, imax); \
+	} \
+	const Kernels kernels_##name = { \
+		level, findHitsUxV_##name, findHitsUyV_##name, findHitsSV_##name, findHitsSQ_##name, findHitsB_##name, bvalsearch_##name \
+	};
+
+KERNELS(base, CPU_BASE, , false)
+KERNELS(sse42, CPU_SSE42, TARGET_SSE42, false)
+KERNELS(avx2, CPU_AVX2, TARGET_AVX2, false)
+KERNELS(avx512, CPU_AVX512, TARGET_AVX512, true)
+
+const Kernels* chooseKernels() {
+	static const Kernels* levels[NCPULEVELS] = { &kernels_base, &kernels_sse42, &kernels_avx2, &kernels_avx512 };
+	return levels[cpuLevelCapped(getenv("GUMPTIONAIRE_CPU"))];
+}
+
 
 
 // SEARCH IMPLEMENTATIONS -------------------------------------------------------------------------
 
+// hilbert search - walk the packed hilbert blocks overlapping rect, skipping any that can't beat the current top-k
+int32_t hilbertHits(GumpSearchContext* sc, const Rect* rect, Point* out_points, int count) {
+	int hits = 0, max = -1, maxloc = -1;
+	int top = sc->nhlevels - 1;
+	findHitsH(rect, sc->hlevels, sc->hpoints, top, 0, sc->hlevelN[top], out_points, count, &hits, &max, &maxloc);
+	ranksort(out_points, hits);
+	return hits;
+}
+
+// x slab - points in [xidxl, xidxl + nx) of the x sorted points, tested for y
+int32_t xslabHits(GumpSearchContext* sc, const Rect* rect, int xidxl, int nx, Point* out_points, int count) {
+#if HILBERTSLABS
+	return hilbertHits(sc, rect, out_points, count);
+#else
+	return sc->kernels->slaby(rect, &sc->xpoints->id[xidxl], &sc->xpoints->rank[xidxl], &sc->xpoints->y[xidxl], nx, out_points, count);
+#endif
+}
+
+// y slab - points in [yidxl, yidxl + ny) of the y sorted points, tested for x
+int32_t yslabHits(GumpSearchContext* sc, const Rect* rect, int yidxl, int ny, Point* out_points, int count) {
+#if HILBERTSLABS
+	return hilbertHits(sc, rect, out_points, count);
+#else
+	return sc->kernels->slabx(rect, &sc->ypoints->id[yidxl], &sc->ypoints->rank[yidxl], &sc->ypoints->x[yidxl], ny, out_points, count);
+#endif
+}
+
 // binary search - narrow search to points in x range, y range, and check smaller set
 int32_t searchBinary(GumpSearchContext* sc, const Rect rect, const int32_t count, Point* out_points) {
-	int xidxl = bvalsearch(sc->xpoints->x, true, rect.lx, 0, sc->N);
-	int xidxr = bvalsearch(sc->xpoints->x, false, rect.hx, 0, sc->N);
+	int xidxl = sc->kernels->bound(sc->xpoints->x, true, rect.lx, 0, sc->N - 1);
+	int xidxr = sc->kernels->bound(sc->xpoints->x, false, rect.hx, 0, sc->N - 1);
 	int nx = xidxr - xidxl + 1;
 	if (nx == 0) return 0;
 
-	int yidxl = bvalsearch(sc->ypoints->y, true, rect.ly, 0, sc->N);
-	int yidxr = bvalsearch(sc->ypoints->y, false, rect.hy, 0, sc->N);
+	int yidxl = sc->kernels->bound(sc->ypoints->y, true, rect.ly, 0, sc->N - 1);
+	int yidxr = sc->kernels->bound(sc->ypoints->y, false, rect.hy, 0, sc->N - 1);
 	int ny = yidxr - yidxl + 1;
 	if (ny == 0) return 0;
 
@@ -467,76 +619,857 @@ int32_t searchBinary(GumpSearchContext* sc, const Rect rect, const int32_t count
 }
 
 
-int32_t regionHits(GumpSearchContext* sc, Rect rect, Region* region, int count, Point* out_points) {
-	if (region->n == 0) return 0;
+inline int32_t nodeHits(GumpSearchContext* sc, const Rect* rect, Region* region, Point* out_points, int count) {
+	Points* p = region->rankpoints;
+	if (p->pos == NULL) return sc->kernels->quant(rect, region->rect, p->id, p->rank, p->x, p->y, NULL, p->qx, p->qy, p->n, out_points, count);
+	Points* all = sc->rankpoints;
+	return sc->kernels->quant(rect, region->rect, all->id, all->rank, all->x, all->y, p->pos, p->qx, p->qy, p->n, out_points, count);
+}
 
-	// if this is a leaf, check it
-	if (region->left == NULL) {
-		Points* p = region->rankpoints;
-		int hits = findHitsSV((Rect*)&rect, p->id, p->rank, p->x, p->y, p->n, out_points, count);
-		if (hits < count) return -1;
-		return hits;
-	}
+// start loading everything the descent may read at "region": the children it tests, and its own points struct in case
+// none of them contains the rect
+inline void prefetchRegion(Region* region) {
+#if PREFETCH
+	__builtin_prefetch(region->rankpoints);
+	if (region->left == NULL) return;
+	__builtin_prefetch(region->left);
+	__builtin_prefetch(region->right);
+	__builtin_prefetch(region->lrmid);
+	__builtin_prefetch(region->bottom);
+	__builtin_prefetch(region->top);
+	__builtin_prefetch(region->btmid);
+#endif
+}
 
-	// look for a child that fully contains this rect
-	if (sc->w < region->subw) {
-		if (isRectInside(region->left->rect,   &rect)) return regionHits(sc, rect, region->left,   count, out_points);
-		if (isRectInside(region->right->rect,  &rect)) return regionHits(sc, rect, region->right,  count, out_points);
-		if (isRectInside(region->lrmid->rect,  &rect)) return regionHits(sc, rect, region->lrmid,  count, out_points);
+// the child of "region" that fully contains "rect", or NULL if there isn't one (or region is a leaf)
+inline Region* containingChild(Region* region, Rect* rect, float w, float h) {
+	if (region->left == NULL) return NULL;
+	if (w < region->subw) {
+		if (isRectInside(region->left->rect,   rect)) return region->left;
+		if (isRectInside(region->right->rect,  rect)) return region->right;
+		if (isRectInside(region->lrmid->rect,  rect)) return region->lrmid;
 	}
-	if (sc->h < region->subh) {
-		if (isRectInside(region->bottom->rect, &rect)) return regionHits(sc, rect, region->bottom, count, out_points);
-		if (isRectInside(region->top->rect,    &rect)) return regionHits(sc, rect, region->top,    count, out_points);
-		if (isRectInside(region->btmid->rect,  &rect)) return regionHits(sc, rect, region->btmid,  count, out_points);
+	if (h < region->subh) {
+		if (isRectInside(region->bottom->rect, rect)) return region->bottom;
+		if (isRectInside(region->top->rect,    rect)) return region->top;
+		if (isRectInside(region->btmid->rect,  rect)) return region->btmid;
 	}
-
-	// if not fully contained in any children, check self
-	Points* p = region->rankpoints;
-	int hits = findHitsSV((Rect*)&rect, p->id, p->rank, p->x, p->y, p->n, out_points, count);
-	if (hits < count) return -1;
-	return hits;
+	return NULL;
 }
 
+int32_t regionHits(GumpSearchContext* sc, Scratch* s, Rect rect, Region* region, int count, Point* out_points) {
+	if (region->n == 0) return 0;
+	prefetchRegion(region);
 
+	// look for a child that fully contains this rect
+	Region* child = containingChild(region, &rect, s->w, s->h);
+	if (child) return regionHits(sc, s, rect, child, count, out_points);
 
-// DLL IMPLEMENTATION -----------------------------------------------------------------------------
+	// if this is a leaf or not fully contained in any children, check self
+	int hits = nodeHits(sc, &rect, region, out_points, count);
+	if (hits < count) return -1;
+	return hits;
+}
 
-int regions = 0;
+// the regions only hold points inside the bounds, so merge in any of the few beyond them that "take" accepts and that
+// beat the top-k found
+template <typename Take>
+int32_t mergeOutlierHits(GumpSearchContext* sc, int hits, int count, Point* out_points, Take take) {
+	for (int o = 0; o < sc->noutliers; o++) {
+		Point* p = &sc->outliers[o];
+		if (!take(p)) continue;
+		if (hits == count && p->rank > out_points[hits-1].rank) break;
+		int k = (hits < count) ? hits++ : hits - 1;
+		while (k > 0 && out_points[k-1].rank > p->rank) {
+			out_points[k] = out_points[k-1];
+			k--;
+		}
+		out_points[k] = *p;
+	}
+	return hits;
+}
 
-Points* buildPoints(int n) {
-	Points* p = (Points*)malloc(sizeof(Points));
-	p->n    = n;
-	p->id   = (int8_t*)calloc(n, sizeof(int8_t));
-	p->rank = (int32_t*)calloc(n, sizeof(int32_t));
-	p->x    = (float*)calloc(n, sizeof(float));
-	p->y    = (float*)calloc(n, sizeof(float));
-	return p;
+// mergeOutlierHits, taking the points inside rect. If "ids" is set, only points with one of them
+int32_t mergeOutliers(GumpSearchContext* sc, Rect* rect, const IdMask* ids, int hits, int count, Point* out_points) {
+	return mergeOutlierHits(sc, hits, count, out_points, [rect, ids](Point* p) {
+		return isHit(rect, p) && (!ids || hasId(ids, p->id));
+	});
 }
 
-Points* copyPoints(Points* src) {
-	Points* p = (Points*)malloc(sizeof(Points));
-	p->n    = src->n;
-	p->id   = (int8_t*)calloc(src->n, sizeof(int8_t));
-	p->rank = (int32_t*)calloc(src->n, sizeof(int32_t));
-	p->x    = (float*)calloc(src->n, sizeof(float));
-	p->y    = (float*)calloc(src->n, sizeof(float));
-	memcpy(p->id,   src->id,   p->n * sizeof(int8_t));
-	memcpy(p->rank, src->rank, p->n * sizeof(int32_t));
-	memcpy(p->x,    src->x,    p->n * sizeof(float));
-	memcpy(p->y,    src->y,    p->n * sizeof(float));
-	return p;
+// points the cells in columns [i0, i1] and rows [j0, j1] own
+inline int32_t gridSum(GumpSearchContext* sc, int i0, int i1, int j0, int j1) {
+	int stride = sc->divs + 1;
+	int32_t* s = sc->gridsum;
+	return s[(i1+1) * stride + j1 + 1] - s[i0 * stride + j1 + 1] - s[(i1+1) * stride + j0] + s[i0 * stride + j0];
 }
 
-void fillPoints(Points* p, Point* arr, int n) {
-	for (int i = 0; i < n; i++) {
-		p->id[i]   = arr[i].id;
-		p->rank[i] = arr[i].rank;
-		p->x[i]    = arr[i].x;
-		p->y[i]    = arr[i].y;
+// points of cell (i, j) inside rect that the cell owns, stopping at "limit"
+int32_t cellCount(GumpSearchContext* sc, const Rect* rect, int i, int j, int32_t limit) {
+	float ox = (i > 0) ? sc->gridx[i-1] : -INFINITY;
+	float oy = (j > 0) ? sc->gridy[j-1] : -INFINITY;
+	Point* p = sc->grid[i][j];
+	int32_t n = 0;
+	for (int k = 0; k < sc->dlen[i][j] && n < limit; k++) {
+		n += p[k].x >= rect->lx && p[k].x <= rect->hx && p[k].y >= rect->ly && p[k].y <= rect->hy
+			&& p[k].x > ox && p[k].y > oy;
 	}
+	return n;
 }
 
-void fillPointArr(Point* arr, Points* p) {
+// count search - cells strictly inside rect come from the prefix sums in O(1), and only the ring of cells cut by its
+// edges is scanned. Stop once "limit" points are found
+int32_t countGrid(GumpSearchContext* sc, const Rect* rect, int32_t limit) {
+	if (sc->N == 0 || !(rect->lx <= rect->hx && rect->ly <= rect->hy)) return 0;
+	int i0 = gridOwner(sc->gridx, sc->divs, sc->bounds->lx, sc->dx, rect->lx);
+	int i1 = gridOwner(sc->gridx, sc->divs, sc->bounds->lx, sc->dx, rect->hx);
+	int j0 = gridOwner(sc->gridy, sc->divs, sc->bounds->ly, sc->dy, rect->ly);
+	int j1 = gridOwner(sc->gridy, sc->divs, sc->bounds->ly, sc->dy, rect->hy);
+
+	// the outer cells also hold the points beyond the bounds, so they are never taken as covered
+	int a0 = (i0 + 1 > 1) ? i0 + 1 : 1, a1 = (i1 - 1 < sc->divs - 2) ? i1 - 1 : sc->divs - 2;
+	int b0 = (j0 + 1 > 1) ? j0 + 1 : 1, b1 = (j1 - 1 < sc->divs - 2) ? j1 - 1 : sc->divs - 2;
+	bool inner = a0 <= a1 && b0 <= b1;
+	int32_t n = inner ? gridSum(sc, a0, a1, b0, b1) : 0;
+
+	for (int i = i0; i <= i1 && n < limit; i++) {
+		for (int j = j0; j <= j1 && n < limit; j++) {
+			if (inner && i >= a0 && i <= a1 && j == b0) { j = b1; continue; }
+			if (sc->dlen[i][j] == 0) continue;
+			Rect* d = &sc->drect[i][j];
+			if (!isRectOverlap((Rect*)rect, d)) continue;
+			if (isRectInside((Rect*)rect, d)) n += gridSum(sc, i, i, j, j);
+			else n += cellCount(sc, rect, i, j, limit - n);
+		}
+	}
+	return n < limit ? n : limit;
+}
+
+
+
+// BUILD SIZING -----------------------------------------------------------------------------------
+
+void defaultParams(BuildParams* params) {
+	params->divs     = DIVS;
+	params->maxdepth = MAXDEPTH;
+	params->nodesize = NODESIZE;
+	params->leafsize = LEAFSIZE;
+	params->maxleaf  = MAXLEAF;
+	params->budget   = 0;
+	params->estimate = 0;
+	params->bytes    = 0;
+}
+
+int64_t gridBytes(int divs) {
+	return (int64_t)divs * (sizeof(Point**) + 2 * sizeof(Rect*) + sizeof(int*) + sizeof(IdMask*) + 2 * sizeof(float))
+		+ (int64_t)divs * divs * (sizeof(Point*) + 2 * sizeof(Rect) + sizeof(int) + sizeof(IdMask))
+		+ (int64_t)(divs + 1) * (divs + 1) * sizeof(int32_t);
+}
+
+int64_t scratchBytes(int divs) {
+	return sizeof(Scratch) + (int64_t)divs * divs * (sizeof(Point*) + 2 * sizeof(int)) + 2 * sizeof(Rect);
+}
+
+int64_t regionNodeBytes(int n, bool leaf) {
+#if REGIONINDEX
+	int64_t bytes = sizeof(Region) + sizeof(Points) + (int64_t)n * (sizeof(int32_t) + 2 * sizeof(uint16_t));
+#else
+	int64_t bytes = sizeof(Region) + sizeof(Points) + (int64_t)n * (sizeof(int8_t) + sizeof(int32_t) + 2 * sizeof(float) + 2 * sizeof(uint16_t));
+#endif
+	if (!leaf) bytes += 6 * sizeof(Rect);
+	return bytes;
+}
+
+// coarse histogram of the points, kept as prefix sums so the count in any rect can be interpolated in constant time
+struct Density {
+	Rect bounds;
+	double* sum;
+};
+
+void buildDensity(Density* d, const Point* points, int N) {
+	// bounds match create(): the second smallest and second largest coordinate
+	float x0 = points[0].x, x1 = points[0].x, x2 = points[0].x, x3 = points[0].x;
+	float y0 = points[0].y, y1 = points[0].y, y2 = points[0].y, y3 = points[0].y;
+	for (int i = 1; i < N; i++) {
+		float x = points[i].x, y = points[i].y;
+		if (i == 1 || x < x1) { if (x < x0) { x1 = x0; x0 = x; } else x1 = x; }
+		if (i == 1 || x > x2) { if (x > x3) { x2 = x3; x3 = x; } else x2 = x; }
+		if (i == 1 || y < y1) { if (y < y0) { y1 = y0; y0 = y; } else y1 = y; }
+		if (i == 1 || y > y2) { if (y > y3) { y2 = y3; y3 = y; } else y2 = y; }
+	}
+	d->bounds.lx = x1; d->bounds.hx = x2;
+	d->bounds.ly = y1; d->bounds.hy = y2;
+
+	int res = DENSITYRES;
+	d->sum = (double*)calloc((res + 1) * (res + 1), sizeof(double));
+	// a flat extent (fewer than 4 points, or every point on one line) puts everything in the first row or column
+	double sx = (x2 > x1) ? res / ((double)x2 - x1) : 0, sy = (y2 > y1) ? res / ((double)y2 - y1) : 0;
+	for (int i = 0; i < N; i++) {
+		int a = (int)(((double)points[i].x - x1) * sx); if (a < 0) a = 0; if (a >= res) a = res - 1;
+		int b = (int)(((double)points[i].y - y1) * sy); if (b < 0) b = 0; if (b >= res) b = res - 1;
+		d->sum[(a + 1) * (res + 1) + b + 1] += 1;
+	}
+	for (int a = 1; a <= res; a++) {
+		for (int b = 1; b <= res; b++) {
+			d->sum[a * (res + 1) + b] += d->sum[(a - 1) * (res + 1) + b] + d->sum[a * (res + 1) + b - 1] - d->sum[(a - 1) * (res + 1) + b - 1];
+		}
+	}
+}
+
+double densityPrefix(Density* d, double u, double v) {
+	int res = DENSITYRES;
+	u = (u < 0) ? 0 : (u > res) ? res : u;
+	v = (v < 0) ? 0 : (v > res) ? res : v;
+	int a = (int)u; if (a == res) a--;
+	int b = (int)v; if (b == res) b--;
+	double fu = u - a, fv = v - b;
+	double* s = d->sum;
+	return s[a * (res + 1) + b] * (1 - fu) * (1 - fv) + s[(a + 1) * (res + 1) + b] * fu * (1 - fv)
+		+ s[a * (res + 1) + b + 1] * (1 - fu) * fv + s[(a + 1) * (res + 1) + b + 1] * fu * fv;
+}
+
+double densityCount(Density* d, double lx, double ly, double hx, double hy) {
+	double sx = (d->bounds.hx > d->bounds.lx) ? DENSITYRES / ((double)d->bounds.hx - d->bounds.lx) : 0;
+	double sy = (d->bounds.hy > d->bounds.ly) ? DENSITYRES / ((double)d->bounds.hy - d->bounds.ly) : 0;
+	double u1 = (lx - d->bounds.lx) * sx, u2 = (hx - d->bounds.lx) * sx;
+	double v1 = (ly - d->bounds.ly) * sy, v2 = (hy - d->bounds.ly) * sy;
+	return densityPrefix(d, u2, v2) - densityPrefix(d, u1, v2) - densityPrefix(d, u2, v1) + densityPrefix(d, u1, v1);
+}
+
+// estimate the region dag footprint by walking its geometry depth by depth. A node at depth d has been split a times
+// in x and b times in y (a + b = d - 1), and the six child rects of every node put it at one of 2^(a+1)-1 x offsets
+// and 2^(b+1)-1 y offsets. Every offset exists above the leaf levels; at the last level only the children of nodes
+// that were too full to become leaves are built
+int64_t estimateRegions(Density* d, BuildParams* params) {
+	int md = params->maxdepth;
+	if (md <= 0) return 0;
+
+	double W = (double)d->bounds.hx - d->bounds.lx;
+	double H = (double)d->bounds.hy - d->bounds.ly;
+	int64_t bytes = 0;
+
+	// children of internal nodes one level above the deepest, indexed [a][i * ny + j]
+	bool** built = (bool**)calloc(md, sizeof(bool*));
+	for (int a = 0; a < md; a++) {
+		int b = md - 1 - a;
+		built[a] = (bool*)calloc(((1 << (a + 1)) - 1) * ((1 << (b + 1)) - 1), sizeof(bool));
+	}
+
+	for (int depth = 1; depth <= md; depth++) {
+		for (int a = 0; a < depth; a++) {
+			int b = depth - 1 - a;
+			int nx = (1 << (a + 1)) - 1, ny = (1 << (b + 1)) - 1;
+			double w = W / (1 << a), h = H / (1 << b);
+			for (int i = 0; i < nx; i++) {
+				for (int j = 0; j < ny; j++) {
+					if (depth == md && depth > 1 && !built[a][i * ny + j]) continue;
+
+					double lx = d->bounds.lx + i * w / 2, ly = d->bounds.ly + j * h / 2;
+					double est = densityCount(d, lx, ly, lx + w, ly + h);
+					bool leaf = depth >= md || (depth == md - 1 && depth >= BLOCKCHECK && est < params->maxleaf);
+					int len = leaf ? params->leafsize : params->nodesize;
+					bytes += regionNodeBytes(est < len ? (int)est : len, leaf);
+					if (leaf || depth != md - 1) continue;
+
+					// x splits move to a + 1 (offsets double), y splits to b + 1
+					int cny = 2 * ny + 1;
+					built[a + 1][(2 * i) * ny + j] = true;
+					built[a + 1][(2 * i + 1) * ny + j] = true;
+					built[a + 1][(2 * i + 2) * ny + j] = true;
+					built[a][i * cny + 2 * j] = true;
+					built[a][i * cny + 2 * j + 1] = true;
+					built[a][i * cny + 2 * j + 2] = true;
+				}
+			}
+		}
+	}
+
+	for (int a = 0; a < md; a++) free(built[a]);
+	free(built);
+	return bytes;
+}
+
+int64_t estimateBytes(Density* d, int N, BuildParams* params) {
+	int64_t bytes = sizeof(GumpSearchContext) + scratchBytes(params->divs) + gridBytes(params->divs);
+
+	// grid cells hold every point once, plus the few on cell boundaries
+	bytes += (int64_t)N * sizeof(Point) * 1001 / 1000;
+
+#if HILBERTSLABS
+	bytes += 2 * (sizeof(Points) + (int64_t)N * sizeof(float));
+	bytes += sizeof(Points) + (int64_t)N * (sizeof(int8_t) + sizeof(int32_t) + 2 * sizeof(float));
+	bytes += (int64_t)N / HBLOCKSIZE * sizeof(HBlock) * HFANOUT / (HFANOUT - 1);
+#else
+	bytes += 2 * (sizeof(Points) + (int64_t)N * (sizeof(int8_t) + sizeof(int32_t) + 2 * sizeof(float)));
+#endif
+
+	// rank sorted copy the region nodes index into, and one grouped by id
+	bytes += sizeof(Points) + (int64_t)N * (sizeof(int8_t) + sizeof(int32_t) + 2 * sizeof(float));
+	bytes += sizeof(Points) + (int64_t)N * (sizeof(int32_t) + 2 * sizeof(float));
+
+	return bytes + estimateRegions(d, params);
+}
+
+// pick the largest region tree, then the longest region lists, that fit the budget. Lists below 300 points fail often
+// enough that a shallower tree with full lists is tried first; the grid is only shrunk once the region tree is gone
+bool chooseParams(const Point* points, int N, int64_t budget, BuildParams* params) {
+	static const int lists[][2] = { { LEAFSIZE, NODESIZE }, { 450, 375 }, { 300, 250 }, { 150, 125 } };
+	static const int grids[] = { DIVS, 128, 96, 64, 32 };
+	const int nlists = sizeof(lists) / sizeof(lists[0]);
+	const int ngrids = sizeof(grids) / sizeof(grids[0]);
+
+	defaultParams(params);
+	params->budget = budget;
+	if (N < 4) return true;
+
+	Density d;
+	buildDensity(&d, points, N);
+
+	bool fit = false;
+	for (int pass = 0; pass < 2 && !fit; pass++) {
+		for (int depth = MAXDEPTH; depth > 0 && !fit; depth--) {
+			for (int l = (pass == 0 ? 0 : nlists - 1); l < (pass == 0 ? nlists - 1 : nlists) && !fit; l++) {
+				params->maxdepth = depth;
+				params->leafsize = lists[l][0];
+				params->nodesize = lists[l][1];
+				params->estimate = estimateBytes(&d, N, params);
+				fit = params->estimate <= budget;
+			}
+		}
+	}
+
+	for (int g = 0; g < ngrids && !fit; g++) {
+		params->maxdepth = 0;
+		params->divs = grids[g];
+		params->estimate = estimateBytes(&d, N, params);
+		fit = params->estimate <= budget;
+	}
+
+	free(d.sum);
+	return fit;
+}
+
+
+
+// STATISTICS -------------------------------------------------------------------------------------
+
+int64_t pointsBytes(Points* p) {
+	int64_t bytes = sizeof(Points);
+	if (p->id)   bytes += p->n * sizeof(int8_t);
+	if (p->rank) bytes += p->n * sizeof(int32_t);
+	if (p->x)    bytes += p->n * sizeof(float);
+	if (p->y)    bytes += p->n * sizeof(float);
+	if (p->qx)   bytes += p->n * sizeof(uint16_t);
+	if (p->qy)   bytes += p->n * sizeof(uint16_t);
+	if (p->pos)  bytes += p->n * sizeof(int32_t);
+	return bytes;
+}
+
+// visit each node of the region dag once, following the same ownership rules as freeRegion. The first pass (no bits
+// in set yet) only finds the rank range of the stored points, the second marks them to count duplicates. Positions are
+// as unique as ranks, so index nodes are counted by position
+void statRegion(Region* region, bool left, bool lrmid, bool right, bool bottom, bool btmid, bool top, StructStats* s, RankSet* set) {
+	if (left   && region->left)   statRegion(region->left,   true,  true,  true,  true,  true, true,  s, set);
+	if (right  && region->right)  statRegion(region->right,  true,  true,  true,  true,  true, true,  s, set);
+	if (lrmid  && region->lrmid)  statRegion(region->lrmid,  false, true,  false, true,  true, true,  s, set);
+	if (bottom && region->bottom) statRegion(region->bottom, false, false, false, true,  true, true,  s, set);
+	if (top    && region->top)    statRegion(region->top,    false, false, false, true,  true, true,  s, set);
+	if (btmid  && region->btmid)  statRegion(region->btmid,  false, false, false, false, true, false, s, set);
+
+	Points* p = region->rankpoints;
+	int32_t* keys = p->pos ? p->pos : p->rank;
+	if (set->bits) {
+		for (int i = 0; i < p->n; i++) rankSetAdd(set, keys[i]);
+		return;
+	}
+	for (int i = 0; i < p->n; i++) rankSetWiden(set, keys[i]);
+
+	s->nodes++;
+	s->bytes += sizeof(Region) + pointsBytes(p);
+	if (region->crect) s->bytes += 6 * sizeof(Rect);
+	if (p->n == 0) s->empty++;
+	if (region->left == NULL) statLeaf(s, p->n);
+	s->points += p->n;
+}
+
+void statRegions(GumpSearchContext* sc, StructStats* s) {
+	RankSet set = { RANKMAX, -1, NULL, 0 };
+	statRegion(sc->root, true, true, true, true, true, true, s, &set);
+	rankSetAlloc(&set);
+	if (set.bits) statRegion(sc->root, true, true, true, true, true, true, s, &set);
+	s->duplicates = s->points - set.distinct;
+	free(set.bits);
+	statFinish(s);
+}
+
+void statGrid(GumpSearchContext* sc, StructStats* s) {
+	s->bytes = gridBytes(sc->divs);
+	for (int i = 0; i < sc->divs; i++) {
+		for (int j = 0; j < sc->divs; j++) {
+			int n = sc->dlen[i][j];
+			s->nodes++;
+			s->points += n;
+			s->bytes += n * sizeof(Point);
+			if (n == 0) s->empty++;
+			else statLeaf(s, n);
+		}
+	}
+
+	// points on a cell boundary are stored in both cells
+	s->duplicates = s->points - sc->N;
+	statFinish(s);
+}
+
+void statHilbert(GumpSearchContext* sc, StructStats* s) {
+	s->bytes = pointsBytes(sc->hpoints) + sc->nhlevels * (sizeof(HBlock*) + sizeof(int));
+	for (int l = 0; l < sc->nhlevels; l++) {
+		s->nodes += sc->hlevelN[l];
+		s->bytes += sc->hlevelN[l] * sizeof(HBlock);
+	}
+	for (int b = 0; b < sc->hlevelN[0]; b++) statLeaf(s, sc->hlevels[0][b].n);
+	s->points = sc->hpoints->n;
+	statFinish(s);
+}
+
+
+
+// ASYNC SEARCH -----------------------------------------------------------------------------------
+
+// take queries off the ring until the pool stops. The result goes to the worker's buffer first, and only to the
+// caller's once the lock shows the query wasn't cancelled while it ran
+THREADFN asyncWorker(void* arg) {
+	AsyncWorker* w = (AsyncWorker*)arg;
+	AsyncPool* p = w->pool;
+	lockAcquire(&p->lock);
+	while (true) {
+		while (p->n == 0 && !p->stop) condWait(&p->work, &p->lock);
+		if (p->stop) break;
+
+		AsyncQuery q = p->queue[p->head];
+		p->head = (p->head + 1) % p->capacity;
+		p->n--;
+		if (q.cancelled) continue;
+		w->ticket = q.ticket;
+		w->cancelled = false;
+		lockRelease(&p->lock);
+
+		if (q.count > w->bufn) {
+			free(w->buf);
+			w->buf = (Point*)malloc(q.count * sizeof(Point));
+			w->bufn = q.count;
+		}
+		int32_t hits = (q.count > 0) ? GUMPTIONAIRE(search)(p->sc, q.rect, q.count, w->buf) : 0;
+
+		lockAcquire(&p->lock);
+		w->ticket = 0;
+		if (w->cancelled) continue;
+		memcpy(q.out, w->buf, hits * sizeof(Point));
+		lockRelease(&p->lock);
+		q.done(q.user, hits);
+		lockAcquire(&p->lock);
+	}
+	lockRelease(&p->lock);
+	return 0;
+}
+
+// let the workers finish the queries they are running, then tell the callers of the queries still waiting
+void freePool(AsyncPool* p) {
+	lockAcquire(&p->lock);
+	p->stop = true;
+	condBroadcast(&p->work);
+	lockRelease(&p->lock);
+	for (int i = 0; i < p->nworkers; i++) threadJoin(p->workers[i].thread);
+
+	for (int i = 0; i < p->n; i++) {
+		AsyncQuery* q = &p->queue[(p->head + i) % p->capacity];
+		if (!q->cancelled) q->done(q->user, ASYNC_CANCELLED);
+	}
+	for (int i = 0; i < p->nworkers; i++) free(p->workers[i].buf);
+	free(p->workers);
+	free(p->queue);
+	condFree(&p->work);
+	lockFree(&p->lock);
+	free(p);
+}
+
+AsyncPool* startPool(SearchContext* sc, int nthreads, int capacity) {
+	AsyncPool* p = (AsyncPool*)malloc(sizeof(AsyncPool));
+	p->sc = sc;
+	lockInit(&p->lock);
+	condInit(&p->work);
+	p->capacity = capacity > 0 ? capacity : ASYNCQUEUE;
+	p->queue = (AsyncQuery*)malloc(p->capacity * sizeof(AsyncQuery));
+	p->head = 0;
+	p->n = 0;
+	p->next = 0;
+	p->stop = false;
+	p->nworkers = nthreads > 0 ? nthreads : cpuCount();
+	p->workers = (AsyncWorker*)calloc(p->nworkers, sizeof(AsyncWorker));
+	for (int i = 0; i < p->nworkers; i++) {
+		AsyncWorker* w = &p->workers[i];
+		w->pool = p;
+		if (threadStart(&w->thread, asyncWorker, w)) continue;
+
+		// stop the ones already started
+		p->nworkers = i;
+		freePool(p);
+		return NULL;
+	}
+	DPRINT(("Started %d async workers\n", p->nworkers));
+	return p;
+}
+
+// the context's pool, starting it if no search_async or start_async has. Of two threads starting it at once, one
+// keeps its pool and the other throws its own away
+AsyncPool* asyncPool(GumpSearchContext* gsc, int nthreads, int capacity, bool* started) {
+	AsyncPool* p = __atomic_load_n(&gsc->pool, __ATOMIC_ACQUIRE);
+	*started = false;
+	if (p) return p;
+	p = startPool((SearchContext*)gsc, nthreads, capacity);
+	if (!p) return NULL;
+
+	AsyncPool* expected = NULL;
+	if (__atomic_compare_exchange_n(&gsc->pool, &expected, p, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		*started = true;
+		return p;
+	}
+	freePool(p);
+	return expected;
+}
+
+
+
+// SHARED INDEX -----------------------------------------------------------------------------------
+
+// the magic also tells apart builds whose region and slab layouts differ
+inline uint64_t sharedMagic() {
+	return SHAREDMAGIC ^ ((uint64_t)HILBERTSLABS << 1) ^ (uint64_t)REGIONINDEX;
+}
+
+inline void* sharedPtr(char* base, int64_t offset) {
+	return offset ? base + offset : NULL;
+}
+
+// lays an index out in a segment. With no base it only measures the bytes needed
+struct Packer {
+	char* base;
+	int64_t used;
+};
+
+// "bytes" at the next cache line boundary, as the kernels expect of their arrays. Return its offset
+int64_t packReserve(Packer* pk, int64_t bytes) {
+	int64_t offset = (pk->used + 63) & ~(int64_t)63;
+	pk->used = offset + bytes;
+	return offset;
+}
+
+int64_t packBytes(Packer* pk, const void* src, int64_t bytes) {
+	if (!src) return 0;
+	int64_t offset = packReserve(pk, bytes);
+	if (pk->base) memcpy(pk->base + offset, src, bytes);
+	return offset;
+}
+
+// a divs x divs table kept as separate rows, stored row after row
+int64_t packRows(Packer* pk, void** rows, int divs, int64_t rowbytes) {
+	int64_t offset = packReserve(pk, divs * rowbytes);
+	if (pk->base) {
+		for (int i = 0; i < divs; i++) memcpy(pk->base + offset + i * rowbytes, rows[i], rowbytes);
+	}
+	return offset;
+}
+
+SharedPoints packPoints(Packer* pk, Points* p) {
+	SharedPoints sp;
+	sp.n    = p->n;
+	sp.id   = packBytes(pk, p->id,   p->n * sizeof(int8_t));
+	sp.rank = packBytes(pk, p->rank, p->n * sizeof(int32_t));
+	sp.x    = packBytes(pk, p->x,    p->n * sizeof(float));
+	sp.y    = packBytes(pk, p->y,    p->n * sizeof(float));
+	sp.qx   = packBytes(pk, p->qx,   p->n * sizeof(uint16_t));
+	sp.qy   = packBytes(pk, p->qy,   p->n * sizeof(uint16_t));
+	sp.pos  = packBytes(pk, p->pos,  p->n * sizeof(int32_t));
+	return sp;
+}
+
+void unpackPoints(char* base, const SharedPoints* sp, Points* p) {
+	p->n    = sp->n;
+	p->id   = (int8_t*)sharedPtr(base, sp->id);
+	p->rank = (int32_t*)sharedPtr(base, sp->rank);
+	p->x    = (float*)sharedPtr(base, sp->x);
+	p->y    = (float*)sharedPtr(base, sp->y);
+	p->qx   = (uint16_t*)sharedPtr(base, sp->qx);
+	p->qy   = (uint16_t*)sharedPtr(base, sp->qy);
+	p->pos  = (int32_t*)sharedPtr(base, sp->pos);
+}
+
+// list each node of the region dag once, following the same ownership rules as freeRegion
+void collectRegion(Region* region, bool left, bool lrmid, bool right, bool bottom, bool btmid, bool top, Region** nodes, int* n) {
+	if (left   && region->left)   collectRegion(region->left,   true,  true,  true,  true,  true, true,  nodes, n);
+	if (right  && region->right)  collectRegion(region->right,  true,  true,  true,  true,  true, true,  nodes, n);
+	if (lrmid  && region->lrmid)  collectRegion(region->lrmid,  false, true,  false, true,  true, true,  nodes, n);
+	if (bottom && region->bottom) collectRegion(region->bottom, false, false, false, true,  true, true,  nodes, n);
+	if (top    && region->top)    collectRegion(region->top,    false, false, false, true,  true, true,  nodes, n);
+	if (btmid  && region->btmid)  collectRegion(region->btmid,  false, false, false, false, true, false, nodes, n);
+	if (nodes) nodes[*n] = region;
+	(*n)++;
+}
+
+// the position of "region" in nodes, sorted by address
+int regionIndex(Region** nodes, int n, Region* region) {
+	if (!region) return -1;
+	int lo = 0, hi = n - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (nodes[mid] < region) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// lay the index out from offset 0 on, header first. Return the bytes it takes
+int64_t packIndex(GumpSearchContext* gsc, Packer* pk, Region** nodes, int nregions) {
+	SharedHeader h;
+	memset(&h, 0, sizeof(SharedHeader));
+	pk->used = sizeof(SharedHeader);
+	h.magic    = sharedMagic();
+	h.N        = gsc->N;
+	h.divs     = gsc->divs;
+	h.maxdepth = gsc->maxdepth;
+	h.nodesize = gsc->nodesize;
+	h.leafsize = gsc->leafsize;
+	h.maxleaf  = gsc->maxleaf;
+	h.root     = -1;
+
+	if (gsc->N > 0) {
+		int divs = gsc->divs;
+		h.bounds = *gsc->bounds;
+		memcpy(h.outliers, gsc->outliers, sizeof(gsc->outliers));
+		h.noutliers = gsc->noutliers;
+		h.area = gsc->area;
+		h.dx = gsc->dx;
+		h.dy = gsc->dy;
+		memcpy(h.idstart, gsc->idstart, sizeof(gsc->idstart));
+
+		h.xpoints    = packPoints(pk, gsc->xpoints);
+		h.ypoints    = packPoints(pk, gsc->ypoints);
+		h.rankpoints = packPoints(pk, gsc->rankpoints);
+		h.idpoints   = packPoints(pk, gsc->idpoints);
+#if HILBERTSLABS
+		h.hpoints  = packPoints(pk, gsc->hpoints);
+		h.nhlevels = gsc->nhlevels;
+		for (int l = 0; l < gsc->nhlevels; l++) {
+			h.hlevels[l] = packBytes(pk, gsc->hlevels[l], gsc->hlevelN[l] * sizeof(HBlock));
+			h.hlevelN[l] = gsc->hlevelN[l];
+		}
+#endif
+
+		h.gridx   = packBytes(pk, gsc->gridx, divs * sizeof(float));
+		h.gridy   = packBytes(pk, gsc->gridy, divs * sizeof(float));
+		h.gridsum = packBytes(pk, gsc->gridsum, (divs + 1) * (divs + 1) * sizeof(int32_t));
+		h.grect   = packRows(pk, (void**)gsc->grect, divs, divs * sizeof(Rect));
+		h.drect   = packRows(pk, (void**)gsc->drect, divs, divs * sizeof(Rect));
+		h.dlen    = packRows(pk, (void**)gsc->dlen,  divs, divs * sizeof(int));
+		h.dids    = packRows(pk, (void**)gsc->dids,  divs, divs * sizeof(IdMask));
+		int64_t* cells = (int64_t*)malloc((int64_t)divs * divs * sizeof(int64_t));
+		for (int i = 0; i < divs; i++) {
+			for (int j = 0; j < divs; j++) cells[i * divs + j] = packBytes(pk, gsc->grid[i][j], gsc->dlen[i][j] * sizeof(Point));
+		}
+		h.cells = packBytes(pk, cells, (int64_t)divs * divs * sizeof(int64_t));
+		free(cells);
+
+		SharedRegion* regions = (SharedRegion*)calloc(nregions > 0 ? nregions : 1, sizeof(SharedRegion));
+		for (int k = 0; k < nregions; k++) {
+			Region* r = nodes[k];
+			SharedRegion* sr = &regions[k];
+			sr->box  = r->box;
+			sr->subw = r->subw;
+			sr->subh = r->subh;
+			sr->n    = r->n;
+			sr->child[0] = regionIndex(nodes, nregions, r->left);
+			sr->child[1] = regionIndex(nodes, nregions, r->right);
+			sr->child[2] = regionIndex(nodes, nregions, r->lrmid);
+			sr->child[3] = regionIndex(nodes, nregions, r->bottom);
+			sr->child[4] = regionIndex(nodes, nregions, r->top);
+			sr->child[5] = regionIndex(nodes, nregions, r->btmid);
+			sr->crect  = packBytes(pk, r->crect, 6 * sizeof(Rect));
+			sr->points = packPoints(pk, r->rankpoints);
+			sr->ids    = r->ids;
+		}
+		h.regions  = packBytes(pk, regions, (int64_t)nregions * sizeof(SharedRegion));
+		h.nregions = nregions;
+		h.root     = regionIndex(nodes, nregions, gsc->root);
+		free(regions);
+	}
+
+	h.bytes = pk->used;
+	if (pk->base) memcpy(pk->base, &h, sizeof(SharedHeader));
+	return pk->used;
+}
+
+// point "gsc" at the index in the attached segment. The structures holding pointers are built in the process's own
+// memory, and everything else is searched where it is
+void unpackIndex(GumpSearchContext* gsc, SharedIndex* si) {
+	char* base = si->data.base;
+	SharedHeader* h = (SharedHeader*)base;
+	gsc->bounds = &h->bounds;
+	if (gsc->N == 0) return;
+
+	int divs = gsc->divs;
+	memcpy(gsc->outliers, h->outliers, sizeof(gsc->outliers));
+	gsc->noutliers = h->noutliers;
+	gsc->area = h->area;
+	gsc->dx = h->dx;
+	gsc->dy = h->dy;
+	memcpy(gsc->idstart, h->idstart, sizeof(gsc->idstart));
+
+	// the context's sorted points, then one per region
+	si->points = (Points*)malloc((5 + h->nregions) * sizeof(Points));
+	unpackPoints(base, &h->xpoints,    &si->points[0]); gsc->xpoints    = &si->points[0];
+	unpackPoints(base, &h->ypoints,    &si->points[1]); gsc->ypoints    = &si->points[1];
+	unpackPoints(base, &h->rankpoints, &si->points[2]); gsc->rankpoints = &si->points[2];
+	unpackPoints(base, &h->idpoints,   &si->points[3]); gsc->idpoints   = &si->points[3];
+#if HILBERTSLABS
+	unpackPoints(base, &h->hpoints,    &si->points[4]); gsc->hpoints    = &si->points[4];
+	gsc->nhlevels = h->nhlevels;
+	gsc->hlevels = (HBlock**)malloc(h->nhlevels * sizeof(HBlock*));
+	gsc->hlevelN = h->hlevelN;
+	for (int l = 0; l < h->nhlevels; l++) gsc->hlevels[l] = (HBlock*)sharedPtr(base, h->hlevels[l]);
+#endif
+
+	gsc->gridx   = (float*)sharedPtr(base, h->gridx);
+	gsc->gridy   = (float*)sharedPtr(base, h->gridy);
+	gsc->gridsum = (int32_t*)sharedPtr(base, h->gridsum);
+	gsc->grid  = (Point***)malloc(divs * sizeof(Point**));
+	gsc->grect = (Rect**)malloc(divs * sizeof(Rect*));
+	gsc->drect = (Rect**)malloc(divs * sizeof(Rect*));
+	gsc->dlen  = (int**)malloc(divs * sizeof(int*));
+	gsc->dids  = (IdMask**)malloc(divs * sizeof(IdMask*));
+	si->cells  = (Point**)malloc((int64_t)divs * divs * sizeof(Point*));
+	int64_t* cells = (int64_t*)sharedPtr(base, h->cells);
+	for (int i = 0; i < divs; i++) {
+		gsc->grid[i]  = &si->cells[i * divs];
+		gsc->grect[i] = (Rect*)(base + h->grect) + i * divs;
+		gsc->drect[i] = (Rect*)(base + h->drect) + i * divs;
+		gsc->dlen[i]  = (int*)(base + h->dlen) + i * divs;
+		gsc->dids[i]  = (IdMask*)(base + h->dids) + i * divs;
+		for (int j = 0; j < divs; j++) gsc->grid[i][j] = (Point*)sharedPtr(base, cells[i * divs + j]);
+	}
+
+	SharedRegion* shared = (SharedRegion*)sharedPtr(base, h->regions);
+	si->regions = (Region*)malloc((h->nregions > 0 ? h->nregions : 1) * sizeof(Region));
+	for (int k = 0; k < h->nregions; k++) {
+		SharedRegion* sr = &shared[k];
+		Region* r = &si->regions[k];
+		Region** child[6] = { &r->left, &r->right, &r->lrmid, &r->bottom, &r->top, &r->btmid };
+		r->box  = sr->box;
+		r->rect = &r->box;
+		r->subw = sr->subw;
+		r->subh = sr->subh;
+		r->n    = sr->n;
+		for (int c = 0; c < 6; c++) *child[c] = (sr->child[c] >= 0) ? &si->regions[sr->child[c]] : NULL;
+		r->crect      = (Rect*)sharedPtr(base, sr->crect);
+		r->ranksort   = NULL;
+		r->rankpoints = &si->points[5 + k];
+		unpackPoints(base, &sr->points, r->rankpoints);
+		r->ids = sr->ids;
+	}
+	gsc->root = (h->root >= 0) ? &si->regions[h->root] : NULL;
+}
+
+// close the segments, and for an attached context free what unpackIndex built
+void freeShared(GumpSearchContext* gsc) {
+	SharedIndex* si = gsc->shared;
+	if (si->attached && gsc->N > 0) {
+		free(gsc->grid);
+		free(gsc->grect);
+		free(gsc->drect);
+		free(gsc->dlen);
+		free(gsc->dids);
+#if HILBERTSLABS
+		free(gsc->hlevels);
+#endif
+		free(si->cells);
+		free(si->regions);
+		free(si->points);
+	}
+	shmClose(&si->data);
+	shmClose(&si->control);
+	free(si);
+	gsc->shared = NULL;
+}
+
+// the control segment of "name", made if no one has published under it yet
+bool openControl(SharedIndex* si, const char* name) {
+	char path[SHMNAME];
+	shmName(path, name, 0);
+	if (shmOpen(&si->control, path, true)) {
+		if (si->control.bytes >= (int64_t)sizeof(SharedControl) && ((SharedControl*)si->control.base)->magic == SHAREDMAGIC) return true;
+		shmClose(&si->control);
+	}
+	if (!shmCreate(&si->control, path, sizeof(SharedControl))) return false;
+	((SharedControl*)si->control.base)->magic = SHAREDMAGIC;
+	return true;
+}
+
+
+
+// DLL IMPLEMENTATION -----------------------------------------------------------------------------
+
+int regions = 0;
+
+Points* buildPoints(int n, bool huge) {
+	Points* p = (Points*)malloc(sizeof(Points));
+	p->n    = n;
+	p->id   = (int8_t*)hugeAlloc((int64_t)n * sizeof(int8_t), huge);
+	p->rank = (int32_t*)hugeAlloc((int64_t)n * sizeof(int32_t), huge);
+	p->x    = (float*)hugeAlloc((int64_t)n * sizeof(float), huge);
+	p->y    = (float*)hugeAlloc((int64_t)n * sizeof(float), huge);
+	p->qx   = NULL;
+	p->qy   = NULL;
+	p->pos  = NULL;
+	return p;
+}
+
+Points* copyPoints(Points* src) {
+	Points* p = buildPoints(src->n, false);
+	memcpy(p->id,   src->id,   p->n * sizeof(int8_t));
+	memcpy(p->rank, src->rank, p->n * sizeof(int32_t));
+	memcpy(p->x,    src->x,    p->n * sizeof(float));
+	memcpy(p->y,    src->y,    p->n * sizeof(float));
+	return p;
+}
+
+void fillPoints(Points* p, Point* arr, int n) {
+	for (int i = 0; i < n; i++) {
+		p->id[i]   = arr[i].id;
+		p->rank[i] = arr[i].rank;
+		p->x[i]    = arr[i].x;
+		p->y[i]    = arr[i].y;
+	}
+}
+
+void quantizePoints(GumpSearchContext* sc, Points* p, Point* arr, Rect* rect) {
+	double sx = quantScale(rect->lx, rect->hx);
+	double sy = quantScale(rect->ly, rect->hy);
+	p->qx = (uint16_t*)arenaAlloc(&sc->arena, p->n * sizeof(uint16_t), sc->huge);
+	p->qy = (uint16_t*)arenaAlloc(&sc->arena, p->n * sizeof(uint16_t), sc->huge);
+	for (int i = 0; i < p->n; i++) {
+		p->qx[i] = quantize(arr[i].x, rect->lx, sx);
+		p->qy[i] = quantize(arr[i].y, rect->ly, sy);
+	}
+}
+
+// points without their own copies - only positions into the rank sorted points, found by rank
+Points* indexPoints(GumpSearchContext* sc, Point* arr, int n) {
+	Points* all = sc->rankpoints;
+	Points* p = (Points*)calloc(1, sizeof(Points));
+	p->n   = n;
+	p->pos = (int32_t*)arenaAlloc(&sc->arena, n * sizeof(int32_t), sc->huge);
+	for (int i = 0; i < n; i++) p->pos[i] = bsearchrank(all->rank, arr[i].rank, 0, all->n - 1);
+	return p;
+}
+
+void fillPointArr(Point* arr, Points* p) {
 	for (int i = 0; i < p->n; i++) {
 		arr[i].id   = p->id[i];
 		arr[i].rank = p->rank[i];
@@ -545,19 +1478,58 @@ void fillPointArr(Point* arr, Points* p) {
 	}
 }
 
+// qx, qy and pos belong to the context's arena
 void freePoints(Points* p) {
-	free(p->id);
-	free(p->rank);
-	free(p->x);
-	free(p->y);
+	hugeFree(p->id,   (int64_t)p->n * sizeof(int8_t));
+	hugeFree(p->rank, (int64_t)p->n * sizeof(int32_t));
+	hugeFree(p->x,    (int64_t)p->n * sizeof(float));
+	hugeFree(p->y,    (int64_t)p->n * sizeof(float));
 	free(p);
 	p = NULL;
 }
 
+Scratch* buildScratch(int divs) {
+	Scratch* s = (Scratch*)malloc(sizeof(Scratch));
+	s->divs   = divs;
+	s->blocks = (Point**)calloc(divs*divs, sizeof(Point*));
+	s->blocki = (int*)calloc(divs*divs, sizeof(int));
+	s->blockn = (int*)calloc(divs*divs, sizeof(int));
+	return s;
+}
+
+void freeScratch(Scratch* s) {
+	free(s->blocks);
+	free(s->blocki);
+	free(s->blockn);
+	free(s);
+}
+
+// each thread keeps one scratch, big enough for every context it has searched, and frees it when it exits
+struct ThreadScratch {
+	Scratch* s;
+	~ThreadScratch() { if (s) freeScratch(s); }
+};
+static thread_local ThreadScratch threadScratch = { NULL };
+
+inline Scratch* searchScratch(GumpSearchContext* gsc) {
+	Scratch* s = threadScratch.s;
+	if (s && s->divs >= gsc->divs) return s;
+	if (s) freeScratch(s);
+	return threadScratch.s = buildScratch(gsc->divs);
+}
+
+// the replica on the calling thread's node, or the context itself if it isn't replicated
+inline GumpSearchContext* localReplica(GumpSearchContext* gsc) {
+	if (gsc->nreplicas < 2) return gsc;
+	GumpSearchContext* local = gsc->replicas[numaCurrentNode(gsc->topology)];
+	return local ? local : gsc;
+}
+
 Region* buildRegion(GumpSearchContext* sc, Rect* rect, Region* lover, Region* lrover, Region* rover, Region* bover, Region* btover, Region* tover, int depth) {
 	regions++;
 	Region* region = (Region*)malloc(sizeof(Region));
-	region->rect       = rect;
+	region->box        = *rect;
+	region->rect       = &region->box;
 	region->subw       = (rect->hx - rect->lx) / 2;
 	region->subh       = (rect->hy - rect->ly) / 2;
 	region->crect      = NULL;
@@ -569,8 +1541,9 @@ Region* buildRegion(GumpSearchContext* sc, Rect* rect, Region* lover, Region* lr
 	region->btmid      = NULL;
 	region->ranksort   = NULL;
 	region->rankpoints = NULL;
+	memset(&region->ids, 0, sizeof(IdMask));
 
-	int est = MAXLEAF;
+	int est = sc->maxleaf;
 	int blocks = -1;
 
 	// only compute point count estimate if deep in tree
@@ -581,8 +1554,8 @@ Region* buildRegion(GumpSearchContext* sc, Rect* rect, Region* lover, Region* lr
 		double dq = (double)(rect->hy - sc->bounds->ly) / sc->dy;
 		int i = floor(di); if (i < 0) i = 0;
 		int j = floor(dj); if (j < 0) j = 0;
-		int p = ceil(dp); if (p > DIVS) p = DIVS;
-		int q = ceil(dq); if (q > DIVS) q = DIVS;
+		int p = ceil(dp); if (p > sc->divs) p = sc->divs;
+		int q = ceil(dq); if (q > sc->divs) q = sc->divs;
 		int w = p - i;
 		int h = q - j;
 
@@ -598,20 +1571,21 @@ Region* buildRegion(GumpSearchContext* sc, Rect* rect, Region* lover, Region* lr
 				if (!isRectOverlap(rect, &sc->drect[a+i][b+j])) continue;
 				est += dlen;
 
-				sc->blocks[blocks] = sc->grid[a+i][b+j];
-				sc->blocki[blocks] = 0;
-				sc->blockn[blocks] = dlen;
+				sc->scratch->blocks[blocks] = sc->grid[a+i][b+j];
+				sc->scratch->blocki[blocks] = 0;
+				sc->scratch->blockn[blocks] = dlen;
 				blocks++;
 			}
 		}
 	}
 
-	bool isleaf = (depth == 9 && est < MAXLEAF) || depth == 10;
-	int len = isleaf ? LEAFSIZE : NODESIZE;
+	bool isleaf = (depth == sc->maxdepth - 1 && est < sc->maxleaf) || depth >= sc->maxdepth;
+	int len = isleaf ? sc->leafsize : sc->nodesize;
 	region->ranksort = (Point*)calloc(len, sizeof(Point));
 	if (blocks > 0) {
-		if (blocks == 1) region->n = findHitsS(rect, sc->blocks[0], sc->blockn[0], region->ranksort, len);
-		else region->n = findHitsB(rect, blocks, sc->blocks, sc->blocki, sc->blockn, region->ranksort, len);
+		Scratch* s = sc->scratch;
+		if (blocks == 1) region->n = findHitsS(rect, s->blocks[0], s->blockn[0], region->ranksort, len);
+		else region->n = sc->kernels->merge(rect, blocks, s->blocks, s->blocki, s->blockn, region->ranksort, len);
 	} else region->n = searchBinary(sc, *rect, len, region->ranksort);
 
 	if (isleaf) return region;
@@ -640,20 +1614,26 @@ Region* buildRegion(GumpSearchContext* sc, Rect* rect, Region* lover, Region* lr
 	return region;
 }
 
-void convertRegion(Region* region) {
+void convertRegion(GumpSearchContext* sc, Region* region) {
 	if (region->rankpoints != NULL) return; // This region has already been converted
 
-	region->rankpoints = buildPoints(region->n);
+#if REGIONINDEX
+	region->rankpoints = indexPoints(sc, region->ranksort, region->n);
+#else
+	region->rankpoints = buildPoints(region->n, sc->huge);
 	fillPoints(region->rankpoints, region->ranksort, region->n);
+#endif
+	quantizePoints(sc, region->rankpoints, region->ranksort, region->rect);
+	for (int i = 0; i < region->n; i++) addId(&region->ids, region->ranksort[i].id);
 	free(region->ranksort);
 	region->ranksort = NULL;
 
-	if (region->left)   convertRegion(region->left);
-	if (region->right)  convertRegion(region->right);
-	if (region->lrmid)  convertRegion(region->lrmid);
-	if (region->bottom) convertRegion(region->bottom);
-	if (region->top)    convertRegion(region->top);
-	if (region->btmid)  convertRegion(region->btmid);
+	if (region->left)   convertRegion(sc, region->left);
+	if (region->right)  convertRegion(sc, region->right);
+	if (region->lrmid)  convertRegion(sc, region->lrmid);
+	if (region->bottom) convertRegion(sc, region->bottom);
+	if (region->top)    convertRegion(sc, region->top);
+	if (region->btmid)  convertRegion(sc, region->btmid);
 }
 
 void freeRegion(Region* region, bool left, bool lrmid, bool right, bool bottom, bool btmid, bool top) {
@@ -668,42 +1648,169 @@ void freeRegion(Region* region, bool left, bool lrmid, bool right, bool bottom,
 	free(region);
 }
 
-void buildGrid(GumpSearchContext* sc) {
-	sc->blocks = (Point**)calloc(DIVS*DIVS, sizeof(Point*));
-	sc->blocki = (int*)calloc(DIVS*DIVS, sizeof(int));
-	sc->blockn = (int*)calloc(DIVS*DIVS, sizeof(int));
+void buildHilbert(GumpSearchContext* sc) {
+	// order points along the hilbert curve through the data bounds
+	BatchKey* keys = (BatchKey*)malloc(sc->N * sizeof(BatchKey));
+	double side = (double)((1u << HILBERTORDER) - 1);
+	double sx = side / (sc->bounds->hx - sc->bounds->lx);
+	double sy = side / (sc->bounds->hy - sc->bounds->ly);
+	for (int i = 0; i < sc->N; i++) {
+		double hx = (sc->ranksort[i].x - sc->bounds->lx) * sx;
+		double hy = (sc->ranksort[i].y - sc->bounds->ly) * sy;
+		if (!(hx > 0)) hx = 0; else if (hx > side) hx = side;
+		if (!(hy > 0)) hy = 0; else if (hy > side) hy = side;
+		keys[i].key = hilbertIndex((uint32_t)hx, (uint32_t)hy);
+		keys[i].idx = i;
+	}
+	keysort(keys, sc->N);
+
+	// cut the curve into blocks, each rank sorted so scans can stop early
+	int nblocks = (sc->N + HBLOCKSIZE - 1) / HBLOCKSIZE;
+	sc->nhlevels = 1;
+	for (int n = nblocks; n > HFANOUT; n = (n + HFANOUT - 1) / HFANOUT) sc->nhlevels++;
+	sc->hlevels = (HBlock**)calloc(sc->nhlevels, sizeof(HBlock*));
+	sc->hlevelN = (int*)calloc(sc->nhlevels, sizeof(int));
+	sc->hpoints = buildPoints(sc->N, sc->huge);
+
+	Point* block = (Point*)calloc(HBLOCKSIZE, sizeof(Point));
+	sc->hlevels[0] = (HBlock*)calloc(nblocks, sizeof(HBlock));
+	sc->hlevelN[0] = nblocks;
+	for (int b = 0; b < nblocks; b++) {
+		int start = b * HBLOCKSIZE;
+		int n = (sc->N - start < HBLOCKSIZE) ? sc->N - start : HBLOCKSIZE;
+		for (int i = 0; i < n; i++) block[i] = sc->ranksort[keys[start + i].idx];
+		ranksort(block, n);
+
+		HBlock* node = &sc->hlevels[0][b];
+		node->start = start;
+		node->n = n;
+		node->minrank = block[0].rank;
+		node->bbox.lx = node->bbox.hx = block[0].x;
+		node->bbox.ly = node->bbox.hy = block[0].y;
+		for (int i = 0; i < n; i++) {
+			sc->hpoints->id[start + i]   = block[i].id;
+			sc->hpoints->rank[start + i] = block[i].rank;
+			sc->hpoints->x[start + i]    = block[i].x;
+			sc->hpoints->y[start + i]    = block[i].y;
+			if (block[i].x < node->bbox.lx) node->bbox.lx = block[i].x;
+			if (block[i].y < node->bbox.ly) node->bbox.ly = block[i].y;
+			if (block[i].x > node->bbox.hx) node->bbox.hx = block[i].x;
+			if (block[i].y > node->bbox.hy) node->bbox.hy = block[i].y;
+		}
+	}
+	free(block);
+	free(keys);
+
+	// pack consecutive blocks into parents until the top level fits in one fanout
+	for (int l = 1; l < sc->nhlevels; l++) {
+		HBlock* children = sc->hlevels[l-1];
+		int nchildren = sc->hlevelN[l-1];
+		int nparents = (nchildren + HFANOUT - 1) / HFANOUT;
+		sc->hlevels[l] = (HBlock*)calloc(nparents, sizeof(HBlock));
+		sc->hlevelN[l] = nparents;
+		for (int b = 0; b < nparents; b++) {
+			HBlock* node = &sc->hlevels[l][b];
+			node->start = b * HFANOUT;
+			node->n = (nchildren - node->start < HFANOUT) ? nchildren - node->start : HFANOUT;
+			node->bbox = children[node->start].bbox;
+			node->minrank = children[node->start].minrank;
+			for (int c = node->start; c < node->start + node->n; c++) {
+				if (children[c].bbox.lx < node->bbox.lx) node->bbox.lx = children[c].bbox.lx;
+				if (children[c].bbox.ly < node->bbox.ly) node->bbox.ly = children[c].bbox.ly;
+				if (children[c].bbox.hx > node->bbox.hx) node->bbox.hx = children[c].bbox.hx;
+				if (children[c].bbox.hy > node->bbox.hy) node->bbox.hy = children[c].bbox.hy;
+				if (children[c].minrank < node->minrank) node->minrank = children[c].minrank;
+			}
+		}
+	}
+}
+
+void freeHilbert(GumpSearchContext* sc) {
+	for (int l = 0; l < sc->nhlevels; l++) free(sc->hlevels[l]);
+	free(sc->hlevels);
+	free(sc->hlevelN);
+	freePoints(sc->hpoints);
+}
+
+// copy the rank sorted points grouped by id, keeping rank order within each id
+void buildIds(GumpSearchContext* sc) {
+	memset(sc->idstart, 0, sizeof(sc->idstart));
+	for (int i = 0; i < sc->N; i++) sc->idstart[(uint8_t)sc->ranksort[i].id + 1]++;
+	for (int b = 0; b < 256; b++) sc->idstart[b + 1] += sc->idstart[b];
+
+	int32_t next[256];
+	memcpy(next, sc->idstart, sizeof(next));
+	Points* p = sc->idpoints = buildPoints(sc->N, sc->huge);
+	for (int i = 0; i < sc->N; i++) {
+		Point* q = &sc->ranksort[i];
+		int k = next[(uint8_t)q->id]++;
+		p->rank[k] = q->rank;
+		p->x[k]    = q->x;
+		p->y[k]    = q->y;
+	}
+	hugeFree(p->id, (int64_t)p->n * sizeof(int8_t));
+	p->id = NULL;
+}
+
+// 2D prefix sums of the points each cell owns, so the points in any block of cells can be counted from four corners
+void buildGridSums(GumpSearchContext* sc) {
+	int stride = sc->divs + 1;
+	sc->gridsum = (int32_t*)calloc(stride * stride, sizeof(int32_t));
+	for (int i = 0; i < sc->divs; i++) {
+		float ox = (i > 0) ? sc->gridx[i-1] : -INFINITY;
+		int32_t column = 0;
+		for (int j = 0; j < sc->divs; j++) {
+			float oy = (j > 0) ? sc->gridy[j-1] : -INFINITY;
+			Point* p = sc->grid[i][j];
+			for (int k = 0; k < sc->dlen[i][j]; k++) column += (p[k].x > ox && p[k].y > oy);
+			sc->gridsum[(i+1) * stride + j + 1] = sc->gridsum[i * stride + j + 1] + column;
+		}
+	}
+}
 
-	sc->dx = (double)(sc->bounds->hx - sc->bounds->lx) / (double)DIVS;
-	sc->dy = (double)(sc->bounds->hy - sc->bounds->ly) / (double)DIVS;
+void buildGrid(GumpSearchContext* sc) {
+	sc->dx = (double)(sc->bounds->hx - sc->bounds->lx) / (double)sc->divs;
+	sc->dy = (double)(sc->bounds->hy - sc->bounds->ly) / (double)sc->divs;
 	DPRINT(("Bounds are [%f,%f,%f,%f]: dx = %f, dy = %f, area %f\n",
 		sc->bounds->lx, sc->bounds->hx, sc->bounds->ly, sc->bounds->hy,
 		sc->dx, sc->dy, sc->area
 	));
 
-	memcpy(sc->gridsort, sc->xsort, sc->N * sizeof(Point));
-	sc->grid = (Point***)calloc(DIVS, sizeof(Point**));
-	sc->grect = (Rect**)calloc(DIVS, sizeof(Rect*));
-	sc->drect = (Rect**)calloc(DIVS, sizeof(Rect*));
-	sc->dlen = (int**)calloc(DIVS, sizeof(int*));
+	sc->grid = (Point***)calloc(sc->divs, sizeof(Point**));
+	sc->grect = (Rect**)calloc(sc->divs, sizeof(Rect*));
+	sc->drect = (Rect**)calloc(sc->divs, sizeof(Rect*));
+	sc->dlen = (int**)calloc(sc->divs, sizeof(int*));
+	sc->dids = (IdMask**)calloc(sc->divs, sizeof(IdMask*));
+	sc->gridx = (float*)calloc(sc->divs, sizeof(float));
+	sc->gridy = (float*)calloc(sc->divs, sizeof(float));
+	for (int i = 0; i < sc->divs; i++) {
+		sc->gridx[i] = (i == sc->divs - 1) ? INFINITY : (float)(sc->bounds->lx + (double)(i+1) * sc->dx);
+		sc->gridy[i] = (i == sc->divs - 1) ? INFINITY : (float)(sc->bounds->ly + (double)(i+1) * sc->dy);
+	}
+
+	// each column is copied from xsort into gridsort and sorted by y there, so xsort stays in x order for the next
+	// column. The outer columns and rows also take the points beyond the bounds
 	int xidxl = 0;
-	for (int i = 0; i < DIVS; i++) {
+	for (int i = 0; i < sc->divs; i++) {
 		double lx = sc->bounds->lx + (double)i * sc->dx;
 		double hx = sc->bounds->lx + (double)(i+1) * sc->dx;
-		if (i == DIVS - 1) hx = sc->bounds->hx;
-		int xidxr = xidxl + bsearchx(&sc->gridsort[xidxl], false, hx, 0, sc->N - xidxl + 1);
+		if (i == sc->divs - 1) hx = sc->bounds->hx;
+		int xidxr = xidxl + bsearchx(&sc->xsort[xidxl], false, sc->gridx[i], 0, sc->N - xidxl - 1);
 		int nx = xidxr - xidxl + 1;
-		ysort(&sc->gridsort[xidxl], nx);
-
-		sc->grid[i] = (Point**)calloc(DIVS, sizeof(Point*));
-		sc->grect[i] = (Rect*)calloc(DIVS, sizeof(Rect));
-		sc->drect[i] = (Rect*)calloc(DIVS, sizeof(Rect));
-		sc->dlen[i] = (int*)calloc(DIVS, sizeof(int));
-		int yidxl = xidxl;
-		for (int j = 0; j < DIVS; j++) {
+		memcpy(sc->gridsort, &sc->xsort[xidxl], nx * sizeof(Point));
+		ysort(sc->gridsort, nx);
+
+		sc->grid[i] = (Point**)calloc(sc->divs, sizeof(Point*));
+		sc->grect[i] = (Rect*)calloc(sc->divs, sizeof(Rect));
+		sc->drect[i] = (Rect*)calloc(sc->divs, sizeof(Rect));
+		sc->dlen[i] = (int*)calloc(sc->divs, sizeof(int));
+		sc->dids[i] = (IdMask*)calloc(sc->divs, sizeof(IdMask));
+		int yidxl = 0;
+		for (int j = 0; j < sc->divs; j++) {
 			double ly = sc->bounds->ly + (double)j * sc->dy;
 			double hy = sc->bounds->ly + (double)(j+1) * sc->dy;
-			if (j == DIVS - 1) hy = sc->bounds->hy;
-			int yidxr = yidxl + bsearchy(&sc->gridsort[yidxl], false, hy, 0, xidxr - yidxl + 1);
+			if (j == sc->divs - 1) hy = sc->bounds->hy;
+			int yidxr = yidxl + bsearchy(&sc->gridsort[yidxl], false, sc->gridy[j], 0, nx - yidxl - 1);
 			int ny = yidxr - yidxl + 1;
 
 			sc->grect[i][j].lx = lx;
@@ -715,7 +1822,7 @@ void buildGrid(GumpSearchContext* sc) {
 				sc->grid[i][j] = NULL;
 			} else {
 				sc->dlen[i][j] = ny;
-				sc->grid[i][j] = (Point*)calloc(ny, sizeof(Point));
+				sc->grid[i][j] = (Point*)arenaAlloc(&sc->arena, ny * sizeof(Point), sc->huge);
 				memcpy(sc->grid[i][j], &sc->gridsort[yidxl], ny * sizeof(Point));
 				ranksort(sc->grid[i][j], ny);
 
@@ -728,50 +1835,81 @@ void buildGrid(GumpSearchContext* sc) {
 					if (p == 0 || sc->grid[i][j][p].y < sc->drect[i][j].ly) sc->drect[i][j].ly = sc->grid[i][j][p].y;
 					if (p == 0 || sc->grid[i][j][p].x > sc->drect[i][j].hx) sc->drect[i][j].hx = sc->grid[i][j][p].x;
 					if (p == 0 || sc->grid[i][j][p].y > sc->drect[i][j].hy) sc->drect[i][j].hy = sc->grid[i][j][p].y;
+					addId(&sc->dids[i][j], sc->grid[i][j][p].id);
 				}
 			}
 
 			// If there are points on the boundary, they need to be included in both grid blocks
-			if (ny > 0 && sc->gridsort[yidxr].y == hx) {
+			if (ny > 0 && sc->gridsort[yidxr].y == sc->gridy[j]) {
 				yidxl = yidxr;
-				while (sc->gridsort[yidxl].y == sc->gridsort[yidxl-1].y) yidxl--;
+				while (yidxl > 0 && sc->gridsort[yidxl].y == sc->gridsort[yidxl-1].y) yidxl--;
 			} else yidxl = yidxr + 1;
 		}
 
 		// If there are points on the boundary, they need to be included in both grid blocks
-		if (nx > 0 && sc->gridsort[xidxr].x == hx) {
+		if (nx > 0 && sc->xsort[xidxr].x == sc->gridx[i]) {
 			xidxl = xidxr;
-			while (sc->gridsort[xidxl].x == sc->gridsort[xidxl-1].x) xidxl--;
+			while (xidxl > 0 && sc->xsort[xidxl].x == sc->xsort[xidxl-1].x) xidxl--;
 		} else xidxl = xidxr + 1;
 	}
+
+	buildGridSums(sc);
 }
 
 void freeGrid(GumpSearchContext* sc) {
 	DPRINT(("Freeing grid tree\n"));
-	for (int i = 0; i < DIVS; i++) {
-		for (int j = 0; j < DIVS; j++) {
-			free(sc->grid[i][j]);
-		}
+	for (int i = 0; i < sc->divs; i++) {
 		free(sc->grid[i]);
 		free(sc->dlen[i]);
+		free(sc->dids[i]);
 		free(sc->drect[i]);
 	}
 	free(sc->grid);
 	free(sc->dlen);
+	free(sc->dids);
 	free(sc->drect);
+	free(sc->gridx);
+	free(sc->gridy);
+	free(sc->gridsum);
 	free(sc->bounds);
-	free(sc->blocks);
-	free(sc->blocki);
-	free(sc->blockn);
 }
 
-__stdcall SearchContext* create(const Point* points_begin, const Point* points_end) {
+// a context with nothing built yet
+GumpSearchContext* newContext(int N, BuildParams* params) {
 	GumpSearchContext* gsc = (GumpSearchContext*)malloc(sizeof(GumpSearchContext));
-	gsc->N = points_end - points_begin;
-	if (gsc->N == 0) return (SearchContext*)gsc;
+	gsc->N = N;
+	gsc->divs     = params->divs;
+	gsc->maxdepth = params->maxdepth;
+	gsc->nodesize = params->nodesize;
+	gsc->leafsize = params->leafsize;
+	gsc->maxleaf  = params->maxleaf;
+	memset(&gsc->counters, 0, sizeof(QueryCounters));
+	gsc->tracer = NULL;
+	lockInit(&gsc->tracelock);
+	gsc->arena = NULL;
+	gsc->replicas = NULL;
+	gsc->nreplicas = 0;
+	gsc->topology = NULL;
+	gsc->pool = NULL;
+	gsc->shared = NULL;
+	gsc->scratch = NULL;
+#if HUGEPAGES
+	const char* huge = getenv("GUMPTIONAIRE_HUGEPAGES");
+	gsc->huge = !(huge && strcmp(huge, "0") == 0);
+#else
+	gsc->huge = false;
+#endif
+	gsc->kernels = chooseKernels();
+	DPRINT(("Kernels for %s\n", cpuLevelName(gsc->kernels->level)));
+	return gsc;
+}
+
+GumpSearchContext* buildContext(const Point* points_begin, const Point* points_end, BuildParams* params) {
+	GumpSearchContext* gsc = newContext(points_end - points_begin, params);
+	if (gsc->N == 0) return gsc;
 
 	DPRINT(("Allocating and copying memory\n"));
-	gsc->trim = (Rect*)malloc(sizeof(Rect));
+	gsc->scratch = buildScratch(gsc->divs);
 	gsc->xsort = (Point*)calloc(gsc->N, sizeof(Point));
 	gsc->ysort = (Point*)calloc(gsc->N, sizeof(Point));
 	gsc->ranksort = (Point*)calloc(gsc->N, sizeof(Point));
@@ -792,100 +1930,247 @@ __stdcall SearchContext* create(const Point* points_begin, const Point* points_e
 	gsc->bounds->hy = gsc->ysort[gsc->N-2].y;
 	gsc->area = rectArea(gsc->bounds);
 
+	// the few points beyond the bounds, which no region holds
+	gsc->noutliers = 0;
+	for (int i = 0; i < gsc->N && gsc->noutliers < 4; i++) {
+		if (!isHit(gsc->bounds, &gsc->ranksort[i])) gsc->outliers[gsc->noutliers++] = gsc->ranksort[i];
+	}
+
 	DPRINT(("Building grid tree\n"));
 	buildGrid(gsc);
 
 	DPRINT(("Building region tree\n"));
 	// convert array of stuctures pattern to structure of arrays pattern
-	gsc->xpoints = buildPoints(gsc->N); fillPoints(gsc->xpoints, gsc->xsort, gsc->N);
-	gsc->ypoints = buildPoints(gsc->N); fillPoints(gsc->ypoints, gsc->ysort, gsc->N);
-	gsc->root = buildRegion(gsc, gsc->bounds, NULL, NULL, NULL, NULL, NULL, NULL, 1);
-
-	// remove("rects.csv");
-	// FILE *f = fopen("points.csv", "w");
-	// for (int i = 0; i < gsc->N; i++) {
-	// 	fprintf(f, "%d,%f,%f\n", gsc->ranksort[i].rank, gsc->ranksort[i].x, gsc->ranksort[i].y);
-	// }
-	// fclose(f);
+	gsc->xpoints = buildPoints(gsc->N, gsc->huge); fillPoints(gsc->xpoints, gsc->xsort, gsc->N);
+	gsc->ypoints = buildPoints(gsc->N, gsc->huge); fillPoints(gsc->ypoints, gsc->ysort, gsc->N);
+	gsc->rankpoints = buildPoints(gsc->N, gsc->huge); fillPoints(gsc->rankpoints, gsc->ranksort, gsc->N);
+	buildIds(gsc);
+	gsc->root = (gsc->maxdepth > 0) ? buildRegion(gsc, gsc->bounds, NULL, NULL, NULL, NULL, NULL, NULL, 1) : NULL;
+
+#if HILBERTSLABS
+	// the hilbert blocks replace the slab scans, so the sorted arrays only need to keep their sort key
+	DPRINT(("Building hilbert blocks\n"));
+	buildHilbert(gsc);
+	hugeFree(gsc->xpoints->id,   (int64_t)gsc->N * sizeof(int8_t));  gsc->xpoints->id = NULL;
+	hugeFree(gsc->xpoints->rank, (int64_t)gsc->N * sizeof(int32_t)); gsc->xpoints->rank = NULL;
+	hugeFree(gsc->xpoints->y,    (int64_t)gsc->N * sizeof(float));   gsc->xpoints->y = NULL;
+	hugeFree(gsc->ypoints->id,   (int64_t)gsc->N * sizeof(int8_t));  gsc->ypoints->id = NULL;
+	hugeFree(gsc->ypoints->rank, (int64_t)gsc->N * sizeof(int32_t)); gsc->ypoints->rank = NULL;
+	hugeFree(gsc->ypoints->x,    (int64_t)gsc->N * sizeof(float));   gsc->ypoints->x = NULL;
+#endif
 
 	free(gsc->xsort);
 	free(gsc->ysort);
 	free(gsc->gridsort);
 	free(gsc->ranksort);
 
-	convertRegion(gsc->root);
+	if (gsc->root) convertRegion(gsc, gsc->root);
+	freeScratch(gsc->scratch);
+	gsc->scratch = NULL;
+
+	return gsc;
+}
 
+__stdcall SearchContext* GUMPTIONAIRE(create)(const Point* points_begin, const Point* points_end) {
+	BuildParams params;
+	defaultParams(&params);
+	SearchContext* sc = (SearchContext*)buildContext(points_begin, points_end, &params);
+
+	// let a host that can't call trace() record its queries
+#if TRACE
+	const char* path = getenv("GUMPTIONAIRE_TRACE");
+	if (path && *path) GUMPTIONAIRE(trace)(sc, path);
+#endif
+	return sc;
+}
+
+__stdcall SearchContext* GUMPTIONAIRE(create_ex)(const Point* points_begin, const Point* points_end, const int64_t budget, BuildParams* chosen) {
+	BuildParams params;
+	if (!chooseParams(points_begin, points_end - points_begin, budget, &params)) {
+		if (chosen) *chosen = params;
+		return NULL;
+	}
+
+	GumpSearchContext* gsc = buildContext(points_begin, points_end, &params);
+	IndexStats st;
+	params.bytes = GUMPTIONAIRE(stats)((SearchContext*)gsc, &st);
+	DPRINT(("Budget %lld: divs %d, depth %d, lists %d/%d, estimate %lld, actual %lld\n",
+		(long long)budget, params.divs, params.maxdepth, params.leafsize, params.nodesize, (long long)params.estimate, (long long)params.bytes
+	));
+	if (chosen) *chosen = params;
 	return (SearchContext*)gsc;
 }
 
-__stdcall int32_t search(SearchContext* sc, Rect rect, const int32_t count, Point* out_points) {
-	GumpSearchContext* gsc = (GumpSearchContext*)sc;
+__stdcall SearchContext* GUMPTIONAIRE(create_numa)(const Point* points_begin, const Point* points_end) {
+	NumaTopology* topology = (NumaTopology*)malloc(sizeof(NumaTopology));
+	numaTopology(topology);
+	if (topology->nnodes < 2) {
+		numaFree(topology);
+		free(topology);
+		return GUMPTIONAIRE(create)(points_begin, points_end);
+	}
+
+	// build each copy from this thread pinned to its node, so first touch puts the copy's memory there
+	BuildParams params;
+	defaultParams(&params);
+	GumpSearchContext** replicas = (GumpSearchContext**)calloc(topology->nnodes, sizeof(GumpSearchContext*));
+	GumpSearchContext* primary = NULL;
+	NumaAffinity saved;
+	numaSave(&saved);
+	for (int node = 0; node < topology->nnodes; node++) {
+		if (!numaPin(topology, node)) continue;
+		DPRINT(("Building replica on node %d\n", node));
+		replicas[node] = buildContext(points_begin, points_end, &params);
+		if (!primary) primary = replicas[node];
+	}
+	numaRestore(&saved);
+
+	// pinning wasn't allowed anywhere
+	if (!primary) {
+		free(replicas);
+		numaFree(topology);
+		free(topology);
+		return GUMPTIONAIRE(create)(points_begin, points_end);
+	}
+	primary->replicas = replicas;
+	primary->nreplicas = topology->nnodes;
+	primary->topology = topology;
+
+#if TRACE
+	const char* path = getenv("GUMPTIONAIRE_TRACE");
+	if (path && *path) GUMPTIONAIRE(trace)((SearchContext*)primary, path);
+#endif
+	return (SearchContext*)primary;
+}
+
+// rect clipped to the bounds the grid and regions cover
+inline void trimRect(GumpSearchContext* gsc, const Rect* rect, Rect* trim) {
+	trim->lx = (rect->lx < gsc->bounds->lx) ? gsc->bounds->lx : rect->lx;
+	trim->hx = (rect->hx > gsc->bounds->hx) ? gsc->bounds->hx : rect->hx;
+	trim->ly = (rect->ly < gsc->bounds->ly) ? gsc->bounds->ly : rect->ly;
+	trim->hy = (rect->hy > gsc->bounds->hy) ? gsc->bounds->hy : rect->hy;
+}
+
+// walk the region descents of a group of queries side by side, one level of one query at a time, prefetching the next
+// level before moving on to the next query so the group's cache misses overlap. The searches that follow then find the
+// nodes they pass through, and the start of the lists they scan, already in cache
+void prefetchDescents(GumpSearchContext* gsc, const Rect* rects, const BatchKey* keys, int n) {
+	Region* node[BATCHGROUP];
+	Rect trim[BATCHGROUP];
+	float w[BATCHGROUP], h[BATCHGROUP];
+	int active = 0;
+	for (int g = 0; g < n; g++) {
+		trimRect(gsc, &rects[keys[g].idx], &trim[g]);
+		w[g] = trim[g].hx - trim[g].lx;
+		h[g] = trim[g].hy - trim[g].ly;
+		node[g] = ((w[g] * h[g]) / gsc->area > REGIONTHRESH) ? gsc->root : NULL;
+		if (node[g]) {
+			prefetchRegion(node[g]);
+			active++;
+		}
+	}
+
+	while (active > 0) {
+		for (int g = 0; g < n; g++) {
+			Region* region = node[g];
+			if (!region) continue;
+			Region* child = (region->n > 0) ? containingChild(region, &trim[g], w[g], h[g]) : NULL;
+			if (child) {
+				prefetchRegion(child);
+				node[g] = child;
+				continue;
+			}
+
+			Points* p = region->rankpoints;
+			__builtin_prefetch(p->qx);
+			__builtin_prefetch(p->qy);
+			__builtin_prefetch((char*)p->qx + 64);
+			__builtin_prefetch((char*)p->qy + 64);
+			if (p->pos) __builtin_prefetch(p->pos);
+			node[g] = NULL;
+			active--;
+		}
+	}
+}
+
+// full search - try the region tree, then pick between slab scans and the grid. *path is set to the strategy that
+// produced the result
+int32_t searchGumptionaire(GumpSearchContext* gsc, Scratch* s, Rect rect, const int32_t count, Point* out_points, int* path) {
+	*path = PATH_EMPTY;
 	if (gsc->N == 0) return 0;
 
-	gsc->trim->lx = (rect.lx < gsc->bounds->lx) ? gsc->bounds->lx : rect.lx;
-	gsc->trim->hx = (rect.hx > gsc->bounds->hx) ? gsc->bounds->hx : rect.hx;
-	gsc->trim->ly = (rect.ly < gsc->bounds->ly) ? gsc->bounds->ly : rect.ly;
-	gsc->trim->hy = (rect.hy > gsc->bounds->hy) ? gsc->bounds->hy : rect.hy;
+	trimRect(gsc, &rect, &s->trim);
 
-	gsc->w = gsc->trim->hx - gsc->trim->lx;
-	gsc->h = gsc->trim->hy - gsc->trim->ly;
-	float apct = (gsc->w * gsc->h) / gsc->area;
+	s->w = s->trim.hx - s->trim.lx;
+	s->h = s->trim.hy - s->trim.ly;
+	float apct = (s->w * s->h) / gsc->area;
 
 	int hits = 0;
 	// Don't run region search if likely to fail
-	if (apct > REGIONTHRESH) {
-		hits = regionHits(gsc, *gsc->trim, gsc->root, count, out_points);
-		if (hits > 0) return hits;
+	if (apct > REGIONTHRESH && gsc->root) {
+#if INSTRUMENT
+		uint64_t start = __rdtsc();
+#endif
+		hits = regionHits(gsc, s, s->trim, gsc->root, count, out_points);
+		if (hits > 0) {
+			hits = mergeOutliers(gsc, &rect, NULL, hits, count, out_points);
+			*path = PATH_REGION;
+			return hits;
+		}
+#if INSTRUMENT
+		countAdd(&gsc->counters.fallbacks, 1);
+		countAdd(&gsc->counters.fallbackcycles, __rdtsc() - start);
+#endif
 	}
 
 	// if region search fails, fall back on grid or binary
 	int xidxl, xidxr, yidxl, yidxr, nx, ny;
 
 	// if valid x range is likely to be smaller than y range, check it first
-	if (gsc->w / gsc->dx < gsc->h / gsc->dy) {
-		xidxl = bvalsearch(gsc->xpoints->x, true, rect.lx, 0, gsc->N);
-		xidxr = bvalsearch(gsc->xpoints->x, false, rect.hx, 0, gsc->N);
+	if (s->w / gsc->dx < s->h / gsc->dy) {
+		xidxl = gsc->kernels->bound(gsc->xpoints->x, true, rect.lx, 0, gsc->N - 1);
+		xidxr = gsc->kernels->bound(gsc->xpoints->x, false, rect.hx, 0, gsc->N - 1);
 		nx = xidxr - xidxl + 1;
 		if (nx == 0) return 0;
 
-		if (nx < LINTHRESH1) return findHitsUyV(&rect, &gsc->xpoints->id[xidxl], &gsc->xpoints->rank[xidxl], &gsc->xpoints->y[xidxl], nx, out_points, count);
+		if (nx < LINTHRESH1) { *path = PATH_XSLAB; return xslabHits(gsc, &rect, xidxl, nx, out_points, count); }
 
-		yidxl = bvalsearch(gsc->ypoints->y, true, rect.ly, 0, gsc->N);
-		yidxr = bvalsearch(gsc->ypoints->y, false, rect.hy, 0, gsc->N);
+		yidxl = gsc->kernels->bound(gsc->ypoints->y, true, rect.ly, 0, gsc->N - 1);
+		yidxr = gsc->kernels->bound(gsc->ypoints->y, false, rect.hy, 0, gsc->N - 1);
 		ny = yidxr - yidxl + 1;
 		if (ny == 0) return 0;
 
-		if (ny < LINTHRESH2) return findHitsUxV(&rect, &gsc->ypoints->id[yidxl], &gsc->ypoints->rank[yidxl], &gsc->ypoints->x[yidxl], ny, out_points, count);
+		if (ny < LINTHRESH2) { *path = PATH_YSLAB; return yslabHits(gsc, &rect, yidxl, ny, out_points, count); }
 	} else {
-		yidxl = bvalsearch(gsc->ypoints->y, true, rect.ly, 0, gsc->N);
-		yidxr = bvalsearch(gsc->ypoints->y, false, rect.hy, 0, gsc->N);
+		yidxl = gsc->kernels->bound(gsc->ypoints->y, true, rect.ly, 0, gsc->N - 1);
+		yidxr = gsc->kernels->bound(gsc->ypoints->y, false, rect.hy, 0, gsc->N - 1);
 		ny = yidxr - yidxl + 1;
 		if (ny == 0) return 0;
 
-		if (ny < LINTHRESH1) return findHitsUxV(&rect, &gsc->ypoints->id[yidxl], &gsc->ypoints->rank[yidxl], &gsc->ypoints->x[yidxl], ny, out_points, count);
+		if (ny < LINTHRESH1) { *path = PATH_YSLAB; return yslabHits(gsc, &rect, yidxl, ny, out_points, count); }
 
-		xidxl = bvalsearch(gsc->xpoints->x, true, rect.lx, 0, gsc->N);
-		xidxr = bvalsearch(gsc->xpoints->x, false, rect.hx, 0, gsc->N);
+		xidxl = gsc->kernels->bound(gsc->xpoints->x, true, rect.lx, 0, gsc->N - 1);
+		xidxr = gsc->kernels->bound(gsc->xpoints->x, false, rect.hx, 0, gsc->N - 1);
 		nx = xidxr - xidxl + 1;
 		if (nx == 0) return 0;
 
-		if (nx < LINTHRESH2) return findHitsUyV(&rect, &gsc->xpoints->id[xidxl], &gsc->xpoints->rank[xidxl], &gsc->xpoints->y[xidxl], nx, out_points, count);
+		if (nx < LINTHRESH2) { *path = PATH_XSLAB; return xslabHits(gsc, &rect, xidxl, nx, out_points, count); }
 	}
 
 	// find grid block for the bottom left and top right corners of the query rect
-	double di = (double)(gsc->trim->lx - gsc->bounds->lx) / gsc->dx;
-	double dj = (double)(gsc->trim->ly - gsc->bounds->ly) / gsc->dy;
-	double dp = (double)(gsc->trim->hx - gsc->bounds->lx) / gsc->dx;
-	double dq = (double)(gsc->trim->hy - gsc->bounds->ly) / gsc->dy;
+	double di = (double)(s->trim.lx - gsc->bounds->lx) / gsc->dx;
+	double dj = (double)(s->trim.ly - gsc->bounds->ly) / gsc->dy;
+	double dp = (double)(s->trim.hx - gsc->bounds->lx) / gsc->dx;
+	double dq = (double)(s->trim.hy - gsc->bounds->ly) / gsc->dy;
 	int i = floor(di); if (i < 0) i = 0;
 	int j = floor(dj); if (j < 0) j = 0;
-	int p = ceil(dp); if (p > DIVS) p = DIVS;
-	int q = ceil(dq); if (q > DIVS) q = DIVS;
+	int p = ceil(dp); if (p > gsc->divs) p = gsc->divs;
+	int q = ceil(dq); if (q > gsc->divs) q = gsc->divs;
 	int w = p - i;
 	int h = q - j;
 
-	if (gsc->trim->lx < gsc->grect[i][j].lx) i--;
-	if (gsc->trim->ly < gsc->grect[i][j].ly) j--;
+	if (s->trim.lx < gsc->grect[i][j].lx) i--;
+	if (s->trim.ly < gsc->grect[i][j].ly) j--;
 
 	int exptests = 0;
 	int blocks = 0;
@@ -895,9 +2180,9 @@ __stdcall int32_t search(SearchContext* sc, Rect rect, const int32_t count, Poin
 			if (len == 0) continue;
 			if (!isRectOverlap(&rect, &gsc->drect[a+i][b+j])) continue;
 
-			gsc->blocks[blocks] = gsc->grid[a+i][b+j];
-			gsc->blocki[blocks] = 0;
-			gsc->blockn[blocks] = len;
+			s->blocks[blocks] = gsc->grid[a+i][b+j];
+			s->blocki[blocks] = 0;
+			s->blockn[blocks] = len;
 			exptests += len;
 			blocks++;
 		}
@@ -907,23 +2192,960 @@ __stdcall int32_t search(SearchContext* sc, Rect rect, const int32_t count, Poin
 
 	int nsmall = nx < ny ? nx : ny;
 	if (nsmall > LINTHRESH3 || exptests * GRIDFACTOR < nsmall) {
-		if (blocks == 1) return findHitsS((Rect*)&rect, gsc->blocks[0], gsc->blockn[0], out_points, count);
-		else return findHitsB((Rect*)&rect, blocks, gsc->blocks, gsc->blocki, gsc->blockn, out_points, count);
+		*path = (blocks == 1) ? PATH_GRIDONE : PATH_GRIDMERGE;
+		if (blocks == 1) return findHitsS((Rect*)&rect, s->blocks[0], s->blockn[0], out_points, count);
+		else return gsc->kernels->merge((Rect*)&rect, blocks, s->blocks, s->blocki, s->blockn, out_points, count);
 	} else {
-		if (nx < ny) return findHitsUyV(&rect, &gsc->xpoints->id[xidxl], &gsc->xpoints->rank[xidxl], &gsc->xpoints->y[xidxl], nx, out_points, count);
-		else return findHitsUxV(&rect, &gsc->ypoints->id[yidxl], &gsc->ypoints->rank[yidxl], &gsc->ypoints->x[yidxl], ny, out_points, count);
+		*path = (nx < ny) ? PATH_XSLAB : PATH_YSLAB;
+		if (nx < ny) return xslabHits(gsc, &rect, xidxl, nx, out_points, count);
+		else return yslabHits(gsc, &rect, yidxl, ny, out_points, count);
+	}
+}
+
+// points of the region's list inside rect with one of "ids", in rank order, up to count
+int32_t nodeIdHits(GumpSearchContext* sc, const Rect* rect, const IdMask* ids, Region* region, Point* out_points, int count) {
+	Points* p = region->rankpoints;
+	Points* src = p->pos ? sc->rankpoints : p;
+	int32_t hits = 0;
+	for (int k = 0; k < p->n && hits < count; k++) {
+		int i = p->pos ? p->pos[k] : k;
+		if (!hasId(ids, src->id[i])) continue;
+		if (src->x[i] < rect->lx || src->x[i] > rect->hx || src->y[i] < rect->ly || src->y[i] > rect->hy) continue;
+		Point hit = { src->id[i], src->rank[i], src->x[i], src->y[i] };
+		out_points[hits++] = hit;
+	}
+	EXAMINE(p->n);
+	return hits;
+}
+
+// slab scan of positions [start, start + n) of the x or y sorted points, keeping the count lowest ranked points inside
+// rect with one of "ids"
+int32_t slabIdHits(const Rect* rect, const IdMask* ids, Points* p, int start, int n, Point* out_points, int count) {
+	int32_t hits = 0;
+	int max = -1, maxloc = -1;
+	for (int i = start; i < start + n; i++) {
+		if (hits == count && p->rank[i] > max) continue;
+		if (!hasId(ids, p->id[i])) continue;
+		if (p->x[i] < rect->lx || p->x[i] > rect->hx || p->y[i] < rect->ly || p->y[i] > rect->hy) continue;
+		Point hit = { p->id[i], p->rank[i], p->x[i], p->y[i] };
+		if (hits < count) {
+			if (hit.rank > max) { max = hit.rank; maxloc = hits; }
+			out_points[hits++] = hit;
+			continue;
+		}
+
+		// replace the highest rank kept, and find the new highest
+		out_points[maxloc] = hit;
+		max = -1;
+		for (int k = 0; k < count; k++) {
+			if (out_points[k].rank > max) { max = out_points[k].rank; maxloc = k; }
+		}
+	}
+	EXAMINE(n);
+	ranksort(out_points, hits);
+	return hits;
+}
+
+// merge the rank ordered points of each id in "ids", taking the ones inside rect, up to count
+int32_t idListHits(GumpSearchContext* sc, const Rect* rect, const IdMask* ids, Point* out_points, int count) {
+	int head[256], end[256];
+	int8_t id[256];
+	int lists = 0;
+	for (int b = 0; b < 256; b++) {
+		if (!hasId(ids, (int8_t)b) || sc->idstart[b] == sc->idstart[b + 1]) continue;
+		head[lists] = sc->idstart[b];
+		end[lists] = sc->idstart[b + 1];
+		id[lists] = (int8_t)b;
+		lists++;
+	}
+
+	Points* p = sc->idpoints;
+	int32_t hits = 0;
+	int64_t n = 0;
+	if (lists == 1) {
+		// a single id is one rank ordered scan
+		int i = head[0];
+		for (; i < end[0] && hits < count; i++) {
+			if (p->x[i] < rect->lx || p->x[i] > rect->hx || p->y[i] < rect->ly || p->y[i] > rect->hy) continue;
+			Point hit = { id[0], p->rank[i], p->x[i], p->y[i] };
+			out_points[hits++] = hit;
+		}
+		EXAMINE(i - head[0]);
+		return hits;
+	}
+
+	while (hits < count) {
+		int minl = -1;
+		for (int l = 0; l < lists; l++) {
+			if (head[l] < end[l] && (minl < 0 || p->rank[head[l]] < p->rank[head[minl]])) minl = l;
+		}
+		if (minl < 0) break;
+
+		int i = head[minl]++;
+		n++;
+		if (p->x[i] < rect->lx || p->x[i] > rect->hx || p->y[i] < rect->ly || p->y[i] > rect->hy) continue;
+		Point hit = { id[minl], p->rank[i], p->x[i], p->y[i] };
+		out_points[hits++] = hit;
+	}
+	EXAMINE(n);
+	return hits;
+}
+
+// search, only taking points with one of "ids". The region holding rect answers if its list has count such points.
+// Otherwise either the grid cells rect overlaps that have any of the ids are merged, or the points of each id are
+// merged in rank order, whichever is expected to look at fewer points
+int32_t searchIds(GumpSearchContext* gsc, Scratch* s, Rect rect, const IdMask* ids, const int32_t count, Point* out_points) {
+	if (gsc->N == 0 || count <= 0 || !(rect.lx <= rect.hx && rect.ly <= rect.hy)) return 0;
+
+	trimRect(gsc, &rect, &s->trim);
+	s->w = s->trim.hx - s->trim.lx;
+	s->h = s->trim.hy - s->trim.ly;
+	float apct = (s->w * s->h) / gsc->area;
+	if (apct > REGIONTHRESH && gsc->root && s->w >= 0 && s->h >= 0) {
+		Region* region = gsc->root;
+		for (Region* child = region; child; child = containingChild(region, &s->trim, s->w, s->h)) region = child;
+		if (isIdOverlap(&region->ids, ids)) {
+			int hits = nodeIdHits(gsc, &rect, ids, region, out_points, count);
+			if (hits == count) return mergeOutliers(gsc, &rect, ids, hits, count, out_points);
+		}
+	}
+
+	int64_t idn = 0;
+	for (int b = 0; b < 256; b++) {
+		if (hasId(ids, (int8_t)b)) idn += gsc->idstart[b + 1] - gsc->idstart[b];
+	}
+	int xidxl = gsc->kernels->bound(gsc->xpoints->x, true, rect.lx, 0, gsc->N - 1);
+	int nx = gsc->kernels->bound(gsc->xpoints->x, false, rect.hx, 0, gsc->N - 1) - xidxl + 1;
+	int yidxl = gsc->kernels->bound(gsc->ypoints->y, true, rect.ly, 0, gsc->N - 1);
+	int ny = gsc->kernels->bound(gsc->ypoints->y, false, rect.hy, 0, gsc->N - 1) - yidxl + 1;
+	if (idn == 0 || nx <= 0 || ny <= 0) return 0;
+
+	int i0 = gridOwner(gsc->gridx, gsc->divs, gsc->bounds->lx, gsc->dx, rect.lx);
+	int i1 = gridOwner(gsc->gridx, gsc->divs, gsc->bounds->lx, gsc->dx, rect.hx);
+	int j0 = gridOwner(gsc->gridy, gsc->divs, gsc->bounds->ly, gsc->dy, rect.ly);
+	int j1 = gridOwner(gsc->gridy, gsc->divs, gsc->bounds->ly, gsc->dy, rect.hy);
+
+	// about nx * ny / N points are in rect, so the lists of the ids give a hit about every N / inside points. The cell
+	// merge gives one about every N / idn points, and pays a scan of every cell for each
+	double inside = fmax(1.0, (double)nx * ny / gsc->N);
+	double listcost = fmin((double)idn, count * gsc->N / inside);
+	double gridcost = fmin(inside, (double)count * gsc->N / idn) * (i1 - i0 + 1) * (j1 - j0 + 1);
+
+#if !HILBERTSLABS
+	// thin rects cross many cells but few points of the x or y sorted arrays, which are scanned whole
+	if (nx < listcost && nx < gridcost && nx <= ny) return slabIdHits(&rect, ids, gsc->xpoints, xidxl, nx, out_points, count);
+	if (ny < listcost && ny < gridcost) return slabIdHits(&rect, ids, gsc->ypoints, yidxl, ny, out_points, count);
+#endif
+	if (listcost < gridcost) return idListHits(gsc, &rect, ids, out_points, count);
+
+	int blocks = 0;
+	for (int i = i0; i <= i1; i++) {
+		for (int j = j0; j <= j1; j++) {
+			if (gsc->dlen[i][j] == 0 || !isIdOverlap(&gsc->dids[i][j], ids)) continue;
+			if (!isRectOverlap(&rect, &gsc->drect[i][j])) continue;
+			s->blocks[blocks] = gsc->grid[i][j];
+			s->blocki[blocks] = 0;
+			s->blockn[blocks] = gsc->dlen[i][j];
+			blocks++;
+		}
+	}
+	if (blocks == 0) return 0;
+	return findHitsBI(&rect, ids, blocks, s->blocks, s->blocki, s->blockn, out_points, count);
+}
+
+// true if rects[i] adds nothing to the union: it lies inside another rect, or is the same as an earlier one
+bool isRectCovered(const Rect* rects, int nrects, int i) {
+	for (int j = 0; j < nrects; j++) {
+		if (j == i || !isRectInside((Rect*)&rects[j], (Rect*)&rects[i])) continue;
+		if (j < i || !isRectInside((Rect*)&rects[i], (Rect*)&rects[j])) return true;
+	}
+	return false;
+}
+
+// true if (x, y) is inside any of the rects
+inline bool isUnionHit(const Rect* rects, int nrects, float x, float y) {
+	for (int r = 0; r < nrects; r++) {
+		if (x >= rects[r].lx && x <= rects[r].hx && y >= rects[r].ly && y <= rects[r].hy) return true;
+	}
+	return false;
+}
+
+// a rank sorted list searchUnion merges: a grid cell, or the list of a region. A region's list only holds its lowest
+// ranks, so it can run out before the region does
+struct UnionList {
+	Point* cell;
+	Points* points;
+	int* pos;
+	int head;
+	int n;
+};
+
+// the region search would answer rect from, or NULL if rect is too small for it
+Region* unionRegion(GumpSearchContext* gsc, const Rect* rect) {
+	if (!gsc->root) return NULL;
+	Rect trim;
+	trimRect(gsc, rect, &trim);
+	float w = trim.hx - trim.lx, h = trim.hy - trim.ly;
+	if (!((w * h) / gsc->area > REGIONTHRESH && w >= 0 && h >= 0)) return NULL;
+
+	Region* region = gsc->root;
+	for (Region* child = region; child; child = containingChild(region, &trim, w, h)) region = child;
+	return region;
+}
+
+// append the grid cells the rects overlap to "lists", each once
+int addUnionCells(GumpSearchContext* gsc, const Rect* rects, int nrects, UnionList* lists, int nlists) {
+	int (*range)[4] = (int(*)[4])malloc(nrects * sizeof(*range));
+	for (int r = 0; r < nrects; r++) {
+		Rect* rect = (Rect*)&rects[r];
+		range[r][0] = gridOwner(gsc->gridx, gsc->divs, gsc->bounds->lx, gsc->dx, rect->lx);
+		range[r][1] = gridOwner(gsc->gridx, gsc->divs, gsc->bounds->lx, gsc->dx, rect->hx);
+		range[r][2] = gridOwner(gsc->gridy, gsc->divs, gsc->bounds->ly, gsc->dy, rect->ly);
+		range[r][3] = gridOwner(gsc->gridy, gsc->divs, gsc->bounds->ly, gsc->dy, rect->hy);
+		for (int i = range[r][0]; i <= range[r][1]; i++) {
+			for (int j = range[r][2]; j <= range[r][3]; j++) {
+				if (gsc->dlen[i][j] == 0 || !isRectOverlap(rect, &gsc->drect[i][j])) continue;
+				bool seen = false;
+				for (int q = 0; q < r && !seen; q++) {
+					seen = i >= range[q][0] && i <= range[q][1] && j >= range[q][2] && j <= range[q][3]
+						&& isRectOverlap((Rect*)&rects[q], &gsc->drect[i][j]);
+				}
+				if (seen) continue;
+
+				UnionList l = { gsc->grid[i][j], NULL, NULL, 0, gsc->dlen[i][j] };
+				lists[nlists++] = l;
+			}
+		}
+	}
+	free(range);
+	return nlists;
+}
+
+// merge "lists" in rank order, taking the points inside any of the rects once each, up to count. Return -1 if a
+// region's list runs out first, since the points of the region past it are unknown
+int32_t unionHits(UnionList* lists, int nlists, const Rect* rects, int nrects, Point* out_points, int count) {
+	int32_t hits = 0;
+	int prank = -1;
+	int64_t n = 0;
+	while (hits < count) {
+		int minl = -1;
+		int minrank = RANKMAX;
+		for (int l = 0; l < nlists; l++) {
+			UnionList* u = &lists[l];
+			if (u->head >= u->n) {
+				if (u->cell) continue;
+				hits = -1;
+				break;
+			}
+			int rank = u->cell ? u->cell[u->head].rank : u->points->rank[u->pos ? u->pos[u->head] : u->head];
+			if (rank < minrank) {
+				minl = l;
+				minrank = rank;
+			}
+		}
+		if (hits < 0 || minl < 0) break;
+
+		// lists that overlap share points, which come up together in rank order
+		UnionList* u = &lists[minl];
+		int i = u->head++;
+		n++;
+		if (minrank == prank) continue;
+		prank = minrank;
+
+		Point hit;
+		if (u->cell) hit = u->cell[i];
+		else {
+			i = u->pos ? u->pos[i] : i;
+			hit.id = u->points->id[i];
+			hit.rank = u->points->rank[i];
+			hit.x = u->points->x[i];
+			hit.y = u->points->y[i];
+		}
+		if (isUnionHit(rects, nrects, hit.x, hit.y)) out_points[hits++] = hit;
+	}
+	EXAMINE(n);
+	return hits;
+}
+
+// search the union of rects, taking each point once and stopping at count. The rects big enough for the region search
+// add the lists of the regions holding them, and the rest the grid cells they overlap, and all of them are merged in
+// one pass. If a region's list runs out first, the cells of every rect are merged instead
+int32_t searchUnion(GumpSearchContext* gsc, const Rect* rects, int nrects, const int32_t count, Point* out_points) {
+	if (gsc->N == 0 || count <= 0 || nrects <= 0) return 0;
+
+	// rects that are empty or inside another add nothing. The ones the regions answer go first
+	Rect* keep = (Rect*)malloc(nrects * sizeof(Rect));
+	Region** regions = (Region**)malloc(nrects * sizeof(Region*));
+	int n = 0, nr = 0;
+	for (int r = 0; r < nrects; r++) {
+		if (!(rects[r].lx <= rects[r].hx && rects[r].ly <= rects[r].hy) || isRectCovered(rects, nrects, r)) continue;
+		keep[n++] = rects[r];
+		Region* region = unionRegion(gsc, &rects[r]);
+		if (!region) continue;
+		keep[n-1] = keep[nr];
+		keep[nr] = rects[r];
+		regions[nr++] = region;
+	}
+
+	// a single rect is a plain search
+	int32_t hits = 0;
+	if (n == 1) {
+		int path;
+		hits = searchGumptionaire(gsc, searchScratch(gsc), keep[0], count, out_points, &path);
+	}
+	if (n <= 1) {
+		free(regions);
+		free(keep);
+		return hits;
+	}
+
+	UnionList* lists = (UnionList*)malloc((nr + gsc->divs * gsc->divs) * sizeof(UnionList));
+	int nlists = 0;
+	for (int q = 0; q < nr; q++) {
+		Points* p = regions[q]->rankpoints;
+		bool seen = regions[q]->n == 0;
+		for (int o = 0; o < q && !seen; o++) seen = regions[o] == regions[q];
+		if (seen) continue;
+
+		UnionList l = { NULL, p->pos ? gsc->rankpoints : p, p->pos, 0, p->n };
+		lists[nlists++] = l;
+	}
+	nlists = addUnionCells(gsc, keep + nr, n - nr, lists, nlists);
+	hits = unionHits(lists, nlists, keep, n, out_points, count);
+
+	// the cells hold the points beyond the bounds, but the regions don't
+	if (hits >= 0 && nr > 0) {
+		hits = mergeOutlierHits(gsc, hits, count, out_points, [keep, n, nr](Point* p) {
+			return isUnionHit(keep, nr, p->x, p->y) && !isUnionHit(keep + nr, n - nr, p->x, p->y);
+		});
+	}
+	if (hits < 0) {
+		nlists = addUnionCells(gsc, keep, n, lists, 0);
+		hits = unionHits(lists, nlists, keep, n, out_points, count);
+	}
+
+	free(lists);
+	free(regions);
+	free(keep);
+	return hits;
+}
+
+// output of search_below: the caller's buffer, handed to "chunk" whenever it fills
+struct BelowOut {
+	Point* out;
+	int32_t capacity;
+	int32_t n;
+	int32_t total;
+	T_chunk chunk;
+	void* user;
+};
+
+// add p to the output. Return false once the buffer is full and there is no chunk callback to empty it
+inline bool emitBelow(BelowOut* o, Point p) {
+	if (o->n == o->capacity) {
+		if (!o->chunk || o->capacity == 0) return false;
+		o->chunk(o->user, o->out, o->n);
+		o->n = 0;
+	}
+	o->out[o->n++] = p;
+	o->total++;
+	return true;
+}
+
+// the deepest region containing rect whose list holds every one of its points ranked below max_rank, or NULL
+Region* belowRegion(GumpSearchContext* sc, Rect* trim, int32_t max_rank) {
+	float w = trim->hx - trim->lx, h = trim->hy - trim->ly;
+	Region* found = NULL;
+	for (Region* region = sc->root; region; region = containingChild(region, trim, w, h)) {
+		Points* p = region->rankpoints;
+		if (p->n == 0) return region;
+		int last = p->pos ? sc->rankpoints->rank[p->pos[p->n - 1]] : p->rank[p->n - 1];
+		if (last >= max_rank) found = region;
+	}
+	return found;
+}
+
+// every point of the region's list inside rect ranked below max_rank, in rank order, then the points beyond the bounds
+// the regions don't hold
+bool regionBelow(GumpSearchContext* sc, const Rect* rect, Region* region, int32_t max_rank, BelowOut* o) {
+	Points* p = region->rankpoints;
+	Points* src = p->pos ? sc->rankpoints : p;
+	for (int k = 0; k < p->n; k++) {
+		int i = p->pos ? p->pos[k] : k;
+		if (src->rank[i] >= max_rank) break;
+		if (src->x[i] < rect->lx || src->x[i] > rect->hx || src->y[i] < rect->ly || src->y[i] > rect->hy) continue;
+		Point hit = { src->id[i], src->rank[i], src->x[i], src->y[i] };
+		if (!emitBelow(o, hit)) return false;
+	}
+	for (int k = 0; k < sc->noutliers; k++) {
+		Point* q = &sc->outliers[k];
+		if (q->rank < max_rank && isHit((Rect*)rect, q) && !emitBelow(o, *q)) return false;
+	}
+	return true;
+}
+
+// every point inside rect ranked below max_rank from the grid cells rect overlaps, cell by cell. Each cell is rank
+// sorted, so its scan ends at the first point ranked max_rank or above. Points on a cell edge only come from the cell
+// that owns them
+bool gridBelow(GumpSearchContext* sc, const Rect* rect, int32_t max_rank, BelowOut* o) {
+	int i0 = gridOwner(sc->gridx, sc->divs, sc->bounds->lx, sc->dx, rect->lx);
+	int i1 = gridOwner(sc->gridx, sc->divs, sc->bounds->lx, sc->dx, rect->hx);
+	int j0 = gridOwner(sc->gridy, sc->divs, sc->bounds->ly, sc->dy, rect->ly);
+	int j1 = gridOwner(sc->gridy, sc->divs, sc->bounds->ly, sc->dy, rect->hy);
+	for (int i = i0; i <= i1; i++) {
+		float ox = (i > 0) ? sc->gridx[i-1] : -INFINITY;
+		for (int j = j0; j <= j1; j++) {
+			if (sc->dlen[i][j] == 0 || !isRectOverlap((Rect*)rect, &sc->drect[i][j])) continue;
+			float oy = (j > 0) ? sc->gridy[j-1] : -INFINITY;
+			Point* p = sc->grid[i][j];
+			for (int k = 0; k < sc->dlen[i][j] && p[k].rank < max_rank; k++) {
+				if (!isHit((Rect*)rect, &p[k]) || p[k].x <= ox || p[k].y <= oy) continue;
+				if (!emitBelow(o, p[k])) return false;
+			}
+		}
+	}
+	return true;
+}
+
+int32_t searchBelow(GumpSearchContext* sc, const Rect* rect, int32_t max_rank, BelowOut* o) {
+	if (sc->N == 0 || !(rect->lx <= rect->hx && rect->ly <= rect->hy)) return 0;
+
+	// one region list is a single rank ordered scan, where the grid has a scan per cell
+	Rect trim;
+	trimRect(sc, rect, &trim);
+	Region* region = (sc->root && trim.lx <= trim.hx && trim.ly <= trim.hy) ? belowRegion(sc, &trim, max_rank) : NULL;
+	if (region) regionBelow(sc, rect, region, max_rank, o);
+	else gridBelow(sc, rect, max_rank, o);
+
+	if (o->chunk && o->n > 0) o->chunk(o->user, o->out, o->n);
+	return o->total;
+}
+
+// search "gsc" (the primary or one of its replicas) with scratch "s", counting and tracing the query on the primary
+inline int32_t searchWith(GumpSearchContext* primary, GumpSearchContext* gsc, Scratch* s, Rect rect, const int32_t count, Point* out_points) {
+	int path;
+#if INSTRUMENT || TRACE
+	// the clock is only read if something records the time
+#if TRACE
+	TraceWriter* tracer = __atomic_load_n(&primary->tracer, __ATOMIC_ACQUIRE);
+#else
+	TraceWriter* tracer = NULL;
+	(void)primary;
+#endif
+	if (!INSTRUMENT && !tracer) return searchGumptionaire(gsc, s, rect, count, out_points, &path);
+
+	examined = 0;
+	uint64_t start = __rdtsc();
+	int32_t hits = searchGumptionaire(gsc, s, rect, count, out_points, &path);
+	int64_t cycles = __rdtsc() - start;
+
+#if TRACE
+	if (tracer) {
+		lockAcquire(&primary->tracelock);
+		if (primary->tracer) traceAppend(primary->tracer, &rect, count, hits, path, cycles);
+		lockRelease(&primary->tracelock);
 	}
+#endif
+#if INSTRUMENT
+	PathCounters* c = &gsc->counters.path[path];
+	int bucket = (cycles > 0) ? 63 - __builtin_clzll(cycles) : 0;
+	if (bucket >= HISTBUCKETS) bucket = HISTBUCKETS - 1;
+	countAdd(&c->queries, 1);
+	countAdd(&c->examined, examined);
+	countAdd(&c->cycles, cycles);
+	countAdd(&c->hist[bucket], 1);
+#endif
+	return hits;
+#else
+	(void)primary;
+	return searchGumptionaire(gsc, s, rect, count, out_points, &path);
+#endif
+}
 
-	// totops += ops;
-	// if (method == 2) DPRINT(("%d,%d,%d,%f,%d,%d,%d,%d,%d\n", ops, nx, ny, pct, blocks, exptests, nsmall, w, h));
+__stdcall int32_t GUMPTIONAIRE(search)(SearchContext* sc, Rect rect, const int32_t count, Point* out_points) {
+	GumpSearchContext* primary = (GumpSearchContext*)sc;
+	GumpSearchContext* gsc = localReplica(primary);
+	return searchWith(primary, gsc, searchScratch(gsc), rect, count, out_points);
+}
 
-	// FILE *f = fopen("rects.csv", "a");
-	// fprintf(f, "%f,%f,%f,%f,%d\n", gsc->trim->lx, gsc->trim->hx, gsc->trim->ly, gsc->trim->hy, ops);
-	// fclose(f);
+// order queries along the hilbert curve through the centers of the rects
+BatchKey* batchKeys(GumpSearchContext* gsc, const Rect* rects, int nrects) {
+	BatchKey* keys = (BatchKey*)malloc(nrects * sizeof(BatchKey));
+	double side = (double)((1u << HILBERTORDER) - 1);
+	double sx = side / (gsc->bounds->hx - gsc->bounds->lx);
+	double sy = side / (gsc->bounds->hy - gsc->bounds->ly);
+	for (int i = 0; i < nrects; i++) {
+		double cx = ((double)rects[i].lx + (double)rects[i].hx) / 2;
+		double cy = ((double)rects[i].ly + (double)rects[i].hy) / 2;
+		double hx = (cx - gsc->bounds->lx) * sx;
+		double hy = (cy - gsc->bounds->ly) * sy;
+		if (!(hx > 0)) hx = 0; else if (hx > side) hx = side;
+		if (!(hy > 0)) hy = 0; else if (hy > side) hy = side;
+		keys[i].key = hilbertIndex((uint32_t)hx, (uint32_t)hy);
+		keys[i].idx = i;
+	}
+	keysort(keys, nrects);
+	return keys;
+}
+
+// run the queries of keys[0, n) in groups of BATCHGROUP, prefetching each group's region descents first
+int32_t searchKeys(GumpSearchContext* primary, GumpSearchContext* local, Scratch* s, const Rect* rects, const BatchKey* keys, int n, int32_t count, Point* out_points, int32_t* out_counts) {
+	int32_t total = 0;
+	for (int i = 0; i < n; i += BATCHGROUP) {
+		int m = (n - i < BATCHGROUP) ? n - i : BATCHGROUP;
+#if PREFETCH
+		prefetchDescents(local, rects, &keys[i], m);
+#endif
+		for (int g = i; g < i + m; g++) {
+			int idx = keys[g].idx;
+			out_counts[idx] = searchWith(primary, local, s, rects[idx], count, &out_points[(size_t)idx * count]);
+			total += out_counts[idx];
+		}
+	}
+	return total;
 }
 
-__stdcall SearchContext* destroy(SearchContext* sc) {
+__stdcall int32_t GUMPTIONAIRE(search_batch)(SearchContext* sc, const Rect* rects, const int32_t nrects, const int32_t count, Point* out_points, int32_t* out_counts) {
 	GumpSearchContext* gsc = (GumpSearchContext*)sc;
+	if (nrects <= 0) return 0;
+	if (gsc->N == 0) {
+		memset(out_counts, 0, nrects * sizeof(int32_t));
+		return 0;
+	}
+
+	BatchKey* keys = batchKeys(gsc, rects, nrects);
+	GumpSearchContext* local = localReplica(gsc);
+	int32_t total = searchKeys(gsc, local, searchScratch(local), rects, keys, nrects, count, out_points, out_counts);
+	free(keys);
+	return total;
+}
+
+inline uint64_t stealRange(uint32_t lo, uint32_t hi) {
+	return ((uint64_t)hi << 32) | lo;
+}
+
+// the next chunk of the worker's own range, or -1 if it has none left
+int takeChunk(StealWorker* w) {
+	uint64_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+	while (true) {
+		uint32_t lo = (uint32_t)r, hi = (uint32_t)(r >> 32);
+		if (lo >= hi) return -1;
+		if (__atomic_compare_exchange_n(&w->range, &r, stealRange(lo + 1, hi), true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return lo;
+	}
+}
+
+// move the back half of the busiest worker's chunks into w's own (empty) range. Return false if every range is empty.
+// Ranges only shrink once handed out, except an empty one refilled by its own worker, so a range never goes back to a
+// value another thread has seen and a compare-exchange can't succeed on a stale one
+bool stealChunks(StealWorker* w) {
+	StealBatch* b = w->batch;
+	while (true) {
+		StealWorker* victim = NULL;
+		uint64_t r = 0;
+		uint32_t most = 0;
+		for (int i = 0; i < b->nworkers; i++) {
+			uint64_t ri = __atomic_load_n(&b->workers[i].range, __ATOMIC_ACQUIRE);
+			uint32_t left = (uint32_t)(ri >> 32) - (uint32_t)ri;
+			if ((uint32_t)ri < (uint32_t)(ri >> 32) && left > most) {
+				victim = &b->workers[i];
+				r = ri;
+				most = left;
+			}
+		}
+		if (!victim) return false;
+
+		uint32_t lo = (uint32_t)r, hi = (uint32_t)(r >> 32);
+		uint32_t mid = hi - (hi - lo + 1) / 2;
+		if (!__atomic_compare_exchange_n(&victim->range, &r, stealRange(lo, mid), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) continue;
+		__atomic_store_n(&w->range, stealRange(mid, hi), __ATOMIC_RELEASE);
+		w->steals++;
+		return true;
+	}
+}
+
+// run chunks of the batch until none are left anywhere, searching the replica on this thread's node with the worker's
+// own scratch. A worker given a node moves there first, so its scratch is allocated there too
+THREADFN stealWorker(void* arg) {
+	StealWorker* w = (StealWorker*)arg;
+	StealBatch* b = w->batch;
+	GumpSearchContext* primary = (GumpSearchContext*)b->sc;
+	if (w->node >= 0) numaPin(primary->topology, w->node);
+	GumpSearchContext* local = localReplica(primary);
+	w->s = buildScratch(local->divs);
+
+	int32_t total = 0;
+	while (true) {
+		int c = takeChunk(w);
+		if (c < 0) {
+			if (!stealChunks(w)) break;
+			continue;
+		}
+		int first = c * STEALCHUNK;
+		int n = (b->nrects - first < STEALCHUNK) ? b->nrects - first : STEALCHUNK;
+		total += searchKeys(primary, local, w->s, b->rects, &b->keys[first], n, b->count, b->out_points, b->out_counts);
+		w->chunks++;
+	}
+	w->total = total;
+	return 0;
+}
+
+__stdcall int32_t GUMPTIONAIRE(search_parallel)(SearchContext* sc, const Rect* rects, const int32_t nrects, const int32_t count, Point* out_points, int32_t* out_counts, const int32_t nthreads) {
+	GumpSearchContext* gsc = (GumpSearchContext*)sc;
+	if (nrects <= 0) return 0;
+	if (gsc->N == 0) {
+		memset(out_counts, 0, nrects * sizeof(int32_t));
+		return 0;
+	}
+
+	int nchunks = (nrects + STEALCHUNK - 1) / STEALCHUNK;
+	int nworkers = nthreads > 0 ? nthreads : cpuCount();
+	if (nworkers > nchunks) nworkers = nchunks;
+	if (nworkers == 1) return GUMPTIONAIRE(search_batch)(sc, rects, nrects, count, out_points, out_counts);
+
+	StealBatch b;
+	b.sc = sc;
+	b.rects = rects;
+	b.keys = batchKeys(gsc, rects, nrects);
+	b.nrects = nrects;
+	b.count = count;
+	b.out_points = out_points;
+	b.out_counts = out_counts;
+	b.nworkers = nworkers;
+	b.workers = (StealWorker*)calloc(nworkers, sizeof(StealWorker));
+
+	// the nodes with a replica, which the started workers are spread over in turn
+	int nodes[MAXNODES];
+	int nnodes = 0;
+	for (int k = 0; k < gsc->nreplicas; k++) {
+		if (gsc->replicas[k]) nodes[nnodes++] = k;
+	}
+
+	// each worker starts on an even share of the chunks, consecutive along the curve. The calling thread stays on its
+	// own node
+	for (int i = 0; i < nworkers; i++) {
+		StealWorker* w = &b.workers[i];
+		w->range = stealRange((int64_t)nchunks * i / nworkers, (int64_t)nchunks * (i + 1) / nworkers);
+		w->batch = &b;
+		w->node = (i > 0 && nnodes > 1) ? nodes[i % nnodes] : -1;
+	}
+
+	// the calling thread is worker 0. A worker that can't be started leaves its chunks to be stolen
+	bool* started = (bool*)calloc(nworkers, sizeof(bool));
+	for (int i = 1; i < nworkers; i++) started[i] = threadStart(&b.workers[i].thread, stealWorker, &b.workers[i]);
+	stealWorker(&b.workers[0]);
+
+	int32_t total = 0;
+	for (int i = 0; i < nworkers; i++) {
+		StealWorker* w = &b.workers[i];
+		if (i > 0 && started[i]) threadJoin(w->thread);
+		DPRINT(("Worker %d: %d chunks, %d steals\n", i, w->chunks, w->steals));
+		total += w->total;
+		if (w->s) freeScratch(w->s);
+	}
+
+	free(started);
+	free(b.workers);
+	free((void*)b.keys);
+	return total;
+}
+
+__stdcall int32_t GUMPTIONAIRE(search_union)(SearchContext* sc, const Rect* rects, const int32_t nrects, const int32_t count, Point* out_points) {
+	return searchUnion(localReplica((GumpSearchContext*)sc), rects, nrects, count, out_points);
+}
+
+__stdcall int32_t GUMPTIONAIRE(search_ids)(SearchContext* sc, const Rect rect, const IdMask* ids, const int32_t count, Point* out_points) {
+	GumpSearchContext* gsc = localReplica((GumpSearchContext*)sc);
+	return searchIds(gsc, searchScratch(gsc), rect, ids, count, out_points);
+}
+
+__stdcall int32_t GUMPTIONAIRE(search_below)(SearchContext* sc, const Rect rect, const int32_t max_rank, Point* out_points, const int32_t capacity, T_chunk chunk, void* user) {
+	BelowOut o = { out_points, capacity, 0, 0, chunk, user };
+	return searchBelow(localReplica((GumpSearchContext*)sc), &rect, max_rank, &o);
+}
+
+__stdcall int64_t GUMPTIONAIRE(search_async)(SearchContext* sc, const Rect rect, const int32_t count, Point* out_points, T_done done, void* user) {
+	bool started;
+	AsyncPool* p = asyncPool((GumpSearchContext*)sc, 0, 0, &started);
+	if (!p) return 0;
+
+	lockAcquire(&p->lock);
+	if (p->n == p->capacity || p->stop) {
+		lockRelease(&p->lock);
+		return 0;
+	}
+	AsyncQuery* q = &p->queue[(p->head + p->n) % p->capacity];
+	q->ticket = ++p->next;
+	q->rect = rect;
+	q->count = count;
+	q->out = out_points;
+	q->done = done;
+	q->user = user;
+	q->cancelled = false;
+	p->n++;
+	int64_t ticket = q->ticket;
+	condSignal(&p->work);
+	lockRelease(&p->lock);
+	return ticket;
+}
+
+__stdcall int32_t GUMPTIONAIRE(cancel_async)(SearchContext* sc, const int64_t ticket) {
+	AsyncPool* p = __atomic_load_n(&((GumpSearchContext*)sc)->pool, __ATOMIC_ACQUIRE);
+	if (!p) return 0;
+
+	int32_t cancelled = 0;
+	lockAcquire(&p->lock);
+	for (int i = 0; i < p->n && !cancelled; i++) {
+		AsyncQuery* q = &p->queue[(p->head + i) % p->capacity];
+		if (q->ticket != ticket || q->cancelled) continue;
+		q->cancelled = true;
+		cancelled = 1;
+	}
+	for (int i = 0; i < p->nworkers && !cancelled; i++) {
+		AsyncWorker* w = &p->workers[i];
+		if (w->ticket != ticket || w->cancelled) continue;
+		w->cancelled = true;
+		cancelled = 1;
+	}
+	lockRelease(&p->lock);
+	return cancelled;
+}
+
+__stdcall int32_t GUMPTIONAIRE(start_async)(SearchContext* sc, const int32_t nthreads, const int32_t capacity) {
+	bool started;
+	asyncPool((GumpSearchContext*)sc, nthreads, capacity, &started);
+	return started ? 0 : -1;
+}
+
+__stdcall int32_t GUMPTIONAIRE(publish_shared)(SearchContext* sc, const char* name) {
+	GumpSearchContext* gsc = (GumpSearchContext*)sc;
+	if (gsc->shared && (gsc->shared->attached || strcmp(gsc->shared->name, name) != 0)) {
+		if (gsc->shared->attached) return -1;
+		freeShared(gsc);
+	}
+	if (!gsc->shared) {
+		SharedIndex* si = (SharedIndex*)calloc(1, sizeof(SharedIndex));
+		snprintf(si->name, SHMNAME, "%s", name);
+		if (!openControl(si, name)) {
+			free(si);
+			return -1;
+		}
+		gsc->shared = si;
+	}
+	SharedIndex* si = gsc->shared;
+	SharedControl* control = (SharedControl*)si->control.base;
+
+	// number the region nodes by address, so a child's index can be looked up
+	int nregions = 0;
+	if (gsc->N > 0 && gsc->root) collectRegion(gsc->root, true, true, true, true, true, true, NULL, &nregions);
+	Region** nodes = (Region**)malloc((nregions > 0 ? nregions : 1) * sizeof(Region*));
+	nregions = 0;
+	if (gsc->N > 0 && gsc->root) collectRegion(gsc->root, true, true, true, true, true, true, nodes, &nregions);
+	#define region_lt(a,b) (*(a) < *(b))
+	QSORT(Region*, nodes, nregions, region_lt);
+
+	Packer pk = { NULL, 0 };
+	int64_t bytes = packIndex(gsc, &pk, nodes, nregions);
+	uint32_t old = __atomic_load_n(&control->version, __ATOMIC_ACQUIRE);
+	uint32_t version = old + 1;
+	char path[SHMNAME];
+	shmName(path, name, version);
+	SharedMemory data;
+	if (!shmCreate(&data, path, bytes)) {
+		free(nodes);
+		return -1;
+	}
+	pk.base = data.base;
+	packIndex(gsc, &pk, nodes, nregions);
+	free(nodes);
+	DPRINT(("Published %s version %u, %lld bytes, %d regions\n", name, version, (long long)bytes, nregions));
+
+	// the old version's name goes, and its memory with the last process attached to it
+	shmPost(&control->version, version);
+	if (old > 0) {
+		shmName(path, name, old);
+		shmRemove(path);
+	}
+	shmClose(&si->data);
+	si->data = data;
+	si->version = version;
+	return version;
+}
+
+__stdcall SearchContext* GUMPTIONAIRE(attach_shared)(const char* name) {
+	SharedIndex* si = (SharedIndex*)calloc(1, sizeof(SharedIndex));
+	snprintf(si->name, SHMNAME, "%s", name);
+	si->attached = true;
+	char path[SHMNAME];
+	shmName(path, name, 0);
+	if (!shmOpen(&si->control, path, false)) {
+		free(si);
+		return NULL;
+	}
+	SharedControl* control = (SharedControl*)si->control.base;
+
+	// the version read can be replaced and removed before its segment is opened
+	for (int tries = 0; tries < SHAREDTRIES && control->magic == SHAREDMAGIC; tries++) {
+		uint32_t version = __atomic_load_n(&control->version, __ATOMIC_ACQUIRE);
+		if (version == 0) break;
+		shmName(path, name, version);
+		if (!shmOpen(&si->data, path, false)) continue;
+		si->version = version;
+		break;
+	}
+	SharedHeader* h = (SharedHeader*)si->data.base;
+	if (!h || si->data.bytes < (int64_t)sizeof(SharedHeader) || h->magic != sharedMagic() || h->bytes > si->data.bytes) {
+		shmClose(&si->data);
+		shmClose(&si->control);
+		free(si);
+		return NULL;
+	}
+
+	BuildParams params;
+	defaultParams(&params);
+	params.divs     = h->divs;
+	params.maxdepth = h->maxdepth;
+	params.nodesize = h->nodesize;
+	params.leafsize = h->leafsize;
+	params.maxleaf  = h->maxleaf;
+	GumpSearchContext* gsc = newContext(h->N, &params);
+	gsc->huge = false;
+	gsc->shared = si;
+	unpackIndex(gsc, si);
+	DPRINT(("Attached to %s version %u, %lld bytes\n", name, si->version, (long long)h->bytes));
+	return (SearchContext*)gsc;
+}
+
+__stdcall int32_t GUMPTIONAIRE(wait_shared)(SearchContext* sc, const int32_t timeout_ms) {
+	SharedIndex* si = ((GumpSearchContext*)sc)->shared;
+	if (!si || !si->attached) return 0;
+	uint32_t version = shmWait(&((SharedControl*)si->control.base)->version, si->version, timeout_ms);
+	return (version != si->version) ? version : 0;
+}
+
+__stdcall void GUMPTIONAIRE(unpublish_shared)(const char* name) {
+	char path[SHMNAME];
+	shmName(path, name, 0);
+	SharedMemory control;
+	if (!shmOpen(&control, path, false)) return;
+	uint32_t version = __atomic_load_n(&((SharedControl*)control.base)->version, __ATOMIC_ACQUIRE);
+	shmClose(&control);
+	if (version > 0) {
+		char data[SHMNAME];
+		shmName(data, name, version);
+		shmRemove(data);
+	}
+	shmRemove(path);
+}
+
+__stdcall int32_t GUMPTIONAIRE(count)(SearchContext* sc, const Rect rect) {
+	return countGrid(localReplica((GumpSearchContext*)sc), &rect, INT32_MAX);
+}
+
+__stdcall int32_t GUMPTIONAIRE(exists)(SearchContext* sc, const Rect rect) {
+	return countGrid(localReplica((GumpSearchContext*)sc), &rect, 1);
+}
+
+__stdcall int64_t GUMPTIONAIRE(stats)(SearchContext* sc, IndexStats* out) {
+	GumpSearchContext* gsc = (GumpSearchContext*)sc;
+	memset(out, 0, sizeof(IndexStats));
+	out->N = gsc->N;
+	out->scratch.bytes = sizeof(GumpSearchContext);
+	if (gsc->N > 0) {
+		if (gsc->root) statRegions(gsc, &out->regions);
+		statGrid(gsc, &out->grid);
+#if HILBERTSLABS
+		statHilbert(gsc, &out->hilbert);
+#endif
+
+		out->sorted.nodes = 4;
+		out->sorted.bytes = pointsBytes(gsc->xpoints) + pointsBytes(gsc->ypoints) + pointsBytes(gsc->rankpoints)
+			+ pointsBytes(gsc->idpoints);
+		out->sorted.points = (gsc->xpoints->rank ? 3 * (int64_t)gsc->N : gsc->N) + gsc->N;
+		out->sorted.duplicates = out->sorted.points > gsc->N ? out->sorted.points - gsc->N : 0;
+
+		out->scratch.nodes = 3;
+		out->scratch.bytes += scratchBytes(gsc->divs) + arenaUnused(gsc->arena);
+	}
+	if (gsc->tracer) out->scratch.bytes += sizeof(TraceWriter);
+
+	// every other node's copy of the index
+	for (int k = 0; k < gsc->nreplicas; k++) {
+		GumpSearchContext* r = gsc->replicas[k];
+		if (!r || r == gsc) continue;
+		IndexStats rs;
+		GUMPTIONAIRE(stats)((SearchContext*)r, &rs);
+		statAdd(&out->regions, &rs.regions);
+		statAdd(&out->grid,    &rs.grid);
+		statAdd(&out->sorted,  &rs.sorted);
+		statAdd(&out->hilbert, &rs.hilbert);
+		statAdd(&out->scratch, &rs.scratch);
+	}
+	if (gsc->nreplicas > 0) out->scratch.bytes += gsc->nreplicas * sizeof(GumpSearchContext*) + sizeof(NumaTopology) + gsc->topology->ncpus * sizeof(int16_t);
+
+	out->bytes = out->regions.bytes + out->grid.bytes + out->sorted.bytes + out->hilbert.bytes + out->scratch.bytes;
+	return out->bytes;
+}
+
+__stdcall int32_t GUMPTIONAIRE(counters)(SearchContext* sc, QueryCounters* out, const int32_t reset) {
+#if INSTRUMENT
+	GumpSearchContext* gsc = (GumpSearchContext*)sc;
+	memset(out, 0, sizeof(QueryCounters));
+	takeCounters(out, &gsc->counters, reset);
+
+	// searches answered by other nodes' copies were counted there
+	for (int k = 0; k < gsc->nreplicas; k++) {
+		GumpSearchContext* r = gsc->replicas[k];
+		if (r && r != gsc) takeCounters(out, &r->counters, reset);
+	}
+	return 0;
+#else
+	(void)sc;
+	(void)reset;
+	memset(out, 0, sizeof(QueryCounters));
+	return -1;
+#endif
+}
+
+__stdcall int32_t GUMPTIONAIRE(trace)(SearchContext* sc, const char* path) {
+#if TRACE
+	GumpSearchContext* gsc = (GumpSearchContext*)sc;
+	TraceWriter* tracer = path ? traceOpen(path, gsc->N, gsc->N > 0 ? gsc->bounds : NULL) : NULL;
+
+	// searches running on other threads append under the lock, so the old writer can't be in use once it's swapped
+	lockAcquire(&gsc->tracelock);
+	TraceWriter* old = gsc->tracer;
+	__atomic_store_n(&gsc->tracer, tracer, __ATOMIC_RELEASE);
+	lockRelease(&gsc->tracelock);
+	if (old) traceClose(old);
+	return (path && !tracer) ? -1 : 0;
+#else
+	(void)sc;
+	(void)path;
+	return -1;
+#endif
+}
+
+__stdcall SearchContext* GUMPTIONAIRE(destroy)(SearchContext* sc) {
+	GumpSearchContext* gsc = (GumpSearchContext*)sc;
+	if (gsc->pool) freePool(gsc->pool);
+	if (gsc->tracer) traceClose(gsc->tracer);
+	lockFree(&gsc->tracelock);
+	if (gsc->nreplicas > 0) {
+		for (int k = 0; k < gsc->nreplicas; k++) {
+			if (gsc->replicas[k] && gsc->replicas[k] != gsc) GUMPTIONAIRE(destroy)((SearchContext*)gsc->replicas[k]);
+		}
+		free(gsc->replicas);
+		numaFree(gsc->topology);
+		free(gsc->topology);
+	}
+	if (gsc->shared) {
+		bool attached = gsc->shared->attached;
+		freeShared(gsc);
+		if (attached) {
+			free(gsc);
+			return NULL;
+		}
+	}
 	if (gsc->N == 0) {
 		free(gsc);
 		return NULL;
@@ -931,9 +3153,14 @@ __stdcall SearchContext* destroy(SearchContext* sc) {
 
 	freePoints(gsc->xpoints);
 	freePoints(gsc->ypoints);
-	free(gsc->trim);
-	freeRegion(gsc->root, true, true, true, true, true, true);
+	freePoints(gsc->rankpoints);
+	freePoints(gsc->idpoints);
+#if HILBERTSLABS
+	freeHilbert(gsc);
+#endif
+	if (gsc->root) freeRegion(gsc->root, true, true, true, true, true, true);
 	freeGrid(gsc);
+	arenaFree(gsc->arena);
 	free(gsc);
 	return NULL;
 }
\ No newline at end of file
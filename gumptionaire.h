@@ -1,4 +1,10 @@
 #include "point_search.h"
+#include "stats.h"
+#include "trace.h"
+#include "hugepages.h"
+#include "numa.h"
+#include "threads.h"
+#include "shm.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -10,44 +16,283 @@ extern "C" {
 #define DLL_API __declspec(dllimport)
 #endif
 
+/* Name of an export. engines.c compiles this engine next to others and defines GUMPTIONAIRE_PREFIX to give the exports
+their own names there. Only the declarations, definitions and calls are renamed, so the parameters and fields that share
+a name keep it. */
+#ifdef GUMPTIONAIRE_PREFIX
+#define GUMPTIONAIRE(name) gumptionaire_##name
+#else
+#define GUMPTIONAIRE(name) name
+#endif
+
+/* Set of point ids: bit (uint8_t)id of bits[] is set for each id in the set. */
+struct IdMask {
+	uint64_t bits[4];
+};
+
 struct Points {
 	int n;
 	int8_t* id;
 	int32_t* rank;
 	float* x;
 	float* y;
+	uint16_t* qx;
+	uint16_t* qy;
+	int32_t* pos;  // positions into the context's rankpoints, for nodes that don't keep their own copies
 };
 
 struct Region {
+	// what a parent's descent reads first, together
+	Rect box;   // the node's bounds, which rect points at
+	Rect* rect;
+	float subw, subh;
 	int n;
-	Point* ranksort;
-
 	Points* rankpoints;
-	Rect* rect;
-	Rect* crect;
+
 	Region* left;
 	Region* right;
 	Region* lrmid;
 	Region* bottom;
 	Region* top;
 	Region* btmid;
+	Rect* crect;
+	Point* ranksort;
+	IdMask ids;  // ids in the node's list
+};
+
+struct HBlock {
+	Rect bbox;
+	int32_t minrank;
+	int32_t start;
+	int32_t n;
+};
+
+struct BatchKey {
+	uint32_t key;
+	int32_t idx;
+};
+
+enum SearchPath {
+	PATH_EMPTY,      // no points can be in the rect
+	PATH_REGION,     // answered from a region node
+	PATH_XSLAB,      // scan of the points in the rect's x range
+	PATH_YSLAB,      // scan of the points in the rect's y range
+	PATH_GRIDONE,    // scan of a single grid cell
+	PATH_GRIDMERGE,  // rank merge of several grid cells
+	NPATHS
+};
+
+#define HISTBUCKETS 32
+
+struct PathCounters {
+	int64_t queries;
+	int64_t examined;
+	int64_t cycles;
+	int64_t hist[HISTBUCKETS];  // queries by floor(log2(cycles))
+};
+
+struct QueryCounters {
+	PathCounters path[NPATHS];
+	int64_t fallbacks;       // region searches that failed before another path answered
+	int64_t fallbackcycles;  // cycles spent in those failed region searches
+};
+
+/* State of one search in progress. Every thread searching a context uses its own. */
+struct Scratch {
+	int divs;
+	Rect trim;
+	float w;
+	float h;
+	Point** blocks;
+	int* blocki;
+	int* blockn;
+};
+
+/* The hot kernels, each built for one instruction set level of cpu.h. */
+struct Kernels {
+	int level;
+	int32_t (*slabx)(const Rect* rect, int8_t* ids, int32_t* ranks, float* xs, int n, Point* out, int count);  // findHitsUxV
+	int32_t (*slaby)(const Rect* rect, int8_t* ids, int32_t* ranks, float* ys, int n, Point* out, int count);  // findHitsUyV
+	int32_t (*scan)(const Rect* rect, int8_t* ids, int32_t* ranks, float* xs, float* ys, int n, Point* out, int count);  // findHitsSV
+	int32_t (*quant)(const Rect* rect, const Rect* qrect, int8_t* ids, int32_t* ranks, float* xs, float* ys, int32_t* pos, uint16_t* qxs, uint16_t* qys, int n, Point* out, int count);  // findHitsSQ
+	int32_t (*merge)(const Rect* rect, int b, Point** blocks, int* blocki, int* blockn, Point* out, int count);  // findHitsB
+	int (*bound)(float* p, bool minOrMax, float v, int imin, int imax);  // bvalsearch
+};
+
+/* Called by the worker that answered a search_async query, with the number of points copied to its buffer, or
+ASYNC_CANCELLED if the context was destroyed before the query ran. */
+typedef void (__stdcall* T_done)(void* user, int32_t hits);
+
+#define ASYNC_CANCELLED -1
+#define ASYNC_REJECTED -2  // reported by the awaitable in async.h when search_async turns a query away
+
+struct AsyncQuery {
+	int64_t ticket;
+	Rect rect;
+	int32_t count;
+	Point* out;
+	T_done done;
+	void* user;
+	bool cancelled;  // skipped when a worker reaches it
+};
+
+struct AsyncPool;
+
+struct AsyncWorker {
+	AsyncPool* pool;
+	Thread thread;
+	int64_t ticket;  // query being answered, 0 if idle
+	bool cancelled;  // that query was cancelled, so drop its result
+	Point* buf;      // the query's result until it's known not to be cancelled
+	int bufn;
+};
+
+/* Worker threads answering search_async queries, and the queries waiting for them in a ring. Everything is guarded by
+"lock". */
+struct AsyncPool {
+	SearchContext* sc;
+	ThreadLock lock;
+	ThreadCond work;
+	AsyncWorker* workers;
+	int nworkers;
+	AsyncQuery* queue;
+	int capacity;
+	int head;
+	int n;         // queries in the ring, cancelled ones included
+	int64_t next;  // last ticket handed out
+	bool stop;
+};
+
+struct StealBatch;
+
+/* One search_parallel worker, with its own scratch and node. "range" packs the next of the chunks it still has to run in the low
+half and the end of them in the high half, so the worker taking chunks from the front and a thief taking the back half
+swap the same word and can't both get a chunk. Padded so no two workers' ranges share a cache line. */
+struct StealWorker {
+	uint64_t range;
+	StealBatch* batch;
+	Scratch* s;
+	Thread thread;
+	int32_t total;   // points copied
+	int32_t chunks;  // chunks run, stolen ones included
+	int32_t steals;
+	int32_t node;    // NUMA node the worker is pinned to, searching the replica there, or -1 to stay put
+	char pad[128 - sizeof(uint64_t) - 2 * sizeof(void*) - sizeof(Thread) - 4 * sizeof(int32_t)];
+};
 
+/* A search_parallel call: its queries in hilbert order, cut into chunks of STEALCHUNK. */
+struct StealBatch {
+	SearchContext* sc;
+	const Rect* rects;
+	const BatchKey* keys;
+	int nrects;
+	int32_t count;
+	Point* out_points;
+	int32_t* out_counts;
+	StealWorker* workers;
+	int nworkers;
+};
+
+/* Layout of an index published to shared memory. Every pointer is an offset from the start of the segment, 0 for
+NULL, so each process can map it wherever it lands. */
+struct SharedPoints {
+	int32_t n;
+	int64_t id, rank, x, y, qx, qy, pos;
+};
+
+struct SharedRegion {
+	Rect box;
 	float subw, subh;
+	int32_t n;
+	int32_t child[6];  // left, right, lrmid, bottom, top, btmid as indexes into the region array, -1 for none
+	int64_t crect;
+	SharedPoints points;
+	IdMask ids;
+};
+
+#define SHAREDLEVELS 16
+
+struct SharedHeader {
+	uint64_t magic;  // SHAREDMAGIC with the build flags that change the layout
+	int64_t bytes;
+	int32_t N, divs, maxdepth, nodesize, leafsize, maxleaf;
+	Rect bounds;
+	Point outliers[4];
+	int32_t noutliers;
+	double area, dx, dy;
+	int32_t idstart[257];
+	SharedPoints xpoints, ypoints, rankpoints, idpoints, hpoints;
+	int64_t hlevels[SHAREDLEVELS];
+	int32_t hlevelN[SHAREDLEVELS];
+	int32_t nhlevels;
+	int64_t gridx, gridy, gridsum, grect, drect, dlen, dids;  // divs x divs tables stored row after row
+	int64_t cells;  // offset of each grid cell's points
+	int64_t regions;
+	int32_t nregions;
+	int32_t root;
+};
+
+/* The segment holding the version number of what is published under a name. */
+struct SharedControl {
+	uint64_t magic;
+	uint32_t version;
+};
+
+/* A context's link to shared memory: the name it publishes under, or the segment it is attached to. An attached
+context's index lives in "data", apart from the node headers and grid tables that hold pointers, which it keeps in its
+own memory. */
+struct SharedIndex {
+	char name[SHMNAME];
+	SharedMemory control;
+	SharedMemory data;  // the published segment
+	uint32_t version;
+	bool attached;
+	Region* regions;
+	Points* points;
+	Point** cells;
+};
+
+struct BuildParams {
+	int32_t divs;
+	int32_t maxdepth;
+	int32_t nodesize;
+	int32_t leafsize;
+	int32_t maxleaf;
+	int64_t budget;
+	int64_t estimate;
+	int64_t bytes;
 };
 
 struct GumpSearchContext {
 	int32_t N;
 
+	// Build parameters
+	int divs;
+	int maxdepth;
+	int nodesize;
+	int leafsize;
+	int maxleaf;
+
 	// Binary search
 	Point* xsort;
 	Point* ysort;
 	Points* xpoints;
 	Points* ypoints;
 
+	// Hilbert search
+	Points* hpoints;
+	HBlock** hlevels;
+	int* hlevelN;
+	int nhlevels;
+
 	// Region search
 	Point* ranksort;
+	Points* rankpoints;
 	Region* root;
-	Rect* trim;
+
+	// Id search
+	Points* idpoints;        // the points grouped by id, in rank order within each id. The id is implied
+	int32_t idstart[257];    // where the points of each (uint8_t)id start in idpoints
 
 	// Grid search
 	Point* gridsort;
@@ -55,21 +300,144 @@ struct GumpSearchContext {
 	Rect** grect;
 	Rect** drect;
 	int** dlen;
-	Rect* bounds;
+	IdMask** dids;     // ids in each cell
+	Rect* bounds;      // the second lowest and highest x and y, to keep one outlier from stretching the grid
+	Point outliers[4]; // points beyond the bounds in rank order
+	int noutliers;
 	double area;
 	double dx, dy;
+	float* gridx;      // upper x edge of each column as stored, the last unbounded
+	float* gridy;      // upper y edge of each row
+	int32_t* gridsum;  // points owned by the cells below and left of each grid corner, (divs+1) x (divs+1)
 
-	// Current search
-	Point** blocks;
-	int* blocki;
-	int* blockn;
-	float w;
-	float h;
+	// Kernels
+	const Kernels* kernels;  // built for the highest level the CPU has, or GUMPTIONAIRE_CPU
+
+	// Memory
+	Arena* arena;  // grid cells and region node arrays
+	bool huge;     // large arrays on 2MB pages
+
+	// Instrumentation
+	QueryCounters counters;
+	TraceWriter* tracer;
+	ThreadLock tracelock;  // held by each append, so threads searching at once take turns
+
+	// Async search
+	AsyncPool* pool;  // started by start_async or the first search_async
+
+	// Shared memory
+	SharedIndex* shared;  // set by publish_shared and attach_shared
+
+	// NUMA replicas, only set on the context create_numa returns
+	GumpSearchContext** replicas;  // copy of the index built on each node, NULL for nodes without CPUs
+	int nreplicas;
+	NumaTopology* topology;
+
+	// Build
+	Scratch* scratch;
 };
 
-SearchContext* __stdcall DLL_API create(const Point* points_begin, const Point* points_end);
-int32_t __stdcall DLL_API search(SearchContext* sc, const Rect rect, const int32_t count, Point* out_points);
-SearchContext* __stdcall DLL_API destroy(SearchContext* sc);
+/* Environment read by create and create_ex: GUMPTIONAIRE_TRACE=path records a trace of every search (see trace, in builds
+with TRACE), GUMPTIONAIRE_HUGEPAGES=0 keeps the index on normal pages instead of 2MB pages, and GUMPTIONAIRE_CPU=base, sse4.2 or avx2
+uses kernels built for that instruction set level instead of the highest the CPU has. */
+SearchContext* __stdcall DLL_API GUMPTIONAIRE(create)(const Point* points_begin, const Point* points_end);
+int32_t __stdcall DLL_API GUMPTIONAIRE(search)(SearchContext* sc, const Rect rect, const int32_t count, Point* out_points);
+SearchContext* __stdcall DLL_API GUMPTIONAIRE(destroy)(SearchContext* sc);
+
+/* Run "nrects" searches, visiting the rects in hilbert order of their centers so consecutive queries touch nearby grid
+cells and region nodes. Results for rects[i] are written to out_points[i*count] with their length in out_counts[i].
+Return the total number of points copied. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(search_batch)(SearchContext* sc, const Rect* rects, const int32_t nrects, const int32_t count, Point* out_points, int32_t* out_counts);
+
+/* Like search_batch, but run the searches on "nthreads" threads (one per CPU if 0), the calling thread among them. Each
+thread starts on its own stretch of the hilbert order and, when that runs out, takes half of what the busiest thread
+has left, so a few slow queries don't leave the other threads idle. On a context from create_numa the threads started
+are pinned to the nodes in turn, each searching its node's copy. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(search_parallel)(SearchContext* sc, const Rect* rects, const int32_t nrects, const int32_t count, Point* out_points, int32_t* out_counts, const int32_t nthreads);
+
+/* Search for the "count" points with the smallest ranks inside any of the "nrects" rects, and copy them ordered by
+smallest rank first to "out_points". A point inside several of the rects is copied once. Return the number copied. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(search_union)(SearchContext* sc, const Rect* rects, const int32_t nrects, const int32_t count, Point* out_points);
+
+/* Like search, but only find points whose id is in "ids". Grid cells and region nodes without any of the ids are
+skipped without looking at their points. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(search_ids)(SearchContext* sc, const Rect rect, const IdMask* ids, const int32_t count, Point* out_points);
+
+/* Called by search_below with each full buffer of points, and with the last partly full one. */
+typedef void (__stdcall* T_chunk)(void* user, const Point* points, int32_t n);
+
+/* Find every point inside "rect" with rank below "max_rank". Points are copied to "out_points", which holds
+"capacity" of them, in no particular order. If "chunk" is set, every full buffer and then the last partly full one is
+passed to chunk with "user", and the buffer reused, so there's no limit on the number found. Without it the search
+stops once the buffer is full. Return the number of points found. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(search_below)(SearchContext* sc, const Rect rect, const int32_t max_rank, Point* out_points, const int32_t capacity, T_chunk chunk, void* user);
+
+/* Queue a search for a worker thread and return at once with a ticket for it, or 0 if "capacity" queries are already
+waiting. A worker copies the result to "out_points" and then calls "done" with "user" and the number copied. Until then
+out_points and user must stay valid, unless the query is cancelled. Starts the workers with start_async's defaults if
+they aren't running yet. */
+int64_t __stdcall DLL_API GUMPTIONAIRE(search_async)(SearchContext* sc, const Rect rect, const int32_t count, Point* out_points, T_done done, void* user);
+
+/* Cancel the search_async query with "ticket". Return 1 if it's cancelled, in which case out_points won't be written
+and done won't be called, so both can be released at once. Return 0 if it's too late, because done has been or is
+about to be called. A cancelled query that is already running still finishes, but in the worker's own buffer. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(cancel_async)(SearchContext* sc, const int64_t ticket);
+
+/* Start "nthreads" workers for search_async (one per CPU if 0), taking at most "capacity" waiting queries (ASYNCQUEUE
+if 0). Return -1 if the workers were already started or a thread couldn't be created, as on Windows for now (see
+threads.h), where search_async then turns every query away. destroy stops the workers once the queries they are running
+are done, and calls done with ASYNC_CANCELLED for those still waiting. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(start_async)(SearchContext* sc, const int32_t nthreads, const int32_t capacity);
+
+/* Copy the index into a shared memory segment named after "name" and a new version number, then tell the processes
+waiting on name that it's the current version. Other processes search it with attach_shared, all of them reading the
+same memory. Return the version, or -1 if the segment couldn't be created, as on Windows for now (see shm.h). The
+segment of the version before is removed, and the processes still attached to it keep it until they detach. Only one
+process should publish under a name. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(publish_shared)(SearchContext* sc, const char* name);
+
+/* Attach read-only to the current version published under "name", and return a context that can be searched like any
+other. destroy detaches it. Return NULL if nothing is published under name. */
+SearchContext* __stdcall DLL_API GUMPTIONAIRE(attach_shared)(const char* name);
+
+/* Block until a version newer than the one "sc" is attached to is published, or "timeout_ms" milliseconds pass (no
+limit if negative). Return the newest version, which a process attaches to before destroying its old context, or 0 if
+there's none newer yet. Can return 0 early, so check again. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(wait_shared)(SearchContext* sc, const int32_t timeout_ms);
+
+/* Remove the names of what is published under "name", so nothing new can attach. Processes attached keep searching
+their version until they detach. */
+void __stdcall DLL_API GUMPTIONAIRE(unpublish_shared)(const char* name);
+
+/* Return the number of points inside "rect", or whether there are any. Cells strictly inside rect are counted from
+prefix sums over the grid, so the cost depends on the cells cut by the edges of rect, not on how many points it holds. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(count)(SearchContext* sc, const Rect rect);
+int32_t __stdcall DLL_API GUMPTIONAIRE(exists)(SearchContext* sc, const Rect rect);
+
+/* Fill "out" with the bytes allocated, node counts, leaf fill, empty cells and duplicated points of each structure in
+the context. Return the total number of bytes. */
+int64_t __stdcall DLL_API GUMPTIONAIRE(stats)(SearchContext* sc, IndexStats* out);
+
+/* Like create, but choose the grid resolution, region depth and region list lengths so the context fits in "budget"
+bytes, preferring the sizes with the lowest query latency. The sizes chosen, the estimated footprint and the bytes
+actually allocated are written to "chosen" (if not NULL). Return NULL if not even the smallest index fits. */
+SearchContext* __stdcall DLL_API GUMPTIONAIRE(create_ex)(const Point* points_begin, const Point* points_end, const int64_t budget, BuildParams* chosen);
+
+/* Like create, but build one copy of the index on each NUMA node, each from a thread pinned to that node, and answer
+every search from the copy on the searching thread's node. Costs one index per node. stats and counters add up all of
+the copies. With a single node, or where the topology can't be read (see numa.h), this is create. */
+SearchContext* __stdcall DLL_API GUMPTIONAIRE(create_numa)(const Point* points_begin, const Point* points_end);
+
+/* Copy the per-path query counts, points examined and latency histograms recorded since create (or the last reset)
+into "out", then clear them if "reset" is non-zero. Return -1 if the library was built without INSTRUMENT, which is
+off unless compiled with -DINSTRUMENT=1. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(counters)(SearchContext* sc, QueryCounters* out, const int32_t reset);
+
+/* Start appending a TraceRecord for every search on this context to the file at "path", replacing any trace already
+being recorded, or stop recording if "path" is NULL. Return -1 if the file can't be created or the library was built
+without TRACE, which is off unless compiled with -DTRACE=1. Searches on several threads at once, search_async and search_parallel workers among them, take turns
+appending, so their records are interleaved in the order they finished. */
+int32_t __stdcall DLL_API GUMPTIONAIRE(trace)(SearchContext* sc, const char* path);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,111 @@
+#ifndef HUGEPAGES_H
+#define HUGEPAGES_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/* Allocation for large, read-mostly index arrays. Allocations of at least HUGEMIN bytes are mapped on their own and,
+if "huge" is set, backed by 2MB pages where the system allows it, so random probes into them take fewer TLB misses:
+explicit hugetlbfs pages first (only there if some were reserved), then transparent huge pages through madvise. On
+Windows large pages need the lock pages in memory privilege, and without it normal pages are used. Smaller allocations
+come from calloc. Memory is zeroed, and is released by hugeFree with the same byte count. */
+
+#define HUGEPAGE (2 << 20)
+#define HUGEMIN (1 << 20)      // smaller allocations aren't worth a mapping of their own
+#define ARENACHUNK (4 << 20)   // smallest block an arena maps at once
+
+inline int64_t hugeRound(int64_t bytes) {
+	return (bytes + HUGEPAGE - 1) & ~(int64_t)(HUGEPAGE - 1);
+}
+
+inline void* hugeAlloc(int64_t bytes, bool huge) {
+	if (bytes < HUGEMIN) return calloc(bytes > 0 ? bytes : 1, 1);
+	int64_t len = hugeRound(bytes);
+
+#ifdef _WIN32
+	void* p = NULL;
+	SIZE_T large = GetLargePageMinimum();
+	if (huge && large && len % large == 0) p = VirtualAlloc(NULL, len, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+	if (!p) p = VirtualAlloc(NULL, len, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	return p;
+#else
+#ifdef MAP_HUGETLB
+	if (huge) {
+		void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) return p;
+	}
+#endif
+
+	// map a page more than needed and trim it, so the mapping starts on a 2MB boundary the kernel can back with one page
+	char* m = (char*)mmap(NULL, len + HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) return NULL;
+	char* p = (char*)(((uintptr_t)m + HUGEPAGE - 1) & ~(uintptr_t)(HUGEPAGE - 1));
+	if (p > m) munmap(m, p - m);
+	if (m + HUGEPAGE > p) munmap(p + len, m + HUGEPAGE - p);
+#ifdef MADV_HUGEPAGE
+	if (huge) madvise(p, len, MADV_HUGEPAGE);
+#endif
+	return p;
+#endif
+}
+
+inline void hugeFree(void* p, int64_t bytes) {
+	if (!p) return;
+	if (bytes < HUGEMIN) {
+		free(p);
+		return;
+	}
+#ifdef _WIN32
+	VirtualFree(p, 0, MEM_RELEASE);
+#else
+	munmap(p, hugeRound(bytes));
+#endif
+}
+
+/* Bump allocator for the many small arrays of one index (grid cells, region nodes), so they share huge pages instead
+of each taking a malloc block. Everything in an arena is released at once by arenaFree. */
+struct Arena {
+	char* base;
+	int64_t used;
+	int64_t size;
+	Arena* next;
+};
+
+inline void* arenaAlloc(Arena** arena, int64_t bytes, bool huge) {
+	bytes = (bytes + 63) & ~(int64_t)63;
+	Arena* a = *arena;
+	if (!a || a->used + bytes > a->size) {
+		a = (Arena*)malloc(sizeof(Arena));
+		a->size = bytes > ARENACHUNK ? hugeRound(bytes) : ARENACHUNK;
+		a->base = (char*)hugeAlloc(a->size, huge);
+		a->used = 0;
+		a->next = *arena;
+		*arena = a;
+	}
+	void* p = a->base + a->used;
+	a->used += bytes;
+	return p;
+}
+
+inline void arenaFree(Arena* arena) {
+	while (arena) {
+		Arena* next = arena->next;
+		hugeFree(arena->base, arena->size);
+		free(arena);
+		arena = next;
+	}
+}
+
+// bytes mapped by the arena but not handed out
+inline int64_t arenaUnused(Arena* arena) {
+	int64_t bytes = 0;
+	for (; arena; arena = arena->next) bytes += sizeof(Arena) + arena->size - arena->used;
+	return bytes;
+}
+
+#endif
@@ -0,0 +1,395 @@
+// inspect - build a gumptionaire index over a dataset and show where its memory and query time go.
+//
+// usage: inspect [options] <dataset>
+//   -tTRACE                  run the rects of a recorded trace instead of generated queries
+//   -nQUERIES                number of generated queries (default 100000)
+//   -cCOUNT                  count for generated queries (default 20)
+//   -sSLOWEST                number of slowest queries to list (default 20)
+//   -hDIVS                   heat map resolution (default 32)
+//   -qLX,LY,HX,HY[,COUNT]    print the brute-force answer for one rect and compare it with search
+//   -v                       check every query against brute force (slow)
+//
+// <dataset> is a packed Point file or KIND:N[:SEED] (uniform, clustered, duplicates). Links directly against
+// gumptionaire so it can walk the grid and region tree; paths and fallbacks come from the counters() export, so build
+// the library with -DINSTRUMENT=1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tools.h"
+#include "trace.h"
+#include "gumptionaire.h"
+
+#define MAXDEPTHS 32
+#define OCCBUCKETS 24
+
+const char* pathNames[NPATHS] = {"empty", "region", "xslab", "yslab", "gridone", "gridmerge"};
+
+struct DepthStats {
+	int64_t nodes;
+	int64_t leaves;
+	int64_t empty;
+	int64_t points;
+	int64_t maxn;
+};
+
+struct QueryResult {
+	Rect rect;
+	int32_t count;
+	int32_t hits;
+	int path;
+	bool fallback;
+	int64_t examined;
+	double ns;
+};
+
+// PRINTING ---------------------------------------------------------------------------------------
+
+void printStruct(const char* name, StructStats* s) {
+	if (s->bytes == 0) return;
+	printf("  %-8s %10.1f MB  %9lld nodes  %9lld leaves  avg fill %8.1f  max fill %7lld  empty %7lld  duplicates %9lld\n",
+		name, s->bytes / 1048576.0, (long long)s->nodes, (long long)s->leaves, s->avgfill, (long long)s->maxfill,
+		(long long)s->empty, (long long)s->duplicates
+	);
+}
+
+// print a divs x divs map of values in [0, 1] as digits 0-9, top row first, with ' ' for cells with no data
+void printHeat(double* v, bool* has, int divs) {
+	for (int j = divs - 1; j >= 0; j--) {
+		printf("  |");
+		for (int i = 0; i < divs; i++) {
+			int c = i * divs + j;
+			if (!has[c]) { printf(" "); continue; }
+			int d = (int)(v[c] * 10);
+			printf("%c", '0' + (d > 9 ? 9 : (d < 0 ? 0 : d)));
+		}
+		printf("|\n");
+	}
+}
+
+void printAnswer(Point* points, int n) {
+	for (int i = 0; i < n; i++) printf("    %10d %4d %12.6f %12.6f\n", points[i].rank, points[i].id, points[i].x, points[i].y);
+}
+
+// GRID -------------------------------------------------------------------------------------------
+
+void inspectGrid(GumpSearchContext* gsc, int heatdivs) {
+	int64_t hist[OCCBUCKETS] = {0};
+	int64_t cells = (int64_t)gsc->divs * gsc->divs;
+	int64_t maxlen = 0;
+	double* heat = (double*)calloc(heatdivs * heatdivs, sizeof(double));
+	bool* has = (bool*)calloc(heatdivs * heatdivs, sizeof(bool));
+
+	for (int i = 0; i < gsc->divs; i++) {
+		for (int j = 0; j < gsc->divs; j++) {
+			int len = gsc->dlen[i][j];
+			int b = 0;
+			while (b < OCCBUCKETS - 1 && (1 << b) <= len) b++;
+			hist[b]++;
+			if (len > maxlen) maxlen = len;
+
+			int c = (int)((int64_t)i * heatdivs / gsc->divs) * heatdivs + (int)((int64_t)j * heatdivs / gsc->divs);
+			heat[c] += len;
+			has[c] = true;
+		}
+	}
+
+	printf("\nGrid: %d x %d cells, most points in a cell %lld\n", gsc->divs, gsc->divs, (long long)maxlen);
+	printf("  %-16s %9s %7s\n", "points in cell", "cells", "share");
+	for (int b = 0; b < OCCBUCKETS; b++) {
+		if (hist[b] == 0) continue;
+		if (b == 0) printf("  %-16s", "0");
+		else printf("  %7d - %-6d", 1 << (b - 1), (1 << b) - 1);
+		printf(" %9lld %6.2f%%\n", (long long)hist[b], 100.0 * hist[b] / cells);
+	}
+
+	double maxheat = 0;
+	for (int c = 0; c < heatdivs * heatdivs; c++) if (heat[c] > maxheat) maxheat = heat[c];
+	for (int c = 0; c < heatdivs * heatdivs; c++) heat[c] = maxheat > 0 ? heat[c] / maxheat : 0;
+	printf("\nPoint density (9 = densest cell):\n");
+	printHeat(heat, has, heatdivs);
+	free(heat);
+	free(has);
+}
+
+// REGION TREE ------------------------------------------------------------------------------------
+
+// walk each node of the region DAG once, following the same ownership as freeRegion
+void walkRegion(Region* region, bool left, bool lrmid, bool right, bool bottom, bool btmid, bool top, int depth, DepthStats* d) {
+	if (left   && region->left)   walkRegion(region->left,   true,  true,  true,  true,  true, true,  depth+1, d);
+	if (right  && region->right)  walkRegion(region->right,  true,  true,  true,  true,  true, true,  depth+1, d);
+	if (lrmid  && region->lrmid)  walkRegion(region->lrmid,  false, true,  false, true,  true, true,  depth+1, d);
+	if (bottom && region->bottom) walkRegion(region->bottom, false, false, false, true,  true, true,  depth+1, d);
+	if (top    && region->top)    walkRegion(region->top,    false, false, false, true,  true, true,  depth+1, d);
+	if (btmid  && region->btmid)  walkRegion(region->btmid,  false, false, false, false, true, false, depth+1, d);
+
+	if (depth >= MAXDEPTHS) depth = MAXDEPTHS - 1;
+	int n = region->rankpoints->n;
+	d[depth].nodes++;
+	if (region->left == NULL) d[depth].leaves++;
+	if (n == 0) d[depth].empty++;
+	d[depth].points += n;
+	if (n > d[depth].maxn) d[depth].maxn = n;
+}
+
+void inspectRegions(GumpSearchContext* gsc) {
+	if (!gsc->root) {
+		printf("\nRegion tree: none\n");
+		return;
+	}
+
+	DepthStats d[MAXDEPTHS];
+	memset(d, 0, sizeof(d));
+	walkRegion(gsc->root, true, true, true, true, true, true, 0, d);
+
+	printf("\nRegion tree: depth %d, lists of %d per node and %d per leaf\n", gsc->maxdepth, gsc->nodesize, gsc->leafsize);
+	printf("  %5s %9s %9s %9s %9s %9s\n", "depth", "nodes", "leaves", "empty", "avg fill", "max fill");
+	for (int i = 0; i < MAXDEPTHS; i++) {
+		if (d[i].nodes == 0) continue;
+		printf("  %5d %9lld %9lld %9lld %9.1f %9lld\n", i, (long long)d[i].nodes, (long long)d[i].leaves,
+			(long long)d[i].empty, (double)d[i].points / d[i].nodes, (long long)d[i].maxn
+		);
+	}
+}
+
+// QUERIES ----------------------------------------------------------------------------------------
+
+void runQueries(SearchContext* sc, QueryResult* q, int64_t n, Point* out, bool instrumented) {
+	QueryCounters c;
+	if (instrumented) counters(sc, &c, 1);
+	for (int64_t i = 0; i < n; i++) {
+		double t = nowNs();
+		q[i].hits = search(sc, q[i].rect, q[i].count, out);
+		q[i].ns = nowNs() - t;
+		q[i].path = -1;
+		q[i].fallback = false;
+		q[i].examined = 0;
+		if (!instrumented) continue;
+
+		counters(sc, &c, 1);
+		for (int p = 0; p < NPATHS; p++) {
+			if (c.path[p].queries == 0) continue;
+			q[i].path = p;
+			q[i].examined = c.path[p].examined;
+		}
+		q[i].fallback = c.fallbacks > 0;
+	}
+}
+
+void inspectPaths(QueryResult* q, int64_t n) {
+	int64_t queries[NPATHS] = {0}, examined[NPATHS] = {0};
+	double ns[NPATHS] = {0};
+	int64_t fallbacks = 0;
+	for (int64_t i = 0; i < n; i++) {
+		if (q[i].fallback) fallbacks++;
+		if (q[i].path < 0) continue;
+		queries[q[i].path]++;
+		examined[q[i].path] += q[i].examined;
+		ns[q[i].path] += q[i].ns;
+	}
+
+	printf("\nPaths: %lld queries, %lld region fallbacks (%.2f%%)\n", (long long)n, (long long)fallbacks, n > 0 ? 100.0 * fallbacks / n : 0);
+	printf("  %-10s %9s %7s %9s %12s\n", "path", "queries", "share", "avg ns", "avg examined");
+	for (int p = 0; p < NPATHS; p++) {
+		if (queries[p] == 0) continue;
+		printf("  %-10s %9lld %6.2f%% %9.0f %12.1f\n", pathNames[p], (long long)queries[p], 100.0 * queries[p] / n,
+			ns[p] / queries[p], (double)examined[p] / queries[p]
+		);
+	}
+}
+
+void inspectFallbacks(QueryResult* q, int64_t n, Rect* bounds, int heatdivs) {
+	int64_t* tried = (int64_t*)calloc(heatdivs * heatdivs, sizeof(int64_t));
+	int64_t* failed = (int64_t*)calloc(heatdivs * heatdivs, sizeof(int64_t));
+	double* rate = (double*)calloc(heatdivs * heatdivs, sizeof(double));
+	bool* has = (bool*)calloc(heatdivs * heatdivs, sizeof(bool));
+
+	// only queries that went to the region tree can fall back
+	for (int64_t k = 0; k < n; k++) {
+		if (q[k].path != PATH_REGION && !q[k].fallback) continue;
+		double cx = ((double)q[k].rect.lx + q[k].rect.hx) / 2;
+		double cy = ((double)q[k].rect.ly + q[k].rect.hy) / 2;
+		int i = (int)((cx - bounds->lx) / (bounds->hx - bounds->lx) * heatdivs);
+		int j = (int)((cy - bounds->ly) / (bounds->hy - bounds->ly) * heatdivs);
+		i = i < 0 ? 0 : (i >= heatdivs ? heatdivs - 1 : i);
+		j = j < 0 ? 0 : (j >= heatdivs ? heatdivs - 1 : j);
+		tried[i * heatdivs + j]++;
+		if (q[k].fallback) failed[i * heatdivs + j]++;
+	}
+	for (int c = 0; c < heatdivs * heatdivs; c++) {
+		has[c] = tried[c] > 0;
+		rate[c] = has[c] ? (double)failed[c] / tried[c] : 0;
+	}
+
+	printf("\nRegion fallback rate by query center (0 = none failed, 9 = 90%% or more failed):\n");
+	printHeat(rate, has, heatdivs);
+	free(tried);
+	free(failed);
+	free(rate);
+	free(has);
+}
+
+void inspectSlowest(QueryResult* q, int64_t n, int slowest) {
+	int64_t* order = (int64_t*)malloc((n > 0 ? n : 1) * sizeof(int64_t));
+	for (int64_t i = 0; i < n; i++) order[i] = i;
+	#define slower(a,b) (q[*(a)].ns > q[*(b)].ns)
+	QSORT(int64_t, order, n, slower);
+
+	printf("\nSlowest %d queries:\n", slowest);
+	printf("  %10s %12s %12s %12s %12s %6s %6s %-10s %4s %9s\n", "ns", "lx", "ly", "hx", "hy", "count", "hits", "path", "fell", "examined");
+	for (int k = 0; k < slowest && k < n; k++) {
+		QueryResult* r = &q[order[k]];
+		printf("  %10.0f %12.6f %12.6f %12.6f %12.6f %6d %6d %-10s %4s %9lld\n", r->ns, r->rect.lx, r->rect.ly, r->rect.hx,
+			r->rect.hy, r->count, r->hits, r->path >= 0 ? pathNames[r->path] : "?", r->fallback ? "yes" : "", (long long)r->examined
+		);
+	}
+	free(order);
+}
+
+int64_t verifyQueries(SearchContext* sc, Point* points, int64_t N, QueryResult* q, int64_t n, Point* out, Point* ref) {
+	int64_t bad = 0;
+	for (int64_t i = 0; i < n; i++) {
+		int32_t hits = search(sc, q[i].rect, q[i].count, out);
+		int32_t refhits = bruteForce(points, N, &q[i].rect, q[i].count, ref);
+		bool ok = hits == refhits;
+		for (int k = 0; ok && k < hits; k++) ok = out[k].rank == ref[k].rank;
+		if (ok) continue;
+		if (bad++ < 10) printf("  mismatch: rect %f %f %f %f count %d, search %d hits, brute force %d\n",
+			q[i].rect.lx, q[i].rect.ly, q[i].rect.hx, q[i].rect.hy, q[i].count, hits, refhits
+		);
+	}
+	return bad;
+}
+
+int main(int argc, char** argv) {
+	const char* tracepath = NULL;
+	const char* dataset = NULL;
+	int64_t nqueries = 100000;
+	int count = 20, slowest = 20, heatdivs = 32;
+	bool verify = false, single = false;
+	Rect qrect;
+	int qcount = 20;
+
+	for (int i = 1; i < argc; i++) {
+		char* a = argv[i];
+		if (a[0] != '-') { dataset = a; continue; }
+		switch (a[1]) {
+			case 't': tracepath = &a[2]; break;
+			case 'n': nqueries = strtoll(&a[2], NULL, 10); break;
+			case 'c': count = atoi(&a[2]); break;
+			case 's': slowest = atoi(&a[2]); break;
+			case 'h': heatdivs = atoi(&a[2]); break;
+			case 'v': verify = true; break;
+			case 'q':
+				single = sscanf(&a[2], "%f,%f,%f,%f,%d", &qrect.lx, &qrect.ly, &qrect.hx, &qrect.hy, &qcount) >= 4;
+				break;
+		}
+	}
+	if (!dataset || heatdivs < 1 || count < 1) {
+		printf("usage: inspect [-tTRACE] [-nQUERIES] [-cCOUNT] [-sSLOWEST] [-hDIVS] [-qLX,LY,HX,HY[,COUNT]] [-v] <dataset>\n");
+		return 1;
+	}
+
+	int64_t N;
+	Point* points = loadDataset(dataset, &N);
+	if (!points) {
+		printf("Can't read dataset %s\n", dataset);
+		return 1;
+	}
+	Rect bounds;
+	pointBounds(points, N, &bounds);
+
+	double t = nowNs();
+	SearchContext* sc = create(points, points + N);
+	double buildms = (nowNs() - t) / 1e6;
+	GumpSearchContext* gsc = (GumpSearchContext*)sc;
+
+	IndexStats st;
+	stats(sc, &st);
+	printf("%lld points, bounds %f %f %f %f, built in %.0f ms, %.1f MB\n", (long long)N, bounds.lx, bounds.ly, bounds.hx,
+		bounds.hy, buildms, st.bytes / 1048576.0
+	);
+	printStruct("regions", &st.regions);
+	printStruct("grid", &st.grid);
+	printStruct("sorted", &st.sorted);
+	printStruct("hilbert", &st.hilbert);
+	printStruct("scratch", &st.scratch);
+	if (N == 0) return 0;
+
+	inspectGrid(gsc, heatdivs);
+	inspectRegions(gsc);
+
+	// queries come from the trace if given, otherwise generated
+	QueryResult* q;
+	int64_t n;
+	int maxcount = count > qcount ? count : qcount;
+	if (tracepath) {
+		TraceHeader header;
+		TraceRecord* records = traceLoad(tracepath, &header, &n);
+		if (!records) {
+			printf("Can't read trace %s\n", tracepath);
+			return 1;
+		}
+		q = (QueryResult*)calloc(n > 0 ? n : 1, sizeof(QueryResult));
+		for (int64_t i = 0; i < n; i++) {
+			q[i].rect = records[i].rect;
+			q[i].count = records[i].count;
+			if (q[i].count > maxcount) maxcount = q[i].count;
+		}
+		free(records);
+	} else {
+		n = nqueries;
+		Rect* rects = generateQueries(n, &bounds, 1);
+		q = (QueryResult*)calloc(n > 0 ? n : 1, sizeof(QueryResult));
+		for (int64_t i = 0; i < n; i++) {
+			q[i].rect = rects[i];
+			q[i].count = count;
+		}
+		free(rects);
+	}
+
+	Point* out = (Point*)malloc(maxcount * sizeof(Point));
+	Point* ref = (Point*)malloc(maxcount * sizeof(Point));
+	QueryCounters c;
+	bool instrumented = counters(sc, &c, 1) == 0;
+	if (!instrumented) printf("\nLibrary built without INSTRUMENT, paths and fallbacks are not available\n");
+
+	runQueries(sc, q, n, out, instrumented);
+	if (instrumented) {
+		inspectPaths(q, n);
+		inspectFallbacks(q, n, &bounds, heatdivs);
+	}
+	inspectSlowest(q, n, slowest);
+
+	if (verify) {
+		printf("\nChecking %lld queries against brute force\n", (long long)n);
+		int64_t bad = verifyQueries(sc, points, N, q, n, out, ref);
+		printf("  %lld mismatches\n", (long long)bad);
+	}
+
+	if (single) {
+		Point* sout = (Point*)malloc(qcount * sizeof(Point));
+		Point* sref = (Point*)malloc(qcount * sizeof(Point));
+		int32_t hits = search(sc, qrect, qcount, sout);
+		int32_t refhits = bruteForce(points, N, &qrect, qcount, sref);
+		bool ok = hits == refhits;
+		for (int k = 0; ok && k < hits; k++) ok = sout[k].rank == sref[k].rank;
+		printf("\nBrute force answer for %f %f %f %f, count %d (search %s):\n", qrect.lx, qrect.ly, qrect.hx, qrect.hy,
+			qcount, ok ? "matches" : "DIFFERS"
+		);
+		printAnswer(sref, refhits);
+		if (!ok) {
+			printf("  search returned:\n");
+			printAnswer(sout, hits);
+		}
+		free(sout);
+		free(sref);
+	}
+
+	destroy(sc);
+	free(out);
+	free(ref);
+	free(q);
+	free(points);
+	return 0;
+}
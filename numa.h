@@ -0,0 +1,119 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/* NUMA topology and thread placement: the node the calling thread is running on, and pinning a thread to the CPUs of
+one node so the memory it touches first is allocated there. Where the topology can't be read there is a single node
+and pinning does nothing, which for now is everywhere but Linux: the Win32 versions haven't been built yet. */
+
+#define MAXNODES 64
+
+struct NumaTopology {
+	int nnodes;
+	int ncpus;
+	int16_t* cpunode;  // node of each CPU
+};
+
+struct NumaAffinity {
+#ifdef __linux__
+	cpu_set_t mask;
+#endif
+};
+
+#ifdef __linux__
+// parse a sysfs CPU list like "0-3,8-11" into the CPUs of "node"
+inline void numaReadCpus(NumaTopology* t, int node, const char* list) {
+	const char* c = list;
+	while (*c >= '0' && *c <= '9') {
+		char* end;
+		int lo = strtol(c, &end, 10), hi = lo;
+		if (*end == '-') hi = strtol(end + 1, &end, 10);
+		for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+			if (cpu >= t->ncpus) {
+				t->cpunode = (int16_t*)realloc(t->cpunode, (cpu + 1) * sizeof(int16_t));
+				for (int i = t->ncpus; i <= cpu; i++) t->cpunode[i] = 0;
+				t->ncpus = cpu + 1;
+			}
+			t->cpunode[cpu] = node;
+		}
+		c = (*end == ',') ? end + 1 : end;
+	}
+}
+#endif
+
+inline void numaTopology(NumaTopology* t) {
+	t->nnodes = 1;
+	t->ncpus = 0;
+	t->cpunode = NULL;
+#ifdef __linux__
+	for (int node = 0; node < MAXNODES; node++) {
+		char path[64], list[4096];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE* f = fopen(path, "r");
+		if (!f) continue;
+		if (fgets(list, sizeof(list), f)) {
+			numaReadCpus(t, node, list);
+			t->nnodes = node + 1;
+		}
+		fclose(f);
+	}
+#endif
+}
+
+inline void numaFree(NumaTopology* t) {
+	free(t->cpunode);
+	t->cpunode = NULL;
+}
+
+inline int numaCurrentNode(NumaTopology* t) {
+	int node = 0;
+#ifdef __linux__
+	int cpu = sched_getcpu();
+	if (cpu >= 0 && cpu < t->ncpus) node = t->cpunode[cpu];
+#endif
+	return node < t->nnodes ? node : 0;
+}
+
+inline void numaSave(NumaAffinity* a) {
+#ifdef __linux__
+	sched_getaffinity(0, sizeof(cpu_set_t), &a->mask);
+#else
+	(void)a;
+#endif
+}
+
+inline void numaRestore(NumaAffinity* a) {
+#ifdef __linux__
+	sched_setaffinity(0, sizeof(cpu_set_t), &a->mask);
+#else
+	(void)a;
+#endif
+}
+
+// run the calling thread only on the CPUs of "node". Return false if the node has no CPUs or pinning isn't allowed
+inline bool numaPin(NumaTopology* t, int node) {
+#ifdef __linux__
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	int n = 0;
+	for (int cpu = 0; cpu < t->ncpus; cpu++) {
+		if (t->cpunode[cpu] != node) continue;
+		CPU_SET(cpu, &mask);
+		n++;
+	}
+	return n > 0 && sched_setaffinity(0, sizeof(cpu_set_t), &mask) == 0;
+#else
+	(void)t;
+	(void)node;
+	return false;
+#endif
+}
+
+#endif
@@ -6,6 +6,9 @@ dynamically. The DLL should export the following functions: "create", "search" a
 descriptions of these functions are given below. You can use any language or compiler, as long as the resulting DLL
 implements this interface. */
 
+#ifndef POINT_SEARCH_H
+#define POINT_SEARCH_H
+
 /* This standard header defines the sized types used. */
 #include <stdint.h>
 
@@ -47,3 +50,5 @@ typedef int32_t (__stdcall* T_search)(SearchContext* sc, const Rect rect, const
 
 /* Release the resources associated with the context. Return nullptr if successful, "sc" otherwise. */
 typedef SearchContext* (__stdcall* T_destroy)(SearchContext* sc);
+
+#endif
@@ -0,0 +1,139 @@
+// replay - run a recorded query trace against one or more engine builds and compare their latency distributions.
+//
+// usage: replay [-rREPEATS] <dataset> <trace> <engine.dll> [engine.dll ...]
+//
+// <dataset> is the packed Point file the trace was recorded on (or KIND:N[:SEED]), <trace> is a file written by
+// the trace() export. Each query is run REPEATS times and its fastest run is kept. Percentiles are reported overall and
+// by the path the recording engine took, with every engine after the first also shown relative to the first.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tools.h"
+#include "trace.h"
+
+#define MAXPATHS 8
+#define NPCTS 5
+
+const double pcts[NPCTS] = {0.5, 0.9, 0.99, 0.999, 1.0};
+const char* pathNames[MAXPATHS] = {"empty", "region", "xslab", "yslab", "gridone", "gridmerge", "path6", "path7"};
+
+struct Latencies {
+	int64_t n;
+	double* ns;
+	double pct[NPCTS];
+	double mean;
+};
+
+void summarize(Latencies* l) {
+	sortDoubles(l->ns, l->n);
+	l->mean = 0;
+	for (int64_t i = 0; i < l->n; i++) l->mean += l->ns[i];
+	if (l->n > 0) l->mean /= l->n;
+	for (int p = 0; p < NPCTS; p++) l->pct[p] = percentile(l->ns, l->n, pcts[p]);
+}
+
+void printLatencies(const char* label, Latencies* l, Latencies* base) {
+	printf("  %-10s %9lld  %9.0f", label, (long long)l->n, l->mean);
+	for (int p = 0; p < NPCTS; p++) printf("  %9.0f", l->pct[p]);
+	if (base && base->n > 0) {
+		printf("  |");
+		for (int p = 0; p < NPCTS; p++) printf(" %5.2fx", base->pct[p] > 0 ? l->pct[p] / base->pct[p] : 0);
+	}
+	printf("\n");
+}
+
+int main(int argc, char** argv) {
+	int repeats = 1;
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-'; arg++) {
+		if (argv[arg][1] == 'r') repeats = atoi(&argv[arg][2]);
+	}
+	if (repeats < 1) repeats = 1;
+	if (argc - arg < 3) {
+		printf("usage: replay [-rREPEATS] <dataset> <trace> <engine.dll> [engine.dll ...]\n");
+		return 1;
+	}
+
+	int64_t N;
+	Point* points = loadDataset(argv[arg], &N);
+	if (!points) {
+		printf("Can't read dataset %s\n", argv[arg]);
+		return 1;
+	}
+
+	TraceHeader header;
+	int64_t nrecords;
+	TraceRecord* records = traceLoad(argv[arg+1], &header, &nrecords);
+	if (!records) {
+		printf("Can't read trace %s\n", argv[arg+1]);
+		return 1;
+	}
+	if (header.N != N) printf("Warning: trace was recorded on %lld points, dataset has %lld\n", (long long)header.N, (long long)N);
+
+	int maxcount = 1;
+	for (int64_t i = 0; i < nrecords; i++) {
+		if (records[i].count > maxcount) maxcount = records[i].count;
+	}
+	Point* out = (Point*)malloc(maxcount * sizeof(Point));
+
+	int nengines = argc - arg - 2;
+	Latencies* all = (Latencies*)calloc(nengines * (MAXPATHS + 1), sizeof(Latencies));
+	printf("%lld points, %lld queries, %d repeats\n", (long long)N, (long long)nrecords, repeats);
+	printf("  %-10s %9s  %9s  %9s  %9s  %9s  %9s  %9s   (ns)\n", "path", "queries", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+	for (int e = 0; e < nengines; e++) {
+		Engine engine;
+		if (!loadEngine(&engine, argv[arg+2+e])) {
+			printf("Can't load engine %s\n", argv[arg+2+e]);
+			return 1;
+		}
+
+		double t = nowNs();
+		SearchContext* sc = engine.create(points, points + N);
+		double buildms = (nowNs() - t) / 1e6;
+
+		// fastest of the repeats for each query
+		double* ns = (double*)malloc((nrecords > 0 ? nrecords : 1) * sizeof(double));
+		for (int64_t i = 0; i < nrecords; i++) ns[i] = 1e300;
+		int64_t mismatches = 0;
+		for (int r = 0; r < repeats; r++) {
+			for (int64_t i = 0; i < nrecords; i++) {
+				t = nowNs();
+				int32_t hits = engine.search(sc, records[i].rect, records[i].count, out);
+				double dt = nowNs() - t;
+				if (dt < ns[i]) ns[i] = dt;
+				if (r == 0 && hits != records[i].hits) mismatches++;
+			}
+		}
+		engine.destroy(sc);
+		unloadEngine(&engine);
+
+		// split by the path the recording engine took
+		Latencies* lat = &all[e * (MAXPATHS + 1)];
+		lat[0].ns = ns;
+		lat[0].n = nrecords;
+		for (int p = 0; p < MAXPATHS; p++) lat[p+1].ns = (double*)malloc((nrecords > 0 ? nrecords : 1) * sizeof(double));
+		for (int64_t i = 0; i < nrecords; i++) {
+			int p = records[i].path;
+			if (p < 0 || p >= MAXPATHS) continue;
+			lat[p+1].ns[lat[p+1].n++] = ns[i];
+		}
+		for (int p = 0; p <= MAXPATHS; p++) summarize(&lat[p]);
+
+		Latencies* base = (e > 0) ? &all[0] : NULL;
+		printf("%s: build %.0f ms, %lld result count mismatches vs trace\n", engine.name, buildms, (long long)mismatches);
+		printLatencies("all", &lat[0], base);
+		for (int p = 0; p < MAXPATHS; p++) {
+			if (lat[p+1].n == 0) continue;
+			printLatencies(pathNames[p], &lat[p+1], base ? &base[p+1] : NULL);
+		}
+	}
+
+	for (int i = 0; i < nengines * (MAXPATHS + 1); i++) free(all[i].ns);
+	free(all);
+	free(out);
+	free(records);
+	free(points);
+	return 0;
+}
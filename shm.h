@@ -0,0 +1,127 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/* Named shared memory that other processes on the host can map: POSIX shm objects. A segment is created once at its
+full size and written, then opened read-only by everyone else. It outlives its creator until it is removed, and
+removing it only drops the name, so processes that have it mapped keep it. A 32-bit word in a segment can be waited on
+until another process changes it (with a futex on Linux, by polling elsewhere). The Win32 file mapping versions haven't
+been built yet, so on Windows segments can't be created or opened for now. */
+
+#define SHMNAME 256
+#define SHMPOLL 10   // milliseconds between looks at a waited word where there's no futex
+
+struct SharedMemory {
+	char* base;
+	int64_t bytes;
+};
+
+inline void shmName(char* out, const char* name, int64_t version) {
+	if (version > 0) snprintf(out, SHMNAME, "/%s.%lld", name, (long long)version);
+	else snprintf(out, SHMNAME, "/%s", name);
+}
+
+// a new segment of "bytes" zeroed bytes, replacing any left under the same name
+inline bool shmCreate(SharedMemory* m, const char* name, int64_t bytes) {
+	m->bytes = bytes;
+	m->base = NULL;
+#ifdef _WIN32
+	(void)name;
+	return false;
+#else
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) return false;
+	if (ftruncate(fd, bytes) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return false;
+	}
+	void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(name);
+		return false;
+	}
+	m->base = (char*)p;
+	return true;
+#endif
+}
+
+// map an existing segment, its whole length
+inline bool shmOpen(SharedMemory* m, const char* name, bool writable) {
+	m->base = NULL;
+#ifdef _WIN32
+	(void)name;
+	(void)writable;
+	return false;
+#else
+	int fd = shm_open(name, writable ? O_RDWR : O_RDONLY, 0);
+	if (fd < 0) return false;
+	struct stat st;
+	void* p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) p = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return false;
+	m->base = (char*)p;
+	m->bytes = st.st_size;
+	return true;
+#endif
+}
+
+inline void shmClose(SharedMemory* m) {
+	if (!m->base) return;
+#ifndef _WIN32
+	munmap(m->base, m->bytes);
+#endif
+	m->base = NULL;
+}
+
+inline void shmRemove(const char* name) {
+#ifdef _WIN32
+	(void)name;
+#else
+	shm_unlink(name);
+#endif
+}
+
+// wait until *word isn't "seen", or "ms" milliseconds pass (forever if negative). Return the word's value then
+inline uint32_t shmWait(uint32_t* word, uint32_t seen, int ms) {
+#if defined(__linux__)
+	struct timespec t = { ms / 1000, (long)(ms % 1000) * 1000000 };
+	if (__atomic_load_n(word, __ATOMIC_ACQUIRE) == seen) syscall(SYS_futex, word, FUTEX_WAIT, seen, ms >= 0 ? &t : NULL, NULL, 0);
+#elif !defined(_WIN32)
+	for (int waited = 0; __atomic_load_n(word, __ATOMIC_ACQUIRE) == seen && (ms < 0 || waited < ms); waited += SHMPOLL) {
+		usleep(SHMPOLL * 1000);
+	}
+#else
+	(void)seen;
+	(void)ms;
+#endif
+	return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+// set *word and wake everything waiting on it
+inline void shmPost(uint32_t* word, uint32_t value) {
+	__atomic_store_n(word, value, __ATOMIC_RELEASE);
+#if defined(__linux__)
+	syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+#endif
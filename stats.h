@@ -0,0 +1,78 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Footprint of one component of a search index. Counts that don't apply to a component are left at zero. */
+struct StructStats {
+	int64_t bytes;       // bytes allocated for the component
+	int64_t nodes;       // tree nodes, grid cells or blocks
+	int64_t leaves;      // leaf nodes, or non-empty grid cells
+	double avgfill;      // average points per leaf
+	int64_t maxfill;     // most points in a single leaf
+	int64_t empty;       // nodes or cells holding no points
+	int64_t points;      // point entries stored
+	int64_t duplicates;  // point entries beyond the first copy of each point
+};
+
+/* Memory accounting for a whole context, broken down by the structures the engines build. */
+struct IndexStats {
+	int64_t N;
+	int64_t bytes;
+	StructStats regions;  // region tree (gumption, gumptionaire) or range trees (gump)
+	StructStats grid;     // grid cells and their grect/drect/dlen tables
+	StructStats sorted;   // x/y, rank and id sorted point arrays
+	StructStats hilbert;  // hilbert blocks (gumptionaire with HILBERTSLABS)
+	StructStats scratch;  // per-search buffers and small context allocations
+};
+
+/* Set of ranks, used to count how many point entries in a structure are copies. */
+struct RankSet {
+	int32_t lo, hi;
+	uint8_t* bits;
+	int64_t distinct;
+};
+
+inline void statLeaf(StructStats* s, int64_t n) {
+	s->leaves++;
+	s->avgfill += n;
+	if (n > s->maxfill) s->maxfill = n;
+}
+
+inline void statFinish(StructStats* s) {
+	if (s->leaves > 0) s->avgfill /= s->leaves;
+}
+
+// fold "r" into "s", for indexes kept as several copies
+inline void statAdd(StructStats* s, const StructStats* r) {
+	int64_t leaves = s->leaves + r->leaves;
+	if (leaves > 0) s->avgfill = (s->avgfill * s->leaves + r->avgfill * r->leaves) / leaves;
+	s->bytes += r->bytes;
+	s->nodes += r->nodes;
+	s->leaves = leaves;
+	if (r->maxfill > s->maxfill) s->maxfill = r->maxfill;
+	s->empty += r->empty;
+	s->points += r->points;
+	s->duplicates += r->duplicates;
+}
+
+inline void rankSetWiden(RankSet* set, int32_t rank) {
+	if (rank < set->lo) set->lo = rank;
+	if (rank > set->hi) set->hi = rank;
+}
+
+inline void rankSetAlloc(RankSet* set) {
+	set->distinct = 0;
+	set->bits = (set->hi >= set->lo) ? (uint8_t*)calloc(((int64_t)set->hi - set->lo) / 8 + 1, 1) : NULL;
+}
+
+inline void rankSetAdd(RankSet* set, int32_t rank) {
+	int64_t i = (int64_t)rank - set->lo;
+	uint8_t bit = 1 << (i & 7);
+	if (set->bits[i >> 3] & bit) return;
+	set->bits[i >> 3] |= bit;
+	set->distinct++;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* The few threading primitives a worker pool needs: a lock, a condition to sleep on while there's no work, and
+starting and joining threads, on pthreads. A thread's function is declared THREADFN and returns 0. The Win32 versions
+haven't been built yet, so Windows has no threads of its own for now: threadStart fails, leaving search_async without
+workers and search_parallel on the calling thread, and the lock spins, so it still guards against threads the caller
+started. */
+
+#ifdef _WIN32
+#define THREADFN uint32_t
+typedef uint32_t (*ThreadMain)(void*);
+typedef int32_t ThreadLock;
+typedef int32_t ThreadCond;
+typedef int32_t Thread;
+#else
+#define THREADFN void*
+typedef void* (*ThreadMain)(void*);
+typedef pthread_mutex_t ThreadLock;
+typedef pthread_cond_t ThreadCond;
+typedef pthread_t Thread;
+#endif
+
+inline void lockInit(ThreadLock* l) {
+#ifdef _WIN32
+	*l = 0;
+#else
+	pthread_mutex_init(l, NULL);
+#endif
+}
+
+inline void lockFree(ThreadLock* l) {
+#ifdef _WIN32
+	(void)l;
+#else
+	pthread_mutex_destroy(l);
+#endif
+}
+
+inline void lockAcquire(ThreadLock* l) {
+#ifdef _WIN32
+	while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE)) __builtin_ia32_pause();
+#else
+	pthread_mutex_lock(l);
+#endif
+}
+
+inline void lockRelease(ThreadLock* l) {
+#ifdef _WIN32
+	__atomic_store_n(l, 0, __ATOMIC_RELEASE);
+#else
+	pthread_mutex_unlock(l);
+#endif
+}
+
+inline void condInit(ThreadCond* c) {
+#ifdef _WIN32
+	*c = 0;
+#else
+	pthread_cond_init(c, NULL);
+#endif
+}
+
+inline void condFree(ThreadCond* c) {
+#ifdef _WIN32
+	(void)c;
+#else
+	pthread_cond_destroy(c);
+#endif
+}
+
+// release l while asleep, and hold it again on waking. Wakes can be spurious, so recheck what was waited for
+inline void condWait(ThreadCond* c, ThreadLock* l) {
+#ifdef _WIN32
+	(void)c;
+	lockRelease(l);
+	__builtin_ia32_pause();
+	lockAcquire(l);
+#else
+	pthread_cond_wait(c, l);
+#endif
+}
+
+inline void condSignal(ThreadCond* c) {
+#ifdef _WIN32
+	(void)c;
+#else
+	pthread_cond_signal(c);
+#endif
+}
+
+inline void condBroadcast(ThreadCond* c) {
+#ifdef _WIN32
+	(void)c;
+#else
+	pthread_cond_broadcast(c);
+#endif
+}
+
+inline bool threadStart(Thread* t, ThreadMain fn, void* arg) {
+#ifdef _WIN32
+	(void)t;
+	(void)fn;
+	(void)arg;
+	return false;
+#else
+	return pthread_create(t, NULL, fn, arg) == 0;
+#endif
+}
+
+inline void threadJoin(Thread t) {
+#ifdef _WIN32
+	(void)t;
+#else
+	pthread_join(t, NULL);
+#endif
+}
+
+inline int cpuCount() {
+#ifdef _WIN32
+	int n = 1;
+#else
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return n > 0 ? n : 1;
+}
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef TOOLS_H
+#define TOOLS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "point_search.h"
+#include "iqsort.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <dlfcn.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* Shared helpers for the command line tools: loading engine DLLs, loading or generating point sets and queries,
+brute-force reference answers, timing and latency percentiles. */
+
+// ENGINES ----------------------------------------------------------------------------------------
+
+struct Engine {
+	const char* name;
+	void* lib;
+	T_create create;
+	T_search search;
+	T_destroy destroy;
+};
+
+inline void* engineSymbol(Engine* e, const char* name) {
+#ifdef _WIN32
+	return (void*)GetProcAddress((HMODULE)e->lib, name);
+#else
+	return dlsym(e->lib, name);
+#endif
+}
+
+/* Load the engine DLL at "path". Return false if it can't be loaded or doesn't export create, search and destroy. */
+inline bool loadEngine(Engine* e, const char* path) {
+	e->name = path;
+#ifdef _WIN32
+	e->lib = (void*)LoadLibraryA(path);
+#else
+	e->lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+#endif
+	if (!e->lib) return false;
+
+	e->create = (T_create)engineSymbol(e, "create");
+	e->search = (T_search)engineSymbol(e, "search");
+	e->destroy = (T_destroy)engineSymbol(e, "destroy");
+	return e->create && e->search && e->destroy;
+}
+
+inline void unloadEngine(Engine* e) {
+#ifdef _WIN32
+	FreeLibrary((HMODULE)e->lib);
+#else
+	dlclose(e->lib);
+#endif
+}
+
+// DATASETS ---------------------------------------------------------------------------------------
+
+inline uint64_t nextRandom(uint64_t* state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+inline float randomFloat(uint64_t* state, float lo, float hi) {
+	return lo + (hi - lo) * (float)((nextRandom(state) >> 40) / (double)(1 << 24));
+}
+
+inline float randomNormal(uint64_t* state) {
+	float u = randomFloat(state, 1e-7f, 1);
+	float v = randomFloat(state, 0, 6.2831853f);
+	return sqrtf(-2 * logf(u)) * cosf(v);
+}
+
+// shuffle unique ranks 0..n-1 over the points and give them random ids
+inline void assignRanks(Point* points, int64_t n, uint64_t* state) {
+	for (int64_t i = 0; i < n; i++) {
+		points[i].id = (int8_t)nextRandom(state);
+		points[i].rank = (int32_t)i;
+	}
+	for (int64_t i = n - 1; i > 0; i--) {
+		int64_t j = nextRandom(state) % (i + 1);
+		int32_t r = points[i].rank;
+		points[i].rank = points[j].rank;
+		points[j].rank = r;
+	}
+}
+
+/* Generate n points with unique shuffled ranks in [-1, 1] x [-1, 1]. "kind" is one of
+	uniform     uniformly distributed
+	clustered   gaussian clusters of varying size and weight
+	duplicates  coordinates snapped to a 256 x 256 lattice, so many points share x, y or both
+Return NULL for an unknown kind. */
+inline Point* generatePoints(const char* kind, int64_t n, uint64_t seed) {
+	uint64_t state = seed * 2654435761u + 1;
+	Point* points = (Point*)malloc((n > 0 ? n : 1) * sizeof(Point));
+
+	if (strcmp(kind, "uniform") == 0) {
+		for (int64_t i = 0; i < n; i++) {
+			points[i].x = randomFloat(&state, -1, 1);
+			points[i].y = randomFloat(&state, -1, 1);
+		}
+	} else if (strcmp(kind, "clustered") == 0) {
+		const int clusters = 64;
+		float cx[clusters], cy[clusters], sd[clusters];
+		for (int c = 0; c < clusters; c++) {
+			cx[c] = randomFloat(&state, -0.9f, 0.9f);
+			cy[c] = randomFloat(&state, -0.9f, 0.9f);
+			sd[c] = powf(10, randomFloat(&state, -3, -1));
+		}
+		for (int64_t i = 0; i < n; i++) {
+			// low numbered clusters get more points
+			int c = (int)(clusters * powf(randomFloat(&state, 0, 1), 2));
+			float x = cx[c] + sd[c] * randomNormal(&state);
+			float y = cy[c] + sd[c] * randomNormal(&state);
+			points[i].x = x < -1 ? -1 : (x > 1 ? 1 : x);
+			points[i].y = y < -1 ? -1 : (y > 1 ? 1 : y);
+		}
+	} else if (strcmp(kind, "duplicates") == 0) {
+		for (int64_t i = 0; i < n; i++) {
+			points[i].x = -1 + (nextRandom(&state) % 256) / 127.5f;
+			points[i].y = -1 + (nextRandom(&state) % 256) / 127.5f;
+		}
+	} else {
+		free(points);
+		return NULL;
+	}
+
+	assignRanks(points, n, &state);
+	return points;
+}
+
+/* Read a file of packed Points. Return NULL if it can't be read. */
+inline Point* readPoints(const char* path, int64_t* n) {
+	FILE* f = fopen(path, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	*n = ftell(f) / (int64_t)sizeof(Point);
+	fseek(f, 0, SEEK_SET);
+
+	Point* points = (Point*)malloc((*n > 0 ? *n : 1) * sizeof(Point));
+	*n = fread(points, sizeof(Point), *n, f);
+	fclose(f);
+	return points;
+}
+
+inline bool writePoints(const char* path, const Point* points, int64_t n) {
+	FILE* f = fopen(path, "wb");
+	if (!f) return false;
+	bool ok = fwrite(points, sizeof(Point), n, f) == (size_t)n;
+	fclose(f);
+	return ok;
+}
+
+/* Load a dataset given either as a file of packed Points or as "KIND:N[:SEED]" for generatePoints. */
+inline Point* loadDataset(const char* spec, int64_t* n) {
+	const char* colon = strchr(spec, ':');
+	if (colon && colon - spec < 16 && colon[1] >= '0' && colon[1] <= '9') {
+		char kind[16];
+		memcpy(kind, spec, colon - spec);
+		kind[colon - spec] = 0;
+		char* end;
+		*n = strtoll(colon + 1, &end, 10);
+		uint64_t seed = (*end == ':') ? strtoull(end + 1, NULL, 10) : 1;
+		return generatePoints(kind, *n, seed);
+	}
+	return readPoints(spec, n);
+}
+
+/* Bounding box of the points. */
+inline void pointBounds(const Point* points, int64_t n, Rect* bounds) {
+	bounds->lx = bounds->ly = 1e30f;
+	bounds->hx = bounds->hy = -1e30f;
+	for (int64_t i = 0; i < n; i++) {
+		if (points[i].x < bounds->lx) bounds->lx = points[i].x;
+		if (points[i].x > bounds->hx) bounds->hx = points[i].x;
+		if (points[i].y < bounds->ly) bounds->ly = points[i].y;
+		if (points[i].y > bounds->hy) bounds->hy = points[i].y;
+	}
+}
+
+/* Generate n rects inside "bounds" whose sides are log-uniform between 1e-4 and 1 of the extent, so every search path
+gets exercised. */
+inline Rect* generateQueries(int64_t n, const Rect* bounds, uint64_t seed) {
+	uint64_t state = seed * 2654435761u + 7;
+	float ew = bounds->hx - bounds->lx;
+	float eh = bounds->hy - bounds->ly;
+	Rect* rects = (Rect*)malloc((n > 0 ? n : 1) * sizeof(Rect));
+	for (int64_t i = 0; i < n; i++) {
+		float w = ew * powf(10, -randomFloat(&state, 0, 4));
+		float h = eh * powf(10, -randomFloat(&state, 0, 4));
+		rects[i].lx = randomFloat(&state, bounds->lx, bounds->hx - w);
+		rects[i].ly = randomFloat(&state, bounds->ly, bounds->hy - h);
+		rects[i].hx = rects[i].lx + w;
+		rects[i].hy = rects[i].ly + h;
+	}
+	return rects;
+}
+
+// restore the max-heap on rank below out[i]
+inline void siftDown(Point* out, int32_t n, int32_t i) {
+	while (true) {
+		int32_t c = 2 * i + 1;
+		if (c >= n) return;
+		if (c + 1 < n && out[c+1].rank > out[c].rank) c++;
+		if (out[i].rank >= out[c].rank) return;
+		Point t = out[i]; out[i] = out[c]; out[c] = t;
+		i = c;
+	}
+}
+
+/* Reference answer: the "count" smallest ranked points in rect, smallest first, by checking every point. Candidates are
+kept in a max-heap on rank so large counts stay cheap. */
+inline int32_t bruteForce(const Point* points, int64_t n, const Rect* rect, int32_t count, Point* out) {
+	int32_t hits = 0;
+	if (count <= 0) return 0;
+	for (int64_t i = 0; i < n; i++) {
+		const Point* p = &points[i];
+		if (!(p->x >= rect->lx && p->x <= rect->hx && p->y >= rect->ly && p->y <= rect->hy)) continue;
+		if (hits < count) {
+			out[hits++] = *p;
+			if (hits == count) for (int32_t j = count / 2 - 1; j >= 0; j--) siftDown(out, count, j);
+			continue;
+		}
+		if (p->rank >= out[0].rank) continue;
+		out[0] = *p;
+		siftDown(out, count, 0);
+	}
+
+	#define tool_rank_lt(a,b) ((a)->rank < (b)->rank)
+	QSORT(Point, out, hits, tool_rank_lt);
+	return hits;
+}
+
+/* Reference count: the number of points in rect. */
+inline int64_t bruteCount(const Point* points, int64_t n, const Rect* rect) {
+	int64_t inside = 0;
+	for (int64_t i = 0; i < n; i++) {
+		const Point* p = &points[i];
+		inside += p->x >= rect->lx && p->x <= rect->hx && p->y >= rect->ly && p->y <= rect->hy;
+	}
+	return inside;
+}
+
+// MEASUREMENT -----------------------------------------------------------------------------------------
+
+/* Bytes of memory committed by this process, to measure engines that don't export stats. */
+inline int64_t processBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS_EX pmc;
+	GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc));
+	return (int64_t)pmc.PrivateUsage;
+#else
+	long pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (!f) return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+	fclose(f);
+	return (int64_t)resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/* Bytes of this process backed by huge pages, transparent or hugetlbfs, or 0 where that can't be read. */
+inline int64_t hugePageBytes() {
+#ifdef _WIN32
+	return 0;
+#else
+	FILE* f = fopen("/proc/self/smaps_rollup", "r");
+	if (!f) return 0;
+	char line[256];
+	int64_t kb = 0;
+	while (fgets(line, sizeof(line), f)) {
+		long v;
+		if (sscanf(line, "AnonHugePages: %ld", &v) == 1) kb += v;
+		else if (sscanf(line, "Private_Hugetlb: %ld", &v) == 1) kb += v;
+		else if (sscanf(line, "Shared_Hugetlb: %ld", &v) == 1) kb += v;
+	}
+	fclose(f);
+	return kb * 1024;
+#endif
+}
+
+/* Counter of this thread's data TLB load misses, or -1 where the platform (or a virtual machine) doesn't expose one. */
+inline int tlbCounterOpen() {
+#ifdef _WIN32
+	return -1;
+#else
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+inline int64_t tlbCounterRead(int counter) {
+	int64_t misses = 0;
+#ifndef _WIN32
+	if (counter < 0 || read(counter, &misses, sizeof(misses)) != sizeof(misses)) return 0;
+#endif
+	return misses;
+}
+
+inline void tlbCounterClose(int counter) {
+#ifndef _WIN32
+	if (counter >= 0) close(counter);
+#endif
+}
+
+/* Monotonic time in nanoseconds. */
+inline double nowNs() {
+#ifdef _WIN32
+	static LARGE_INTEGER freq = {0};
+	if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return (double)t.QuadPart * 1e9 / (double)freq.QuadPart;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+#endif
+}
+
+inline void sortDoubles(double* arr, unsigned n) {
+	#define double_lt(a,b) (*(a) < *(b))
+	QSORT(double, arr, n, double_lt);
+}
+
+/* Value at fraction "p" of an ascending array. */
+inline double percentile(const double* sorted, int64_t n, double p) {
+	if (n == 0) return 0;
+	int64_t i = (int64_t)(p * (n - 1) + 0.5);
+	return sorted[i];
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "point_search.h"
+
+#define TRACEMAGIC 0x43525447  // "GTRC"
+#define TRACEVERSION 1
+#define TRACEBUFFER 4096
+
+#pragma pack(push, 1)
+
+/* Start of a trace file, followed by TraceRecords until the end of the file. */
+struct TraceHeader {
+	int32_t magic;
+	int32_t version;
+	int64_t N;     // points in the context the trace was recorded on
+	Rect bounds;   // bounds of those points, used to check a replay dataset matches
+};
+
+/* One search call. "path" is the engine's SearchPath for the query, or -1 if the engine doesn't report one. */
+struct TraceRecord {
+	Rect rect;
+	int32_t count;
+	int32_t hits;
+	int8_t path;
+	int64_t cycles;  // TSC ticks spent in the search, 0 if not measured
+};
+
+#pragma pack(pop)
+
+/* Buffered trace file writer, so recording costs a memcpy per search and one fwrite per TRACEBUFFER searches. */
+struct TraceWriter {
+	FILE* f;
+	int n;
+	TraceRecord buf[TRACEBUFFER];
+};
+
+inline TraceWriter* traceOpen(const char* path, int64_t N, const Rect* bounds) {
+	FILE* f = fopen(path, "wb");
+	if (!f) return NULL;
+
+	TraceHeader h;
+	h.magic = TRACEMAGIC;
+	h.version = TRACEVERSION;
+	h.N = N;
+	memset(&h.bounds, 0, sizeof(Rect));
+	if (bounds) h.bounds = *bounds;
+	fwrite(&h, sizeof(TraceHeader), 1, f);
+
+	TraceWriter* w = (TraceWriter*)malloc(sizeof(TraceWriter));
+	w->f = f;
+	w->n = 0;
+	return w;
+}
+
+inline void traceFlush(TraceWriter* w) {
+	if (w->n > 0) fwrite(w->buf, sizeof(TraceRecord), w->n, w->f);
+	w->n = 0;
+}
+
+inline void traceAppend(TraceWriter* w, const Rect* rect, int32_t count, int32_t hits, int path, int64_t cycles) {
+	TraceRecord* r = &w->buf[w->n];
+	r->rect = *rect;
+	r->count = count;
+	r->hits = hits;
+	r->path = (int8_t)path;
+	r->cycles = cycles;
+	if (++w->n == TRACEBUFFER) traceFlush(w);
+}
+
+inline void traceClose(TraceWriter* w) {
+	traceFlush(w);
+	fclose(w->f);
+	free(w);
+}
+
+/* Read a whole trace file. Return the records (caller frees) and their number in "n", or NULL if the file can't be
+read or isn't a trace. */
+inline TraceRecord* traceLoad(const char* path, TraceHeader* header, int64_t* n) {
+	FILE* f = fopen(path, "rb");
+	if (!f) return NULL;
+	if (fread(header, sizeof(TraceHeader), 1, f) != 1 || header->magic != TRACEMAGIC || header->version != TRACEVERSION) {
+		fclose(f);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	int64_t len = ftell(f) - (int64_t)sizeof(TraceHeader);
+	fseek(f, sizeof(TraceHeader), SEEK_SET);
+
+	*n = len / (int64_t)sizeof(TraceRecord);
+	TraceRecord* records = (TraceRecord*)malloc((*n > 0 ? *n : 1) * sizeof(TraceRecord));
+	*n = fread(records, sizeof(TraceRecord), *n, f);
+	fclose(f);
+	return records;
+}
+
+#endif